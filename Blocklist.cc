@@ -0,0 +1,162 @@
+// Include files
+#include <cstring>
+#include <algorithm>
+
+#include "common.h"
+#include "Blocklist.h"
+
+// Static member definitions
+const char Blocklist::MAGIC[8] = { 'D', 'N', 'S', 'P', 'B', 'L', 'K', '1' };
+const uint32_t Blocklist::BYTE_ORDER_MARK;
+
+// Program code
+Blocklist::Blocklist():
+	map(NULL),
+	size(0),
+	header(NULL),
+	bloom(NULL),
+	hashes(NULL)
+{
+	// NOP
+}
+
+Blocklist::~Blocklist()
+{
+	if (this->map)
+		common::Unmap_file(this->map, this->size);
+}
+
+bool Blocklist::Load(const char *fname)
+{
+	if (!(this->map = common::Map_file(fname, &this->size)))
+		return false;
+
+	this->header = reinterpret_cast<const header_st *>(this->map);
+	if (this->size < sizeof(*this->header)
+	    || memcmp(this->header->magic, MAGIC, sizeof(MAGIC)))
+	{
+		common::Log_error("%s: not a blocklist", fname);
+		return false;
+	} else if (this->header->byte_order != BYTE_ORDER_MARK)
+	{
+		common::Log_error("%s: wrong byte order", fname);
+		return false;
+	}
+
+	// The Bloom filter must be a power of 2 words.
+	const uint64_t nwords = this->header->bloom_words;
+	if (!nwords || (nwords & (nwords - 1))
+	    || !this->header->nhashes
+	    || this->header->size != this->size
+	    || (this->size - sizeof(*this->header)) / sizeof(uint64_t)
+		< nwords + this->header->nnames)
+	{
+		common::Log_error("%s: corrupt blocklist", fname);
+		return false;
+	}
+
+	this->bloom = reinterpret_cast<const uint64_t *>
+		(&this->map[sizeof(*this->header)]);
+	this->hashes = &this->bloom[nwords];
+	return true;
+}
+
+unsigned Blocklist::Suffix_hashes(const char *qname, size_t sqname,
+				  uint64_t *hashes)
+{
+	// Find where the labels start.
+	unsigned nlabels = 0;
+	size_t labels[MAX_LABELS];
+	for (size_t off = 0; off < sqname && nlabels < MAX_LABELS; )
+	{
+		unsigned llabel = static_cast<uint8_t>(qname[off]);
+		if (!llabel)
+			break;
+
+		// DNSMessage accepts a compression pointer at the end
+		// of a QNAME.  Then its suffixes are unknown, so none
+		// of them can match, like in Routes::Lookup().
+		if ((llabel & NS_CMPRSFLGS) || off + 1 + llabel > sqname)
+			return 0;
+		labels[nlabels++] = off;
+		off += 1 + llabel;
+	}
+
+	// Hash the labels from right to left, so the hash of a suffix
+	// is the hash of its parent continued with its first label.
+	// It's FNV-1a finalized with the mixer of splitmix64.
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (unsigned i = nlabels; i-- > 0; )
+	{
+		const char *label = &qname[labels[i]];
+		unsigned llabel = static_cast<uint8_t>(label[0]);
+		for (unsigned o = 0; o <= llabel; o++)
+		{
+			char c = label[o];
+			if (c >= 'A' && c <= 'Z')
+				c |= 0x20;
+			hash ^= static_cast<uint8_t>(c);
+			hash *= 0x100000001b3ull;
+		}
+
+		uint64_t mixed = hash;
+		mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ull;
+		mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebull;
+		hashes[i] = mixed ^ (mixed >> 31);
+	}
+
+	return nlabels;
+}
+
+uint64_t Blocklist::Bloom_bit(uint64_t hash, unsigned i, uint64_t nbits)
+{
+	// Double hashing: the two halves of @hash give the start and
+	// the stride.
+	uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+	return (h1 + static_cast<uint64_t>(i) * h2) & (nbits - 1);
+}
+
+// Look up @hash in the sorted @hashes.  Since they're uniformly distributed
+// interpolation finds the neighborhood, which is then binary searched.
+bool Blocklist::find(uint64_t hash) const
+{
+	const uint64_t n = this->header->nnames;
+	if (!n)
+		return false;
+
+	uint64_t guess = static_cast<uint64_t>(
+		(static_cast<unsigned __int128>(hash) * n) >> 64);
+	uint64_t lo = guess >= 64 ? guess - 64 : 0;
+	uint64_t hi = std::min(guess + 64, n);
+	if (this->hashes[lo] > hash)
+		lo = 0;
+	if (hi < n && this->hashes[hi] <= hash)
+		hi = n;
+
+	return std::binary_search(&this->hashes[lo], &this->hashes[hi],
+				  hash);
+}
+
+bool Blocklist::Match(const char *qname, size_t sqname) const
+{
+	uint64_t hashes[MAX_LABELS];
+	unsigned nhashes = Suffix_hashes(qname, sqname, hashes);
+
+	const uint64_t nbits = this->header->bloom_words * 64;
+	for (unsigned i = 0; i < nhashes; i++)
+	{	// Check the Bloom filter first.
+		bool maybe = true;
+		for (unsigned o = 0; o < this->header->nhashes && maybe; o++)
+		{
+			uint64_t bit = Bloom_bit(hashes[i], o, nbits);
+			maybe = this->bloom[bit / 64] & (1ull << (bit % 64));
+		}
+
+		if (maybe && find(hashes[i]))
+			return true;
+	}
+
+	return false;
+}
+
+// End of Blocklist.cc
@@ -0,0 +1,76 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <arpa/nameser.h>
+
+// Class matching query names against a large list of blocked domains,
+// including all their subdomains.  The list is memory-mapped from a file
+// created by mkdnsdb -b, which consists of a Bloom filter and the sorted
+// hashes of the blocked names.  Every suffix of a QNAME is looked up:
+// the Bloom filter makes misses cheap and the hashes confirm the hits.
+class Blocklist
+{
+public:
+	// Layout of the file: the header is followed by the Bloom filter
+	// of @bloom_words, then the @nnames sorted hashes.  All numbers
+	// are in host byte order, which is checked through @byte_order.
+	struct header_st
+	{
+		char magic[8];
+		uint32_t byte_order;
+		uint32_t nhashes;
+		uint64_t bloom_words;
+		uint64_t nnames;
+		uint64_t size;
+	};
+
+	static const char MAGIC[8];
+	static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+	// A name can't have more labels than this.
+	static const unsigned MAX_LABELS = NS_MAXCDNAME / 2;
+
+protected:
+	// The mapped file.
+	const char *map;
+	size_t size;
+
+	const struct header_st *header;
+	const uint64_t *bloom;
+	const uint64_t *hashes;
+
+public:
+	// The file must be Load()ed before the object can be used.
+	Blocklist();
+	~Blocklist();
+
+	// Map @fname and check its header.  Returns false on error.
+	bool Load(const char *fname);
+
+	// Number of blocked domains.
+	uint64_t Count() const { return this->header->nnames; }
+
+	// Whether @qname (in wire format) or any of its parent domains
+	// is blocked.
+	bool Match(const char *qname, size_t sqname) const;
+
+	// Compute the hash of each suffix of @qname from the longest
+	// to the shortest (excluding the root) into @hashes, which must
+	// have room for MAX_LABELS.  The names are compared
+	// case-insensitively.  Returns the number of hashes, 0 if @qname
+	// is compressed.
+	static unsigned Suffix_hashes(const char *qname, size_t sqname,
+				      uint64_t *hashes);
+
+	// Return the @i:th bit position of @hash in a Bloom filter of
+	// @nbits, which is a power of 2.
+	static uint64_t Bloom_bit(uint64_t hash, unsigned i, uint64_t nbits);
+
+protected:
+	bool find(uint64_t hash) const;
+};
+
+#endif // ! BLOCKLIST_H
@@ -0,0 +1,75 @@
+// Include files
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+#include "CongestionWindow.h"
+
+// Static member definitions
+const unsigned CongestionWindow::MIN_LIMIT;
+const unsigned CongestionWindow::INITIAL_LIMIT;
+const unsigned CongestionWindow::SHORT_SAMPLES;
+const unsigned CongestionWindow::LONG_SAMPLES;
+constexpr double CongestionWindow::TOLERANCE;
+constexpr double CongestionWindow::SMOOTHING;
+
+// Program code
+CongestionWindow::CongestionWindow(unsigned max_limit):
+	MAX_LIMIT(std::max(max_limit, MIN_LIMIT)),
+	limit(std::min(INITIAL_LIMIT, MAX_LIMIT))
+{
+	// NOP
+}
+
+void CongestionWindow::Released()
+{
+	assert(this->inflight > 0);
+	this->inflight--;
+}
+
+void CongestionWindow::Answered(Latency::duration rtt)
+{
+	double sample = std::max(rtt.count(), Latency::duration::rep(1));
+
+	if (!this->long_rtt)
+		this->short_rtt = this->long_rtt = sample;
+	else
+	{
+		this->short_rtt += (sample - this->short_rtt) / SHORT_SAMPLES;
+		this->long_rtt  += (sample - this->long_rtt)  / LONG_SAMPLES;
+	}
+
+	// After an overload the long-term average is inflated, which would
+	// hide the next one for a long time.
+	if (this->long_rtt > 2 * this->short_rtt)
+		this->long_rtt *= 0.95;
+
+	double gradient = std::max(0.5, std::min(1.0,
+		TOLERANCE * this->long_rtt / this->short_rtt));
+
+	// Don't grow the @limit if it's not being used.
+	if (gradient >= 1.0 && this->inflight < this->limit / 2)
+		return;
+
+	// The target leaves room for a queue of sqrt(@limit) queries, so
+	// the @limit keeps probing for more capacity.  Each sample moves
+	// the @limit by 1/@limit of the way, so it's SMOOTHING of the way
+	// per round-trip.
+	double target = this->limit * gradient + std::sqrt(this->limit);
+	this->limit += SMOOTHING * (target - this->limit) / this->limit;
+	this->limit = std::max(double(MIN_LIMIT),
+			       std::min(double(MAX_LIMIT), this->limit));
+}
+
+void CongestionWindow::Expired(std::chrono::steady_clock::time_point sent)
+{	// The queries sent before the previous decrease were sent with
+	// the larger @limit, so they don't tell anything new.
+	if (sent < this->decreased)
+		return;
+
+	this->limit = std::max(double(MIN_LIMIT), this->limit / 2);
+	this->decreased = std::chrono::steady_clock::now();
+	this->ntimeouts++;
+}
+
+// End of CongestionWindow.cc
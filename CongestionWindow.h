@@ -0,0 +1,73 @@
+#ifndef CONGESTION_WINDOW_H
+#define CONGESTION_WINDOW_H
+
+#include <chrono>
+
+#include "Latency.h"
+
+// Class limiting the number of queries in flight to an upstream server
+// to what it can answer without queueing them, like the gradient2 limiter
+// of Netflix's concurrency-limits.  The round-trip times are averaged over
+// a short and a long term.  While the short-term average stays within
+// @TOLERANCE of the long-term one, the server isn't overloaded and the
+// @limit grows by about its square root per round-trip; when it rises
+// above, the @limit shrinks in proportion.  Comparing to the long-term
+// average rather than the minimum keeps the mix of cache hits and misses
+// of a recursive server from looking like congestion.  Queries timing
+// out halve the @limit, at most once per round-trip like TCP does.
+class CongestionWindow
+{
+protected:
+	static const unsigned MIN_LIMIT = 4;
+	static const unsigned INITIAL_LIMIT = 20;
+
+	// The number of samples the short and long-term averages follow.
+	static const unsigned SHORT_SAMPLES = 8;
+	static const unsigned LONG_SAMPLES = 512;
+
+	// How much the short-term average may exceed the long-term one
+	// before the @limit is decreased, and how fast the @limit follows
+	// its target.
+	static constexpr double TOLERANCE = 1.5;
+	static constexpr double SMOOTHING = 0.2;
+
+	// Initialized from command line options.
+	const unsigned MAX_LIMIT;
+
+	double limit;
+	unsigned inflight = 0;
+
+	// Exponential moving averages of the round-trip times in us.
+	double short_rtt = 0, long_rtt = 0;
+
+	// Only queries sent after this are considered for another
+	// decrease on timeout.
+	std::chrono::steady_clock::time_point decreased;
+
+public:
+	// Statistics: the number of decreases because of timeouts and
+	// the number of queries which couldn't be forwarded because the
+	// window was closed.
+	unsigned long long ntimeouts = 0, nclosed = 0;
+
+	// The @limit never exceeds @max_limit.
+	CongestionWindow(unsigned max_limit);
+
+	// Whether another query can be sent.
+	bool Open() const { return this->inflight < Limit(); }
+	unsigned Limit() const { return this->limit; }
+	unsigned Inflight() const { return this->inflight; }
+
+	// Called when a query is sent and when it's done, either answered
+	// or expired.
+	void Sent() { this->inflight++; }
+	void Released();
+
+	// Adjust the @limit to the @rtt of an answered query.
+	void Answered(Latency::duration rtt);
+
+	// Called when a query @sent at that time has expired.
+	void Expired(std::chrono::steady_clock::time_point sent);
+};
+
+#endif // ! CONGESTION_WINDOW_H
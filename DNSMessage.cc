@@ -0,0 +1,389 @@
+// Include files
+#include <cstring>
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include "DNSMessage.h"
+
+// Static member definitions
+const uint16_t DNSMessage::UDP_SIZE;
+
+// Program code
+// Read a 16-bit big-endian number from @p.
+static inline uint16_t get16(const char *p)
+{
+	const uint8_t *u = reinterpret_cast<const uint8_t *>(p);
+	return (u[0] << 8) | u[1];
+}
+
+// Advance *@offp past the domain name it points to.  Names in the question
+// section are not expected to be compressed, but if they are, the pointer
+// is skipped as well (we don't need to know the name it points to).
+const char *DNSMessage::skip_name(size_t *offp, bool is_question) const
+{
+	size_t off = *offp;
+
+	// A name is a sequence of labels, terminated by the root label
+	// (which is the empty string) or a compression pointer.
+	for (;;)
+	{
+		if (off >= this->size)
+			return is_question
+				? "unterminated QNAME" : "unterminated name";
+
+		unsigned llabel = *reinterpret_cast<const uint8_t *>
+				   (&this->msg[off]);
+		if (llabel == 0)
+		{	// We've reached the root label.
+			off++;
+			break;
+		} else if ((llabel & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+		{	// Compression pointer, which is two bytes long.
+			if (this->size - off < 2)
+				return "truncated compression pointer";
+			off += 2;
+			break;
+		} else if (llabel & NS_CMPRSFLGS)
+			return "invalid label type";
+
+		// A label is a string, preceded by a single byte
+		// representing the label's length.
+		if (this->size - off - 1 < llabel)
+			return is_question
+				? "truncated QNAME" : "truncated name";
+		off += 1 + llabel;
+
+		// Leave room for the root label.
+		if (off - *offp >= NS_MAXCDNAME)
+			return "name too long";
+	}
+
+	*offp = off;
+	return NULL;
+}
+
+const char *DNSMessage::Parse(const char *msg, size_t smsg)
+{
+	const char *error;
+
+	*this = DNSMessage();
+	this->msg = msg;
+	this->size = smsg;
+
+	if (smsg < NS_HFIXEDSZ)
+		return "incomplete header";
+	const dns_header_st *header = Header();
+
+	// Parse the question section of @msg.  There can be multiple
+	// questions in a DNS query, or none at all (eg. when doing a
+	// dynamic DNS update).
+	size_t off = this->question_begin = NS_HFIXEDSZ;
+	for (unsigned i = ntohs(header->qdcount); i > 0; i--)
+	{
+		size_t qname = off;
+		if ((error = skip_name(&off, true)) != NULL)
+			return error;
+
+		// The QNAME is followed by the query class and type,
+		// without padding.
+		if (smsg - off < NS_QFIXEDSZ)
+			return "truncated QUESTION section";
+
+		if (qname == this->question_begin)
+		{
+			this->qname_begin = qname;
+			this->qname_end = off;
+			this->qtype = get16(&msg[off]);
+			this->qclass = get16(&msg[off + NS_INT16SZ]);
+		}
+
+		off += NS_QFIXEDSZ;
+	}
+	this->question_end = off;
+
+	// Walk through the rest of the resource records to see that they're
+	// well-formed and find the OPT and TSIG records.
+	unsigned nrrs = ntohs(header->ancount) + ntohs(header->nscount);
+	unsigned narrs = ntohs(header->arcount);
+	for (unsigned i = 0; i < nrrs + narrs; i++)
+	{
+		size_t rr = off;
+		if ((error = skip_name(&off, false)) != NULL)
+			return error;
+
+		if (smsg - off < NS_RRFIXEDSZ)
+			return "truncated resource record";
+		uint16_t type = get16(&msg[off]);
+		uint16_t rrclass = get16(&msg[off + NS_INT16SZ]);
+		uint16_t rdlength = get16(&msg[off + 2*NS_INT16SZ
+						 + NS_INT32SZ]);
+		off += NS_RRFIXEDSZ;
+
+		if (smsg - off < rdlength)
+			return "truncated RDATA";
+		off += rdlength;
+
+		// OPT and TSIG are only valid in the additional section.
+		if (i < nrrs)
+			continue;
+
+		if (type == ns_t_opt)
+		{
+			if (this->opt_begin)
+				return "multiple OPT records";
+			this->opt_begin = rr;
+			this->opt_end = off;
+			this->udp_size = rrclass;
+		} else if (type == ns_t_tsig)
+		{
+			if (i != nrrs + narrs - 1)
+				return "TSIG is not the last record";
+			this->has_tsig = true;
+		}
+	}
+
+	return NULL;
+}
+
+uint16_t DNSMessage::Id() const
+{
+	return ntohs(Header()->id);
+}
+
+unsigned DNSMessage::Qdcount() const
+{
+	return ntohs(Header()->qdcount);
+}
+
+void DNSMessage::Answer(std::vector<char> &response, unsigned rcode,
+			const char *rrs, size_t srrs, unsigned nrrs) const
+{
+	// An OPT record with our payload size and no options.
+	static const unsigned char opt[] =
+	{
+		0,				// root name
+		0, ns_t_opt,			// TYPE
+		UDP_SIZE >> 8, UDP_SIZE & 0xFF,	// CLASS
+		0, 0, 0, 0,			// TTL: extended RCODE
+		0, 0,				// RDLENGTH
+	};
+
+	// Truncate the response if it wouldn't fit.
+	size_t limit = this->over_stream ? NS_MAXMSG : Max_udp_response();
+	size_t sopt = this->opt_begin ? sizeof(opt) : 0;
+	bool truncated = NS_HFIXEDSZ + Question_size() + srrs + sopt > limit;
+	if (truncated)
+		srrs = nrrs = 0;
+
+	response.resize(NS_HFIXEDSZ + Question_size() + srrs + sopt);
+	memcpy(&response[0], this->msg, NS_HFIXEDSZ);
+	memcpy(&response[NS_HFIXEDSZ], Question(), Question_size());
+	if (srrs)
+		memcpy(&response[NS_HFIXEDSZ + Question_size()], rrs, srrs);
+	if (sopt)
+		memcpy(&response[response.size() - sopt], opt, sopt);
+
+	// Keep the ID, OPCODE, RD and CD bits of the query.
+	dns_header_st *header = reinterpret_cast<dns_header_st *>
+		(&response[0]);
+	header->qr = 1;
+	header->aa = 1;
+	header->tc = truncated;
+	header->ra = 1;
+	header->unused = 0;
+	header->ad = 0;
+	header->rcode = rcode;
+	header->ancount = htons(nrrs);
+	header->nscount = 0;
+	header->arcount = htons(sopt ? 1 : 0);
+}
+
+bool DNSMessage::Limit_udp_size(uint16_t udp_size)
+{
+	if (!this->opt_begin || this->has_tsig || this->udp_size <= udp_size)
+		return false;
+
+	// The CLASS of the OPT record follows its (root) name and TYPE.
+	char *msg = const_cast<char *>(this->msg);
+	size_t off = this->opt_begin
+		+ Name_size(&msg[this->opt_begin],
+			    this->size - this->opt_begin)
+		+ NS_INT16SZ;
+	msg[off]     = udp_size >> 8;
+	msg[off + 1] = udp_size & 0xFF;
+	this->udp_size = udp_size;
+	return true;
+}
+
+size_t DNSMessage::Truncate(size_t limit)
+{
+	if (this->size <= limit || this->has_tsig)
+		return this->size;
+
+	// The OPT record, which is the only one kept, is moved right
+	// after the question section.
+	char *msg = const_cast<char *>(this->msg);
+	size_t sopt = this->opt_end - this->opt_begin;
+	if (sopt)
+		memmove(&msg[this->question_end], &msg[this->opt_begin], sopt);
+
+	dns_header_st *header = reinterpret_cast<dns_header_st *>(msg);
+	header->tc = 1;
+	header->ancount = header->nscount = 0;
+	header->arcount = htons(sopt ? 1 : 0);
+	return this->question_end + sopt;
+}
+
+bool DNSMessage::Question_equals(const std::vector<char> &question) const
+{
+	return question.size() == Question_size()
+		&& !memcmp(Question(), question.data(), question.size());
+}
+
+bool DNSMessage::Question_equals_nocase(
+			const std::vector<char> &question) const
+{	// The first QNAME is at the beginning of the question section.
+	size_t sqname = Qname_size();
+	return question.size() == Question_size()
+		&& Equal_nocase(Question(), question.data(), sqname)
+		&& !memcmp(Question() + sqname, question.data() + sqname,
+			   question.size() - sqname);
+}
+
+std::string DNSMessage::Name_str(const char *name, size_t sname)
+{
+	std::string qname;
+
+	// (International names aren't decoded.)
+	const char *p = name, *end = name + sname;
+	while (p < end)
+	{
+		unsigned llabel = *reinterpret_cast<const uint8_t *>(p);
+		if (!llabel)
+			break;
+		if (!qname.empty())
+			qname.append(1, '.');
+		if ((llabel & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+		{	// We don't follow compression pointers.
+			qname.append("...");
+			break;
+		}
+		qname.append(p + 1, llabel);
+		p += 1 + llabel;
+	}
+
+	return qname.empty() ? "." : qname;
+}
+
+size_t DNSMessage::Name_size(const char *buf, size_t sbuf)
+{
+	size_t off = 0;
+
+	while (off < sbuf)
+	{
+		unsigned llabel = *reinterpret_cast<const uint8_t *>(&buf[off]);
+		if (!llabel)
+			return off + 1;
+		else if ((llabel & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+			return off + 2;
+		off += 1 + llabel;
+	}
+
+	return sbuf;
+}
+
+void DNSMessage::Fold_case(char *dst, const char *src, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Process 16 bytes at a time.  Bytes >= 0x80 are negative
+	// in the signed comparisons, so they're never in ['A', 'Z'].
+	const __m128i before_a = _mm_set1_epi8('A' - 1);
+	const __m128i after_z = _mm_set1_epi8('Z' + 1);
+	const __m128i lowercase = _mm_set1_epi8(0x20);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(
+			reinterpret_cast<const __m128i *>(&src[i]));
+		__m128i is_upper = _mm_and_si128(
+			_mm_cmpgt_epi8(v, before_a),
+			_mm_cmplt_epi8(v, after_z));
+		v = _mm_or_si128(v, _mm_and_si128(is_upper, lowercase));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&dst[i]), v);
+	}
+#endif
+
+	for (; i < n; i++)
+		dst[i] = src[i] >= 'A' && src[i] <= 'Z'
+			? src[i] | 0x20 : src[i];
+}
+
+bool DNSMessage::Equal_nocase(const char *lhs, const char *rhs, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Compare the lowercased bytes 16 at a time.
+	const __m128i before_a = _mm_set1_epi8('A' - 1);
+	const __m128i after_z = _mm_set1_epi8('Z' + 1);
+	const __m128i lowercase = _mm_set1_epi8(0x20);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i l = _mm_loadu_si128(
+			reinterpret_cast<const __m128i *>(&lhs[i]));
+		__m128i r = _mm_loadu_si128(
+			reinterpret_cast<const __m128i *>(&rhs[i]));
+		l = _mm_or_si128(l, _mm_and_si128(lowercase, _mm_and_si128(
+			_mm_cmpgt_epi8(l, before_a),
+			_mm_cmplt_epi8(l, after_z))));
+		r = _mm_or_si128(r, _mm_and_si128(lowercase, _mm_and_si128(
+			_mm_cmpgt_epi8(r, before_a),
+			_mm_cmplt_epi8(r, after_z))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(l, r)) != 0xFFFF)
+			return false;
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		char l = lhs[i] >= 'A' && lhs[i] <= 'Z' ? lhs[i] | 0x20 : lhs[i];
+		char r = rhs[i] >= 'A' && rhs[i] <= 'Z' ? rhs[i] | 0x20 : rhs[i];
+		if (l != r)
+			return false;
+	}
+
+	return true;
+}
+
+void DNSMessage::Flip_case(char *name, size_t sname, uint64_t mask)
+{
+	const char *end = name + sname;
+
+	while (mask && name < end)
+	{
+		unsigned llabel = *reinterpret_cast<const uint8_t *>(name);
+		if (!llabel || (llabel & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+			break;
+
+		for (char *p = name + 1; mask && p <= name + llabel && p < end;
+		     p++)
+		{
+			char lower = *p | 0x20;
+			if (lower < 'a' || lower > 'z')
+				continue;
+			if (mask & 1)
+				*p ^= 0x20;
+			mask >>= 1;
+		}
+		name += 1 + llabel;
+	}
+}
+
+// End of DNSMessage.cc
@@ -0,0 +1,156 @@
+#ifndef DNS_MESSAGE_H
+#define DNS_MESSAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <arpa/nameser.h>
+
+// Non-owning view of a DNS message in wire format.  Parse() walks the
+// message once, validates it and records the offsets of the interesting
+// parts, so the rest of the program can access them without copying.
+// The view is only valid as long as the message buffer is.
+class DNSMessage
+{
+public:
+	typedef HEADER dns_header_st;
+
+	// The message being viewed.
+	const char *msg = NULL;
+	size_t size = 0;
+
+	// The entire question section: [@question_begin, @question_end).
+	size_t question_begin = 0, question_end = 0;
+
+	// The QNAME of the first question in wire format, followed by its
+	// QTYPE and QCLASS.  @qname_begin == @qname_end if there are no
+	// questions at all (eg. in a dynamic DNS update).
+	size_t qname_begin = 0, qname_end = 0;
+	uint16_t qtype = 0, qclass = 0;
+
+	// The OPT pseudo-RR (RFC 6891) is at [@opt_begin, @opt_end) and
+	// @udp_size is the requestor's payload size from its CLASS field.
+	// @opt_begin is 0 if there's no OPT record.
+	size_t opt_begin = 0, opt_end = 0;
+	uint16_t udp_size = 0;
+
+	// Whether the message is signed with TSIG (RFC 2845), in which case
+	// it mustn't be modified.
+	bool has_tsig = false;
+
+	// Not set by Parse(): whether the message arrived over a stream
+	// transport (TCP or TLS), where responses aren't limited by
+	// @udp_size.
+	bool over_stream = false;
+
+public:
+	// Parse @msg and fill in the view.  Returns NULL on success or
+	// a static string describing what is wrong with the message.
+	const char *Parse(const char *msg, size_t smsg);
+
+	const dns_header_st *Header() const
+	{
+		return reinterpret_cast<const dns_header_st *>(this->msg);
+	}
+
+	// The query ID in host byte order.
+	uint16_t Id() const;
+
+	// Accessors of the question section.
+	const char *Question() const
+	{
+		return &this->msg[this->question_begin];
+	}
+	size_t Question_size() const
+	{
+		return this->question_end - this->question_begin;
+	}
+
+	// Build a response to this query in @response, with @rcode and
+	// the @nrrs resource records of @rrs as the answer section, whose
+	// owner names may be compression pointers to the QNAME.  If the
+	// query has an OPT record, so will the response.  If the response
+	// doesn't fit in the client's UDP payload size (unless the query
+	// arrived @over_stream), it is truncated.
+	// There must be exactly one question.
+	void Answer(std::vector<char> &response, unsigned rcode,
+		    const char *rrs = NULL, size_t srrs = 0,
+		    unsigned nrrs = 0) const;
+
+	// The UDP payload size we advertise in OPT records we generate.
+	static const uint16_t UDP_SIZE = 1232;
+
+	// The largest response the sender of this query can take over UDP.
+	size_t Max_udp_response() const
+	{
+		return this->opt_begin
+			? std::max<size_t>(this->udp_size, NS_PACKETSZ)
+			: NS_PACKETSZ;
+	}
+
+	// The following two modify the message in place, so its buffer
+	// must be writable.  The view is invalid after Truncate().
+	// Lower the payload size in the OPT record to @udp_size, unless
+	// it's smaller already or the message is signed.  Returns whether
+	// it was lowered.
+	bool Limit_udp_size(uint16_t udp_size);
+
+	// Cut the message down to the header, the question section and
+	// the OPT record and set the TC bit, if it's larger than @limit
+	// and not signed.  Returns the new size of the message.
+	size_t Truncate(size_t limit);
+
+	// Whether the question section is byte-for-byte equal to @question.
+	bool Question_equals(const std::vector<char> &question) const;
+
+	// Whether the question section is equal to @question except for
+	// the case of the first QNAME.
+	bool Question_equals_nocase(const std::vector<char> &question) const;
+
+	// Number of questions.
+	unsigned Qdcount() const;
+
+	// Accessors of the first QNAME.
+	const char *Qname() const { return &this->msg[this->qname_begin]; }
+	size_t Qname_size() const
+	{
+		return this->qname_end - this->qname_begin;
+	}
+
+	// Return the first QNAME in presentation format, for logging.
+	std::string Qname_str() const
+	{
+		return Name_str(Qname(), Qname_size());
+	}
+
+	// Return the wire-format name of @sname bytes at @name
+	// in presentation format.
+	static std::string Name_str(const char *name, size_t sname);
+
+	// Return the size of the valid wire-format name at the beginning
+	// of @sbuf bytes at @buf, including the terminating root label
+	// or compression pointer.
+	static size_t Name_size(const char *buf, size_t sbuf);
+
+	// Convert @n bytes of a wire-format name from @src to lowercase
+	// into @dst, which may be the same as @src.  Label lengths are
+	// at most 63 so they are left alone.
+	static void Fold_case(char *dst, const char *src, size_t n);
+
+	// Compare two wire-format names case-insensitively.
+	static bool Equal_nocase(const char *lhs, const char *rhs, size_t n);
+
+	// Flip the case of the i:th letter of the wire-format @name of
+	// @sname bytes if the i:th bit of @mask is set (0x20 encoding).
+	// Only the first 64 letters can be flipped.  Flipping the name
+	// again with the same @mask restores it.
+	static void Flip_case(char *name, size_t sname, uint64_t mask);
+
+protected:
+	const char *skip_name(size_t *offp, bool is_question) const;
+};
+
+#endif // ! DNS_MESSAGE_H
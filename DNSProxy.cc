@@ -1,12 +1,18 @@
 // Include files
 #include <cassert>
 #include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <ctime>
 #include <unistd.h>
 
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include <sys/ioctl.h>
+#include <linux/errqueue.h>
 
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
@@ -14,20 +20,93 @@
 #include "common.h"
 #include "Requests.h"
 #include "Upstream.h"
+#include "TLSUpstream.h"
+#include "StreamListener.h"
+#include "Hedging.h"
+#include "SocketBuffers.h"
+#include "Records.h"
+#include "Blocklist.h"
+#include "Routes.h"
+#include "Pipeline.h"
+#include "HeavyHitters.h"
+#include "CongestionWindow.h"
+#include "Synthesizer.h"
+#include "Handoff.h"
+#include "Probes.h"
 #include "DNSProxy.h"
 
+// The epoll busy-poll parameters are new in Linux 6.9.
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+# define EPIOCSPARAMS			_IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// Static member definitions
+const unsigned DNSProxy::MAX_CASE_MISMATCHES;
+const unsigned DNSProxy::RESUME_PERCENT;
+const uint64_t DNSProxy::INJECTED;
+const unsigned DNSProxy::MAX_LOAD_PERCENT;
+
 // Program code
-DNSProxy::DNSProxy(const struct config_st &config):
-	config(config)
+// The finalizer of splitmix64, which makes every bit of the result depend
+// on every bit of @x.
+static uint64_t mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+DNSProxy::DNSProxy(const struct config_st &config,
+		   Pipeline *pipeline, unsigned worker):
+	config(config),
+	pipeline(pipeline),
+	worker(worker)
 {
 	// NOP
 }
 
 DNSProxy::~DNSProxy()
 {
-	delete this->sockets;
+	for (const auto &server: this->servers)
+	{
+		delete server.sockets;
+		delete server.tls;
+		delete server.tcp;
+		delete server.window;
+	}
+	if (this->tls_ctx)
+		SSL_CTX_free(this->tls_ctx);
+	delete this->tcp_listener;
+	delete this->tls_listener;
+	if (this->tls_listener_ctx)
+		SSL_CTX_free(this->tls_listener_ctx);
+	delete this->hedging;
+	delete this->pending;
 	delete this->requests;
+	delete this->buffers;
+	delete this->local_records;
+	delete this->blocklist;
+	delete this->synthesizer;
+	delete this->route_table;
+	for (auto top: this->top)
+		delete top;
+	delete this->handoff;
 
+	if (this->handoff_conn >= 0)
+		close(this->handoff_conn);
+	if (this->handoff_fd >= 0)
+		close(this->handoff_fd);
+	if (this->sigfd >= 0)
+		close(this->sigfd);
+	if (this->hedgefd >= 0)
+		close(this->hedgefd);
 	if (this->timerfd >= 0)
 		close(this->timerfd);
 	if (this->serverfd >= 0)
@@ -56,16 +135,238 @@ bool DNSProxy::str2addr(struct sockaddr_in *saddr,
 	}
 }
 
+// Parse @addr:@port and append it to the list of upstream @servers
+// as part of @route.  The Upstream sockets are created when @pollfd
+// is ready.
+bool DNSProxy::add_server(const char *addr, unsigned port, unsigned route)
+{
+	struct server_st server = { };
+	if (!str2addr(&server.addr, addr, port))
+		return false;
+	server.route = route;
+	server.seed = mix64(static_cast<uint64_t>(server.addr.sin_addr.s_addr)
+			    << 16 | server.addr.sin_port);
+	this->servers.push_back(server);
+	this->routes[route].servers.push_back(this->servers.size() - 1);
+	return true;
+}
+
+// Add the comma-separated [tls:]<address>[:<port>][#<name>] list of
+// @servers to @route.  @port is the default port of UDP servers.
+bool DNSProxy::add_servers(const std::string &servers, unsigned port,
+			   unsigned route)
+{
+	for (size_t start = 0; start <= servers.size(); )
+	{
+		size_t comma = servers.find(',', start);
+		if (comma == std::string::npos)
+			comma = servers.size();
+
+		std::string addr = servers.substr(start, comma - start);
+		unsigned server_port = port;
+		bool use_tls = false;
+		std::string tls_name;
+		if (addr.compare(0, 4, "tls:") == 0)
+		{
+			use_tls = true;
+			server_port = TLSUpstream::PORT;
+			addr.erase(0, 4);
+
+			auto hash = addr.find('#');
+			if (hash != std::string::npos)
+			{
+				tls_name = addr.substr(hash + 1);
+				addr.resize(hash);
+			}
+		}
+
+		auto colon = addr.find(':');
+		if (colon != std::string::npos)
+		{
+			const char *port_str = &addr[colon+1];
+			char *end;
+			unsigned long parsed = strtoul(port_str, &end, 10);
+			if (*end || end == port_str || !parsed
+			    || parsed > std::numeric_limits<uint16_t>::max())
+			{
+				common::Log_error("%s: invalid port",
+						  addr.c_str());
+				return false;
+			}
+			server_port = parsed;
+			addr.resize(colon);
+		}
+
+		if (!add_server(addr.c_str(), server_port, route))
+			return false;
+		this->servers.back().use_tls = use_tls;
+		this->servers.back().tls_name = tls_name;
+		start = comma + 1;
+	}
+
+	return true;
+}
+
+// Parse @route, which is <domain>=<servers>, and add it to @routes
+// and the @route_table.
+bool DNSProxy::add_route(const char *route, unsigned port)
+{
+	const char *eq = strchr(route, '=');
+	if (!eq)
+	{
+		common::Log_error("%s: missing upstream servers", route);
+		return false;
+	}
+
+	struct route_st new_route = { };
+	new_route.domain.assign(route, eq);
+	this->routes.push_back(new_route);
+	if (!this->route_table->Add(new_route.domain.c_str(),
+				    this->routes.size() - 1))
+		return false;
+	return add_servers(eq + 1, port, this->routes.size() - 1);
+}
+
+// Return the index of the route @query should be forwarded through.
+unsigned DNSProxy::find_route(const DNSMessage &query) const
+{
+	if (!this->route_table || !query.Qdcount())
+		return 0;
+
+	unsigned route = this->route_table->Lookup(query.Qname(),
+						   query.Qname_size());
+	return route != Routes::NO_ROUTE ? route : 0;
+}
+
+// Return the index of the server of @route @query should be forwarded to.
+// It's the first one, unless there's @config.name_affinity, in which case
+// the servers are ranked by rendezvous hashing of the last labels of the
+// QNAME, so each domain is sent to the same server, and adding or removing
+// a server only moves the domains it gains or loses.  To keep a popular
+// domain from overloading its server, the highest ranking server is taken
+// which has less than @MAX_LOAD_PERCENT of its share of the route's
+// queries in flight (bounded-load consistent hashing).
+unsigned DNSProxy::choose_server(unsigned route, const DNSMessage &query)
+{
+	const auto &candidates = this->routes[route].servers;
+	if (!this->config.name_affinity || candidates.size() < 2)
+		return candidates[0];
+
+	uint64_t hash = 0;
+	if (query.Qdcount())
+	{
+		uint64_t hashes[Blocklist::MAX_LABELS];
+		unsigned nlabels = Blocklist::Suffix_hashes(
+				query.Qname(), query.Qname_size(), hashes);
+		if (nlabels)
+			hash = hashes[nlabels > this->config.name_affinity
+				      ? nlabels - this->config.name_affinity
+				      : 0];
+	}
+
+	unsigned inflight = 0;
+	for (unsigned server: candidates)
+		inflight += this->servers[server].inflight;
+	const size_t nshares = 100 * candidates.size();
+	const unsigned max_load = ((inflight + 1) * MAX_LOAD_PERCENT
+				   + nshares - 1) / nshares;
+
+	// Not all servers can be over @max_load.
+	unsigned chosen = candidates[0];
+	uint64_t chosen_score = 0, top_score = 0;
+	for (unsigned server: candidates)
+	{
+		uint64_t score = mix64(hash ^ this->servers[server].seed);
+		if (score > top_score)
+			top_score = score;
+		if (this->servers[server].inflight < max_load
+		    && score >= chosen_score)
+		{
+			chosen = server;
+			chosen_score = score;
+		}
+	}
+
+	if (chosen_score != top_score)
+		this->stats.affinity_spills++;
+	return chosen;
+}
+
+// Return the index of the server @upstream_fd belongs to.  If it's
+// a stream connection, *@streamp is set to its TLSUpstream, otherwise
+// to NULL.
+unsigned DNSProxy::find_server(int upstream_fd, TLSUpstream **streamp) const
+{
+	for (unsigned server = 0; server < this->servers.size(); server++)
+	{
+		const struct server_st &candidate = this->servers[server];
+
+		*streamp = candidate.tls ? candidate.tls : candidate.tcp;
+		if (*streamp && (*streamp)->Has(upstream_fd))
+			return server;
+
+		*streamp = NULL;
+		if (candidate.sockets && candidate.sockets->Has(upstream_fd))
+			return server;
+	}
+
+	assert(false);
+	return 0;
+}
+
 bool DNSProxy::Init(const char *local_addr, unsigned local_port,
-		    const char *upstream_addr, unsigned upstream_port)
+		    const char *upstream_addr, unsigned upstream_port,
+		    const std::vector<const char *> &secondaries,
+		    const std::vector<const char *> &routes,
+		    const std::vector<const char *> &rules)
 {
 	struct sockaddr_in listen_addr;
+	const bool embedded = !local_addr;
 
 	// Before anything else parse the addresses we're given.
-	if (!str2addr(&listen_addr, local_addr, local_port))
+	if (!embedded && !str2addr(&listen_addr, local_addr, local_port))
 		return false;
-	if (!str2addr(&this->upstream, upstream_addr, upstream_port))
+
+	struct route_st default_route = { "." };
+	this->routes.push_back(default_route);
+	if (!add_servers(upstream_addr, upstream_port, 0))
 		return false;
+	for (const auto secondary: secondaries)
+		if (!add_servers(secondary, upstream_port, 0))
+			return false;
+
+	if (!routes.empty())
+		this->route_table = new Routes();
+	for (const auto route: routes)
+		if (!add_route(route, upstream_port))
+			return false;
+
+	if (!rules.empty())
+		this->synthesizer = new Synthesizer();
+	for (const auto rule: rules)
+		if (!this->synthesizer->Add(rule))
+			return false;
+
+	if (this->config.records)
+	{	// Nothing is parsed, so this is quick.
+		this->local_records = new Records();
+		if (!this->local_records->Load(this->config.records))
+			return false;
+		common::Log_info("%u RRsets loaded from %s",
+				 this->local_records->Count(),
+				 this->config.records);
+	}
+
+	if (this->config.blocklist)
+	{
+		this->blocklist = new Blocklist();
+		if (!this->blocklist->Load(this->config.blocklist))
+			return false;
+		common::Log_info("%llu domains blocked by %s",
+				 static_cast<unsigned long long>(
+					this->blocklist->Count()),
+				 this->config.blocklist);
+	}
 
 	if ((this->pollfd = epoll_create(1)) < 0)
 	{
@@ -74,29 +375,103 @@ bool DNSProxy::Init(const char *local_addr, unsigned local_port,
 	}
 
 	// Let's not close fd:s on error, the destructor will do it anyway.
-	if ((this->serverfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
-	{
-		common::Log_error("socket(serverfd): %m");
+	// The queries of a @pipeline worker come from the @pipeline.
+	this->sockopts.busy_poll = this->config.busy_poll;
+	this->sockopts.timestamping = this->config.timestamping;
+	if (this->config.hot_restart && !this->pipeline && !embedded
+	    && !take_over())
 		return false;
-	} else if (bind(this->serverfd,
-			reinterpret_cast<const sockaddr *>(&listen_addr),
-			sizeof(listen_addr)) < 0)
+	if (!this->pipeline && !embedded)
 	{
-		common::Log_error("bind(%s:%u): %m", local_addr, local_port);
-		return false;
-	} else
-		common::Log_info("Listening on %s:%u",
-				 local_addr, local_port);
+		if (this->handoff && (this->serverfd =
+				this->handoff->Take_socket(
+					Handoff::CLIENT_SOCKET,
+					listen_addr)) >= 0)
+			common::Log_info("Listening on %s:%u (taken over)",
+					 local_addr, local_port);
+		else if ((this->serverfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+		{
+			common::Log_error("socket(serverfd): %m");
+			return false;
+		} else if (bind(this->serverfd,
+				reinterpret_cast<const sockaddr *>(
+								&listen_addr),
+				sizeof(listen_addr)) < 0)
+		{
+			common::Log_error("bind(%s:%u): %m",
+					  local_addr, local_port);
+			return false;
+		} else
+			common::Log_info("Listening on %s:%u",
+					 local_addr, local_port);
+
+		common::Set_sockopts(this->serverfd, this->sockopts);
+	}
+	this->buffers = new SocketBuffers(this->config.max_socket_buffer);
+
+	if (this->config.busy_poll)
+	{	// Let the kernel busy-poll the device queues as well,
+		// if it can.
+		struct epoll_params params = { };
+
+		params.busy_poll_usecs = this->config.busy_poll;
+		params.busy_poll_budget = 8;
+		params.prefer_busy_poll = 1;
+		if (ioctl(this->pollfd, EPIOCSPARAMS, &params) < 0)
+			common::Log_debug("ioctl(EPIOCSPARAMS): %m");
+	}
 
 	struct epoll_event event = { EPOLLIN };
-	event.data.fd = this->serverfd;
-	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, this->serverfd,
-		      &event) < 0)
+	event.data.fd = this->pipeline
+		? this->pipeline->Wakeup_fd(this->worker)
+		: this->serverfd;
+	if (!embedded && epoll_ctl(this->pollfd, EPOLL_CTL_ADD,
+				   event.data.fd, &event) < 0)
 	{
 		common::Log_error("epoll_ctl(add): %m");
 		return false;
 	}
 
+	// Listen on the same address for stream transports.  Only one
+	// worker of a @pipeline can listen on them.
+	const bool first_worker = !embedded
+		&& (!this->pipeline || this->worker == 0);
+	if (this->config.tcp_port && first_worker)
+	{
+		this->tcp_listener = new StreamListener(
+			NULL, this->config.max_connections, this->pollfd);
+		listen_addr.sin_port = htons(this->config.tcp_port);
+		if (!this->tcp_listener->Listen(listen_addr, this->handoff
+				? this->handoff->Take_socket(
+					Handoff::LISTENER, listen_addr)
+				: -1))
+			return false;
+	}
+
+	if (this->config.tls_port && first_worker)
+	{
+		if (!this->config.tls_cert || !this->config.tls_key)
+		{
+			common::Log_error("A certificate and a private key "
+					  "are needed for DNS-over-TLS");
+			return false;
+		} else if (!(this->tls_listener_ctx =
+				StreamListener::New_context(
+					this->config.tls_cert,
+					this->config.tls_key)))
+			return false;
+
+		this->tls_listener = new StreamListener(
+			this->tls_listener_ctx, this->config.max_connections,
+			this->pollfd);
+		listen_addr.sin_port = htons(this->config.tls_port);
+		if (!this->tls_listener->Listen(listen_addr, this->handoff
+				? this->handoff->Take_socket(
+					Handoff::LISTENER, listen_addr)
+				: -1))
+			return false;
+	}
+
 	if ((this->timerfd = timerfd_create(CLOCK_MONOTONIC, 0)) < 0)
 	{
 		common::Log_error("timerfd_create(): %m");
@@ -110,24 +485,346 @@ bool DNSProxy::Init(const char *local_addr, unsigned local_port,
 		return false;
 	}
 
-	this->sockets = new Upstream(this->config.max_ports,
-				     this->config.max_port_lifetime,
-				     this->pollfd, this->upstream);
+	// Receive SIGUSR1 and SIGHUP through @sigfd.  The @pipeline
+	// receives them for its workers, and the signals of a program
+	// we're embedded in are none of our business.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGHUP);
+	if (!this->pipeline && !embedded)
+	{
+		if (sigprocmask(SIG_BLOCK, &sigs, NULL) < 0)
+		{
+			common::Log_error("sigprocmask(): %m");
+			return false;
+		} else if ((this->sigfd = signalfd(-1, &sigs, 0)) < 0)
+		{
+			common::Log_error("signalfd(): %m");
+			return false;
+		}
+
+		event.data.fd = this->sigfd;
+		if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, this->sigfd,
+			      &event) < 0)
+		{
+			common::Log_error("epoll_ctl(add): %m");
+			return false;
+		}
+	}
+
+	bool can_hedge = false;
+	for (const auto &route: this->routes)
+		if (route.servers.size() > 1)
+			can_hedge = true;
+
+	if (this->config.hedge_percentile && can_hedge)
+	{
+		if ((this->hedgefd = timerfd_create(CLOCK_MONOTONIC, 0)) < 0)
+		{
+			common::Log_error("timerfd_create(hedge): %m");
+			return false;
+		}
+
+		event.data.fd = this->hedgefd;
+		if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, this->hedgefd,
+			      &event) < 0)
+		{
+			common::Log_error("epoll_ctl(add): %m");
+			return false;
+		}
+
+		this->hedging = new Hedging(this->config.hedge_percentile,
+					    this->config.hedge_budget,
+					    this->hedgefd);
+	} else if (this->config.hedge_percentile)
+		common::Log_info("Hedging needs a secondary upstream server, "
+				 "disabled.");
+
+	if (this->config.max_pending)
+		this->pending = new FairQueue(this->config.max_pending);
+	if (this->config.heavy_hitters)
+		for (auto &top: this->top)
+			top = new HeavyHitters(this->config.heavy_hitters);
+
+	for (auto &server: this->servers)
+		if (!server.use_tls)
+			server.sockets = new Upstream(
+					this->config.max_ports,
+					this->config.max_port_lifetime,
+					this->sockopts,
+					this->pollfd, server.addr);
+		else if (this->tls_ctx || (this->tls_ctx =
+				TLSUpstream::New_context(this->config.tls_ca)))
+		{
+			server.tls = new TLSUpstream(
+					this->tls_ctx,
+					this->config.tls_connections,
+					this->pollfd, server.addr,
+					server.tls_name);
+			server.tls->On_disconnect(lost_connection, this);
+		} else
+			return false;
+	for (auto &server: this->servers)
+		// DNS-over-TLS isn't vulnerable to spoofing.
+		server.randomize_case = this->config.randomize_case
+			&& !server.use_tls;
+	if (this->config.congestion_control)
+		for (auto &server: this->servers)
+			server.window = new CongestionWindow(
+					this->config.max_requests
+						? this->config.max_requests
+						: ~0u);
 	this->requests = new Requests(this->config.max_requests,
 				      this->config.request_timeout,
 				      this->config.min_gc_time,
 				      this->timerfd);
 
+	// Now that everything is ready, take over the requests of the
+	// process we replace, and wait for the one replacing us.
+	if (this->handoff && !adopt_requests())
+		return false;
+	if (this->config.hot_restart && !this->pipeline && !embedded)
+	{
+		if ((this->handoff_fd = Handoff::Listen(
+				this->config.hot_restart)) < 0)
+			return false;
+
+		event.data.fd = this->handoff_fd;
+		if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, this->handoff_fd,
+			      &event) < 0)
+		{
+			common::Log_error("epoll_ctl(add): %m");
+			return false;
+		}
+	}
+
+	// Indexed by the DEBUG, TIMESTAMPING and HEDGING bits.
+	static void (DNSProxy::*const policies[])() =
+	{
+		&DNSProxy::use_policy<false, false, false>,
+		&DNSProxy::use_policy<false, false, true>,
+		&DNSProxy::use_policy<false, true,  false>,
+		&DNSProxy::use_policy<false, true,  true>,
+		&DNSProxy::use_policy<true,  false, false>,
+		&DNSProxy::use_policy<true,  false, true>,
+		&DNSProxy::use_policy<true,  true,  false>,
+		&DNSProxy::use_policy<true,  true,  true>,
+	};
+	(this->*policies[(common::Debug ? 4 : 0)
+			 | (this->config.timestamping ? 2 : 0)
+			 | (this->hedging ? 1 : 0)])();
+
+	return true;
+}
+
+// Connect to the process we replace through @config.hot_restart, if there
+// is one, and receive its sockets and outstanding requests in @handoff.
+// It carries on serving until we've adopt_requests()ed them.
+bool DNSProxy::take_over()
+{
+	if (!Handoff::Connect(this->config.hot_restart, &this->handoff_conn))
+		return false;
+	else if (this->handoff_conn < 0)
+		// We're the first one.
+		return true;
+
+	this->handoff = new Handoff();
+	if (!this->handoff->Receive(this->handoff_conn))
+		return false;
+	common::Log_info("Taking over %zu sockets from the running process",
+			 this->handoff->Sockets().size());
+	return true;
+}
+
+// Take over the upstream sockets and the outstanding requests received
+// in @handoff, and let the process we replace go.  The requests forwarded
+// to servers we don't have anymore are dropped along with their sockets.
+bool DNSProxy::adopt_requests()
+{
+	struct adopted_st
+	{
+		struct Handoff::socket_st *socket;
+		unsigned server;
+		unsigned outstanding;
+	};
+
+	// Find the servers of the upstream sockets by their peers.
+	// @sockets is keyed by their fds in the process we replace,
+	// which are part of the request IDs.
+	std::unordered_map<int, struct adopted_st> sockets;
+	for (auto &socket: this->handoff->Sockets())
+	{
+		struct sockaddr_in peer;
+		socklen_t speer = sizeof(peer);
+
+		if (socket.kind != Handoff::UPSTREAM_SOCKET
+		    || getpeername(socket.fd,
+				   reinterpret_cast<struct sockaddr *>(&peer),
+				   &speer) < 0)
+			continue;
+		for (unsigned server = 0; server < this->servers.size();
+		     server++)
+		{
+			const struct server_st &candidate =
+				this->servers[server];
+			if (candidate.sockets
+			    && candidate.addr.sin_addr.s_addr
+				== peer.sin_addr.s_addr
+			    && candidate.addr.sin_port == peer.sin_port)
+			{
+				sockets[socket.orig_fd] =
+					adopted_st { &socket, server, 0 };
+				break;
+			}
+		}
+	}
+
+	// Read all requests first to know how many each socket has.
+	// The hedged ones are linked again once all are known.
+	uint32_t nrequests;
+	unsigned ndropped = 0;
+	std::vector<std::pair<Requests::request_id_t,
+			      struct Requests::request_st>> requests;
+	std::unordered_map<Requests::request_id_t,
+			   Requests::request_id_t> request_ids;
+	std::vector<std::pair<Requests::request_id_t,
+			      Requests::request_id_t>> siblings;
+	if (!this->handoff->Get(&nrequests))
+		goto corrupt;
+	for (unsigned i = 0; i < nrequests; i++)
+	{
+		Requests::request_id_t orig_request_id, sibling;
+		std::chrono::steady_clock::time_point sent, expiration;
+		struct sockaddr_in client;
+		Requests::query_id_t orig_query_id;
+		bool recursion_desired;
+		uint64_t case_mask;
+		uint16_t udp_size;
+		bool hedged;
+		std::vector<char> question, query;
+
+		if (!this->handoff->Get(&orig_request_id)
+		    || !this->handoff->Get(&sent)
+		    || !this->handoff->Get(&expiration)
+		    || !this->handoff->Get(&client)
+		    || !this->handoff->Get(&orig_query_id)
+		    || !this->handoff->Get(&recursion_desired)
+		    || !this->handoff->Get(&case_mask)
+		    || !this->handoff->Get(&udp_size)
+		    || !this->handoff->Get(&hedged)
+		    || !this->handoff->Get(&sibling)
+		    || !this->handoff->Get(&question)
+		    || !this->handoff->Get(&query))
+			goto corrupt;
+
+		auto socket = sockets.find(
+				Requests::Upstream_fd(orig_request_id));
+		if (socket == sockets.end())
+		{
+			ndropped++;
+			continue;
+		}
+
+		int upstream_fd = socket->second.socket->fd;
+		auto request_id = Requests::Request_id(upstream_fd,
+				Requests::Query_id(orig_request_id));
+		socket->second.outstanding++;
+		request_ids[orig_request_id] = request_id;
+		if (hedged)
+			siblings.emplace_back(request_id, sibling);
+		requests.emplace_back(request_id, Requests::request_st {
+			upstream_fd, socket->second.server,
+			sent, expiration,
+			client, 0,
+			std::move(question), orig_query_id,
+			recursion_desired,
+			std::move(query), case_mask, udp_size,
+			false, 0, false });
+	}
+
+	for (auto &i: sockets)
+	{
+		struct adopted_st &adopted = i.second;
+		struct Upstream::socket_usage_st usage =
+		{
+			adopted.outstanding,
+			adopted.socket->lifetime,
+		};
+
+		if (!this->servers[adopted.server].sockets->Adopt(
+				adopted.socket->fd, usage,
+				adopted.socket->retired))
+			return false;
+		adopted.socket->fd = -1;
+	}
+
+	for (const auto &i: requests)
+	{
+		struct server_st &server = this->servers[i.second.server];
+
+		this->requests->Adopt(i.first, i.second);
+		server.inflight++;
+		if (server.window)
+			server.window->Sent();
+	}
+	for (const auto &i: siblings)
+	{
+		auto sibling = request_ids.find(i.second);
+		if (sibling != request_ids.end()
+		    && !this->requests->Find(i.first)->hedged)
+			this->requests->Link(i.first, sibling->second);
+	}
+
+	// Let the process we replace go.
+	if (!Handoff::Confirm(this->handoff_conn))
+	{
+		common::Log_error("The running process didn't let us "
+				  "take over");
+		return false;
+	}
+	close(this->handoff_conn);
+	this->handoff_conn = -1;
+	delete this->handoff;
+	this->handoff = NULL;
+
+	common::Log_info("Took over %zu outstanding requests, dropped %u",
+			 requests.size(), ndropped);
 	return true;
+
+corrupt:
+	common::Log_error("The state received from the running process "
+			  "is corrupt");
+	return false;
+}
+
+// Set the @step_fn and the @inject_fn with the policy of @D, @T and @H.
+template <bool D, bool T, bool H>
+void DNSProxy::use_policy()
+{
+	this->step_fn = &DNSProxy::step<policy_st<D, T, H>>;
+	this->inject_fn = &DNSProxy::inject<policy_st<D, T, H>>;
 }
 
 // Read an UDP message from @fd, returning its size in *@smsgp.
-// If @sender is not NULL it is filled.  On failure returns NULL.
+// If @sender is not NULL it is filled.  If @queuedp is not NULL, it's set
+// to the time the message spent in the socket's receive queue, or zero if
+// it's not known.  The number of messages dropped by the kernel on @fd is
+// accounted for.  On failure returns NULL.
+template <class Policy>
 char *DNSProxy::receive_message(int fd, int *smsgp,
-				struct sockaddr_in *sender) const
+				struct sockaddr_in *sender,
+				Latency::duration *queuedp)
 {
 	char *msg;
-	socklen_t addrlen;
+	struct iovec iov;
+	struct msghdr mhdr;
+	union
+	{	// Make sure the buffer is properly aligned.
+		char buf[CMSG_SPACE(sizeof(struct scm_timestamping))
+			 + CMSG_SPACE(sizeof(uint32_t))];
+		struct cmsghdr align;
+	} control;
 
 	// First try to determine the size of the message.
 	// If we can't, assume it's no larger than NS_MAXMSG.
@@ -149,18 +846,62 @@ char *DNSProxy::receive_message(int fd, int *smsgp,
 
 	// Receive @msg.
 	msg = new char[*smsgp];
-	addrlen = sizeof(*sender);
-	*smsgp = recvfrom(fd, msg, *smsgp, 0,
-			  reinterpret_cast<struct sockaddr *>(sender),
-			  &addrlen);
+	iov.iov_base = msg;
+	iov.iov_len = *smsgp;
+
+	mhdr.msg_name = sender;
+	mhdr.msg_namelen = sizeof(*sender);
+	mhdr.msg_iov = &iov;
+	mhdr.msg_iovlen = 1;
+	mhdr.msg_control = control.buf;
+	mhdr.msg_controllen = sizeof(control.buf);
+	mhdr.msg_flags = 0;
+
+	*smsgp = recvmsg(fd, &mhdr, 0);
 	if (*smsgp < 0)
 	{
-		common::Log_error("recvfrom(): %m");
+		common::Log_error("recvmsg(): %m");
 		delete[] msg;
 		return NULL;
 	}
 
-	if (common::Debug)
+	// The drop counter is only included if it's not zero.
+	uint32_t drops = 0;
+	if (queuedp)
+		*queuedp = Latency::duration::zero();
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mhdr); cmsg;
+	     cmsg = CMSG_NXTHDR(&mhdr, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+		else if (queuedp
+		    && cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{	// The kernel timestamp is in CLOCK_REALTIME.
+			struct scm_timestamping tss;
+			struct timespec now;
+
+			memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+			clock_gettime(CLOCK_REALTIME, &now);
+			*queuedp = std::chrono::duration_cast<
+					Latency::duration>(
+				std::chrono::seconds(now.tv_sec
+						     - tss.ts[0].tv_sec)
+				+ std::chrono::nanoseconds(now.tv_nsec
+							   - tss.ts[0].tv_nsec));
+		}
+
+	if (unsigned ndropped = this->buffers->Received(fd, drops))
+	{
+		common::Log_debug("Kernel dropped %u messages on socket %d",
+				  ndropped, fd);
+		if (fd == this->serverfd)
+			this->stats.client_drops += ndropped;
+		else
+			this->stats.upstream_drops += ndropped;
+	}
+
+	if (Policy::DEBUG)
 		common::Log_debug("Message received from %s:%u: %d bytes",
 				  inet_ntoa(sender->sin_addr),
 				  ntohs(sender->sin_port), *smsgp);
@@ -169,6 +910,7 @@ char *DNSProxy::receive_message(int fd, int *smsgp,
 
 // Pop the next UDP message from @fd without reading it.
 // It is used when we know we won't be able to process it.
+template <class Policy>
 void DNSProxy::discard_message(int fd) const
 {
 	char msg;
@@ -181,332 +923,1607 @@ void DNSProxy::discard_message(int fd) const
 		     &addrlen) < 0)
 		common::Log_error("recv(discard): %m");
 
-	if (common::Debug)
+	if (Policy::DEBUG)
 		common::Log_debug("Discarding message from %s:%u",
 				  inet_ntoa(sender.sin_addr),
 				  ntohs(sender.sin_port));
 }
 
-// Parse @msg and extract the query ID and the question section.
-// Returns a pointer to the DNS header (which is the first byte of @msg)
-// or NULL if the message is not valid.
-const DNSProxy::dns_header_st *
-DNSProxy::parse_message(const struct sockaddr_in &sender,
-			const char *msg, size_t smsg,
-			Requests::query_id_t *query_idp,
-			std::vector<char> &question) const
+// Parse @msg into @view, logging the reason if it is not a valid DNS
+// message.  In debug mode the first QNAME is logged too.
+template <class Policy>
+bool DNSProxy::parse_message(const struct sockaddr_in &sender,
+			     const char *msg, size_t smsg,
+			     DNSMessage *view) const
 {
-	const dns_header_st *header;
-	const char *top, *p;
-	size_t left;
+	const char *error;
 
-	if (smsg < NS_HFIXEDSZ)
+	if ((error = view->Parse(msg, smsg)) != NULL)
 	{
-		common::Log_error("%s: incomplete header (%zu bytes)",
-				  inet_ntoa(sender.sin_addr), smsg);
-		return NULL;
+		if (smsg < NS_HFIXEDSZ)
+			common::Log_error("%s: %s (%zu bytes)",
+					  inet_ntoa(sender.sin_addr),
+					  error, smsg);
+		else
+			common::Log_error("%s[%u]: %s",
+					  inet_ntoa(sender.sin_addr),
+					  view->Id(), error);
+		return false;
 	}
 
-	header = reinterpret_cast<const dns_header_st *>(msg);
-	*query_idp = ntohs(header->id);
-
-	// Parse the question section of @msg.  There can be multiple
-	// questions in a DNS query, or none at all (eg. when doing a
-	// dynamic DNS update).
-	p = top = &msg[NS_HFIXEDSZ];
-	left = smsg - NS_HFIXEDSZ;
-	for (unsigned i = ntohs(header->qdcount); i > 0; i--)
-	{
-		std::string qname;
-
-		// Parse one @qname.  A QNAME is a sequence of labels,
-		// terminated by the root label (which is the empty string).
-		for (;;)
-		{	// A label is a string, preceded by a single byte
-			// representing the label's length.
-			//
-			// NOTE: I'm not sure whether message compression
-			//       can be applied to the names appearing in
-			//       the question section.  If so, the worst
-			//       case we'll log a bogus QNAME.
-			//
-			// (And of course international names aren't decoded.)
-			if (left < 1)
-			{
-				common::Log_error("%s[%u]: "
-						  "unterminated QNAME",
-						  inet_ntoa(sender.sin_addr),
-						  *query_idp);
-				return NULL;
-			}
-
-			unsigned llabel = *reinterpret_cast<const uint8_t *>
-					   (p);
-			p++;
-			left--;
+	if (Policy::DEBUG && view->Qname_size() > 0)
+		common::Log_debug("%s[%u]: QNAME: %s",
+				  inet_ntoa(sender.sin_addr), view->Id(),
+				  view->Qname_str().c_str());
 
-			if (llabel == 0)
-				// We've reached the root label.
-				break;
-
-			if (left < llabel)
-			{
-				common::Log_error("%s[%u]: truncated QNAME",
-						  inet_ntoa(sender.sin_addr),
-						  *query_idp);
-				return NULL;
-			}
+	return true;
+}
 
-			if (common::Debug)
-			{	// Add the label to @qname.
-				if (!qname.empty())
-					qname.append(1, '.');
-				qname.append(p, llabel);
-			}
+// Send @msg to @client, or on @stream if it's not 0, which may be
+// the response callback of an Inject()ed query.  Returns false
+// on failure.
+bool DNSProxy::reply(const struct sockaddr_in &client, uint64_t stream,
+		     const char *msg, size_t smsg)
+{
+	if (stream & INJECTED)
+	{
+		if (!this->response_callback)
+			return false;
+		this->response_callback(this->response_arg,
+					stream & ~INJECTED, msg, smsg);
+		return true;
+	}
 
-			p += llabel;
-			left -= llabel;
-		}
+	if (stream)
+		// Only one of the listeners has @stream.
+		return (this->tcp_listener
+			&& this->tcp_listener->Reply(stream, msg, smsg))
+		       || (this->tls_listener
+			   && this->tls_listener->Reply(stream, msg, smsg));
 
-		// The QNAME is followed by the query class and type,
-		// without padding.  Skip them.
-		if (left < NS_QFIXEDSZ)
+	if (this->pipeline)
+	{	// The TX thread is notified at the end of the event.
+		struct Pipeline::packet_st packet;
+		packet.peer = client;
+		packet.msg.assign(msg, msg + smsg);
+		if (!this->pipeline->Push_response(this->worker, packet))
 		{
-			common::Log_error("%s[%u]: "
-					  "truncated QUESTION section",
-					  inet_ntoa(sender.sin_addr),
-					  *query_idp);
-			return NULL;
+			common::Log_error("Response ring of worker %u is full",
+					  this->worker);
+			return false;
 		}
-		p += NS_QFIXEDSZ;
-		left -= NS_QFIXEDSZ;
 
-		if (common::Debug)
-		{
-			common::Log_debug("%s[%u]: QNAME: %s",
-					  inet_ntoa(sender.sin_addr),
-					  *query_idp,
-					  qname.empty() ? ".":qname.c_str());
-			qname.clear();
-		}
+		this->tx_pending = true;
+		return true;
 	}
 
-	// Save the entire @question.
-	question.assign(top, p);
-
-	return header;
+	if (sendto(this->serverfd, msg, smsg, 0,
+		   reinterpret_cast<const struct sockaddr *>(&client),
+		   sizeof(client)) < 0)
+	{	// inet_ntoa() might change @errno.
+		auto serrno = errno;
+		const char *addr = inet_ntoa(client.sin_addr);
+		errno = serrno;
+		common::Log_error("sendto(%s:%u): %m",
+				  addr, ntohs(client.sin_port));
+		return false;
+	} else
+		return true;
 }
 
-// Read a message from @serverfd, replace its query ID with a random one,
-// forward it on a random upstream socket and save the query in the internal
-// data structures.  Returns false if there was a problem with receiving the
-// message (which could indicate some uncontrollable transient error, like
-// out of kernel memory).
-bool DNSProxy::forward_query() const
+// Answer @query from @local_records if it's there.  Returns whether
+// a response has been sent.
+template <class Policy>
+bool DNSProxy::answer_locally(const struct sockaddr_in &client,
+			      uint64_t stream, const DNSMessage &query)
 {
-	char *msg;
-	int smsg, upstream_fd;
-	struct sockaddr_in client;
-	dns_header_st *header;
-	std::vector<char> question;
-	Requests::query_id_t received_query_id, proxied_query_id;
-	struct Upstream::socket_usage_st *upstream_socket;
+	const char *rrset;
+	size_t skey, srrset;
+	unsigned nrrs;
+	char key[Records::MAX_KEY];
 
-	// Do we have a free query ID to forward a query with?
-	// If not, discard the message without reading it.
-	if (!this->requests->Get_query_id(&proxied_query_id))
-	{
-		discard_message(this->serverfd);
-		return true;
-	}
+	if (!this->local_records
+	    || query.Qdcount() != 1
+	    || query.Header()->opcode != ns_o_query
+	    || query.qclass != ns_c_in)
+		return false;
 
-	if (!(msg = receive_message(this->serverfd, &smsg, &client)))
+	skey = Records::Make_key(key, query.Qname(), query.Qname_size(),
+				 query.qtype);
+	if (!this->local_records->Lookup(key, skey, &rrset, &srrset, &nrrs))
 		return false;
 
-	if (!(header = const_cast<dns_header_st *>(parse_message(
-						client, msg, smsg,
-						&received_query_id,
-						question))))
-		goto out;
+	query.Answer(this->response, ns_r_noerror, rrset, srrset, nrrs);
+	if (reply(client, stream,
+		  this->response.data(), this->response.size())
+	    && Policy::DEBUG)
+		common::Log_debug("%u <- %s:%u <- local",
+				  query.Id(),
+				  inet_ntoa(client.sin_addr),
+				  ntohs(client.sin_port));
 
-	if (header->qr)
-	{
-		common::Log_error("%s[%u]: message is not a query",
+	this->stats.local_answers++;
+	return true;
+}
+
+// Answer @query by the first matching rule of the @synthesizer.
+// Returns whether a response has been sent.
+template <class Policy>
+bool DNSProxy::answer_synthesized(const struct sockaddr_in &client,
+				  uint64_t stream, const DNSMessage &query)
+{
+	if (!this->synthesizer
+	    || query.Qdcount() != 1
+	    || query.Header()->opcode != ns_o_query
+	    || query.qclass != ns_c_in
+	    || !this->synthesizer->Answer(query, this->response))
+		return false;
+
+	if (reply(client, stream,
+		  this->response.data(), this->response.size())
+	    && Policy::DEBUG)
+		common::Log_debug("%u <- %s:%u <- synthesized",
+				  query.Id(),
 				  inet_ntoa(client.sin_addr),
-				  received_query_id);
-		goto out;
-	}
+				  ntohs(client.sin_port));
 
-	if (!(upstream_socket = this->sockets->Get(&upstream_fd)))
-		goto out;
+	this->stats.synthesized++;
+	return true;
+}
 
-	header->id = htons(proxied_query_id);
-	if (send(upstream_fd, msg, smsg, 0) < 0)
+// Answer @query of class IN with NXDOMAIN (or the null address) if its
+// QNAME is in the @blocklist.  Returns whether a response has been sent.
+template <class Policy>
+bool DNSProxy::answer_blocked(const struct sockaddr_in &client,
+			      uint64_t stream, const DNSMessage &query)
+{
+	// The answers for --block-with-null.  The owner names point to
+	// the QNAME.
+	static const unsigned char null_a[] =
 	{
-		common::Log_error("send(upstream): %m");
-		goto out;
-	} else if (common::Debug)
+		0xC0, NS_HFIXEDSZ, 0, ns_t_a, 0, ns_c_in,
+		0, 0, 0, 60, 0, 4,
+		0, 0, 0, 0,
+	};
+	static const unsigned char null_aaaa[] =
 	{
-		struct sockaddr_in saddr;
-		if (common::GetSockName(upstream_fd, &saddr))
-			common::Log_debug("%u -> %s:%u -> %u",
-					  received_query_id,
-					  inet_ntoa(saddr.sin_addr),
-					  ntohs(saddr.sin_port),
-					  proxied_query_id);
-	}
+		0xC0, NS_HFIXEDSZ, 0, ns_t_aaaa, 0, ns_c_in,
+		0, 0, 0, 60, 0, 16,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	};
 
-	this->sockets->Put(upstream_fd, upstream_socket);
-	this->requests->Put(proxied_query_id, upstream_fd, client,
-			    question, received_query_id);
+	if (!this->blocklist
+	    || query.Qdcount() != 1
+	    || query.Header()->opcode != ns_o_query
+	    || query.qclass != ns_c_in
+	    || !this->blocklist->Match(query.Qname(), query.Qname_size()))
+		return false;
 
-out:
-	delete[] msg;
+	if (!this->config.block_with_null)
+		query.Answer(this->response, ns_r_nxdomain);
+	else if (query.qtype == ns_t_a)
+		query.Answer(this->response, ns_r_noerror,
+			     reinterpret_cast<const char *>(null_a),
+			     sizeof(null_a), 1);
+	else if (query.qtype == ns_t_aaaa)
+		query.Answer(this->response, ns_r_noerror,
+			     reinterpret_cast<const char *>(null_aaaa),
+			     sizeof(null_aaaa), 1);
+	else	// NODATA
+		query.Answer(this->response, ns_r_noerror);
+
+	if (reply(client, stream,
+		  this->response.data(), this->response.size())
+	    && Policy::DEBUG)
+		common::Log_debug("%u <- %s:%u <- blocked",
+				  query.Id(),
+				  inet_ntoa(client.sin_addr),
+				  ntohs(client.sin_port));
+
+	this->stats.blocked++;
 	return true;
 }
 
-// Read a message from @upstream_fd, validate it as a DNS response,
-// replace its query ID and return it to the appropriate client.
-// Returns false if there was a problem with receiving the message.
-bool DNSProxy::return_response(int upstream_fd) const
+// Read a message from @serverfd and handle_query() it.  Returns false
+// if there was a problem with receiving the message (which could indicate
+// some uncontrollable transient error, like out of kernel memory).
+template <class Policy>
+bool DNSProxy::forward_query()
 {
-	int smsg;
 	char *msg;
-	dns_header_st *header;
-	std::vector<char> question;
-	Requests::query_id_t proxied_query_id;
-	const struct Requests::request_st *request;
+	int smsg;
+	struct sockaddr_in client;
+	Latency::duration queued;
+	std::chrono::steady_clock::time_point dequeued;
+	bool can_forward;
 
-	if (!(msg = receive_message(upstream_fd, &smsg)))
-		return false;
+	// Can we forward another query?  If not, and the query can't be
+	// answered locally or queued either, discard the message without
+	// reading it.
+	can_forward = !check_memory() && !this->requests->Full();
+	if (!can_forward && !this->local_records && !this->synthesizer
+	    && !this->blocklist && (!this->pending || this->shedding))
+	{
+		if (this->shedding)
+			this->stats.shed++;
+		else
+			this->stats.over_max_requests++;
+		discard_message<Policy>(this->serverfd);
+		return true;
+	}
+
+	if (!(msg = receive_message<Policy>(this->serverfd, &smsg,
+					    &client, &queued)))
+		return false;
+	dequeued = std::chrono::steady_clock::now();
+	this->stats.queries++;
+	if (Policy::TIMESTAMPING)
+		this->stages[QUERY_QUEUED].Add(queued);
+
+	handle_query<Policy>(client, 0, msg, smsg, dequeued, can_forward);
+	delete[] msg;
+	return true;
+}
+
+// Pop the queries the @pipeline has for us and handle_query() them.
+// Also handle the signals the @pipeline has passed on.
+template <class Policy>
+void DNSProxy::receive_pipelined_queries()
+{
+	uint64_t n;
+	struct Pipeline::packet_st packet;
+
+	// Reset the eventfd before looking at the rings, so we can't miss
+	// a wakeup.
+	if (read(this->pipeline->Wakeup_fd(this->worker), &n, sizeof(n)) < 0
+	    && errno != EAGAIN)
+		common::Log_error("read(wakeupfd): %m");
+
+	unsigned signals = this->pipeline->Signals(this->worker);
+	if (signals & (1u << SIGHUP))
+		reload();
+	if (signals & (1u << SIGUSR1))
+	{	// Don't mix our statistics with the other workers'.
+		std::lock_guard<std::mutex> lock(this->pipeline->Stats_lock());
+		common::Log_info("Statistics of worker %u:", this->worker);
+		dump_stats();
+	}
+
+	while (this->pipeline->Pop_query(this->worker, &packet))
+	{	// The time spent in the ring is accounted as processing.
+		this->stats.queries++;
+		handle_query<Policy>(packet.peer, 0,
+				     packet.msg.data(), packet.msg.size(),
+				     packet.received,
+				     !check_memory()
+				     && !this->requests->Full());
+	}
+}
+
+// Handle @events on @sfd, a connection of @listener, and handle_query()
+// the queries received.
+template <class Policy>
+void DNSProxy::receive_stream_queries(StreamListener *listener, int sfd,
+				      uint32_t events)
+{
+	std::vector<struct StreamListener::query_st> queries;
+
+	listener->Process(sfd, events, &queries);
+	for (auto &query: queries)
+	{
+		this->stats.queries++;
+		handle_query<Policy>(query.client, query.stream,
+				     query.msg.data(), query.msg.size(),
+				     std::chrono::steady_clock::now(),
+				     !check_memory()
+				     && !this->requests->Full());
+	}
+}
+
+// Validate @msg as a query from @client (on @stream if it's not 0),
+// answer it locally if possible, otherwise forward it to the upstream
+// server of its route and save the query in the internal data structures.
+// @can_forward tells whether another request can be forwarded; even if it
+// can, the server's congestion window may not let it through.
+template <class Policy>
+void DNSProxy::handle_query(const struct sockaddr_in &client, uint64_t stream,
+			    char *msg, size_t smsg,
+			    std::chrono::steady_clock::time_point dequeued,
+			    bool can_forward)
+{
+	DNSMessage view;
+	unsigned route, server;
+
+	if (!parse_message<Policy>(client, msg, smsg, &view))
+		return;
+	view.over_stream = stream != 0;
+
+	if (view.Header()->qr)
+	{
+		common::Log_error("%s[%u]: message is not a query",
+				  inet_ntoa(client.sin_addr), view.Id());
+		return;
+	}
+	DNSPROXY_PROBE5(query__received, client.sin_addr.s_addr,
+			ntohs(client.sin_port), view.Id(), stream,
+			Probe_ns(dequeued));
+
+	if (this->top[TOP_CLIENTS])
+	{
+		this->top[TOP_CLIENTS]->Add(
+			reinterpret_cast<const char *>(&client.sin_addr),
+			sizeof(client.sin_addr));
+		count_name(TOP_QNAMES, view.Qname(), view.Qname_size());
+	}
+
+	// Try to avoid forwarding the query at all.
+	if (answer_locally<Policy>(client, stream, view)
+	    || answer_synthesized<Policy>(client, stream, view)
+	    || answer_blocked<Policy>(client, stream, view))
+		return;
+
+	route = find_route(view);
+	server = choose_server(route, view);
+	if (can_forward && !window_open(server))
+	{
+		this->servers[server].window->nclosed++;
+		can_forward = false;
+	}
+
+	// If there are @pending queries waiting for requests, this one has
+	// to wait its turn too, unless we're over the memory budget.  The ones
+	// only waiting for the windows of other servers don't hold it up.
+	if (this->shedding)
+		this->stats.shed++;
+	else if (this->pending
+		 && (!can_forward || (this->pending_for_requests
+				      && !this->pending->Empty())))
+	{
+		struct FairQueue::query_st query;
+
+		query.client = client;
+		query.stream = stream;
+		query.received = dequeued;
+		query.msg.assign(msg, msg + smsg);
+		this->pending->Push(query);
+	} else if (can_forward)
+		forward_request<Policy>(client, stream, view, server,
+					msg, smsg, dequeued);
+	else if (this->requests->Full())
+		this->stats.over_max_requests++;
+}
+
+// Forward @msg, a query from @client (on @stream if it's not 0) parsed
+// into @view, to the @server:th upstream server and save the query
+// in the internal data structures.  @msg was received at @dequeued.
+template <class Policy>
+void DNSProxy::forward_request(const struct sockaddr_in &client,
+			       uint64_t stream, DNSMessage &view,
+			       unsigned server, char *msg, size_t smsg,
+			       std::chrono::steady_clock::time_point dequeued)
+{
+	std::vector<char> question, query;
+	Requests::query_id_t received_query_id = view.Id();
+	Requests::request_id_t request_id;
+	uint64_t case_mask = 0;
+	uint16_t udp_size;
+	unsigned route;
+
+	route = this->servers[server].route;
+	this->routes[route].queries++;
+
+	// Responses larger than what the client asked for are truncated,
+	// and the upstream server is asked for no more than
+	// @config.edns_size, so its responses aren't fragmented.
+	udp_size = stream ? 0 : view.Max_udp_response();
+	if (this->config.edns_size
+	    && view.Limit_udp_size(this->config.edns_size))
+		this->stats.edns_limited++;
+
+	// The response must match the random case of the QNAME as well
+	// as the query ID to be accepted.
+	if (this->servers[server].randomize_case && view.Qname_size() > 0)
+	{
+		case_mask = std::uniform_int_distribution<uint64_t>()(
+								common::Rnd);
+		DNSMessage::Flip_case(const_cast<char *>(view.Qname()),
+				      view.Qname_size(), case_mask);
+	}
+
+	if (!send_query(server, false, msg, smsg, &request_id))
+		return;
+	DNSPROXY_PROBE4(query__forwarded, received_query_id,
+			Requests::Upstream_fd(request_id),
+			Requests::Query_id(request_id), route);
+	if (Policy::DEBUG)
+	{
+		struct sockaddr_in saddr;
+		if (common::GetSockName(Requests::Upstream_fd(request_id),
+					&saddr))
+			common::Log_debug("%u -> %s:%u -> %u",
+					  received_query_id,
+					  inet_ntoa(saddr.sin_addr),
+					  ntohs(saddr.sin_port),
+					  Requests::Query_id(request_id));
+	}
+
+	// Keep a copy of the question for validating the response,
+	// and the query if it may need to be sent again: hedged or,
+	// if the client can take a response of any size, over TCP.
+	question.assign(view.Question(),
+			view.Question() + view.Question_size());
+	if (Policy::HEDGING || stream)
+		query.assign(msg, msg + smsg);
+
+	this->requests->Put(request_id, server, client, stream,
+			    question, received_query_id, view.Header()->rd,
+			    query, case_mask, udp_size);
+	this->stats.forwarded++;
+	this->stages[QUERY_PROCESSED].Add(
+		std::chrono::duration_cast<Latency::duration>(
+			std::chrono::steady_clock::now() - dequeued));
+	if (Policy::HEDGING && this->routes[route].servers.size() > 1)
+		this->hedging->Schedule(request_id,
+					this->servers[server].rtt);
+}
+
+// Forward the @pending queries in turn while there are free requests
+// and we're within the memory budget, and fail the ones which have
+// waited for more than @config.pending_timeout.  The queries of servers
+// whose congestion window is closed are skipped, keeping their places
+// in the queue, so a congested server doesn't hold up the queries
+// of the others.
+template <class Policy>
+void DNSProxy::dispatch_pending()
+{
+	struct FairQueue::query_st query;
+	auto &blocked = this->blocked;
+
+	this->pending->Expire(std::chrono::steady_clock::now()
+			      - std::chrono::milliseconds(
+					this->config.pending_timeout),
+			      [this](struct FairQueue::query_st &query)
+			      { fail_pending<Policy>(query); });
+
+	while (!this->pending->Empty() && !this->requests->Full()
+	       && !check_memory() && this->pending->Pop(&query))
+	{
+		DNSMessage view;
+		unsigned server;
+
+		// @query has been parsed successfully before.
+		if (!parse_message<Policy>(query.client, query.msg.data(),
+					   query.msg.size(), &view))
+			continue;
+		view.over_stream = query.stream != 0;
+
+		server = choose_server(find_route(view), view);
+		if (!window_open(server))
+		{	// Scanning on is pointless once every window
+			// is closed.
+			blocked.push_back(std::move(query));
+			if (!any_window_open())
+				break;
+			continue;
+		}
+
+		forward_request<Policy>(query.client, query.stream, view,
+					server, query.msg.data(),
+					query.msg.size(), query.received);
+	}
+
+	// Put the skipped queries back at the fronts of their flows
+	// in the order they were taken.
+	while (!blocked.empty())
+	{
+		this->pending->Unpop(blocked.back());
+		blocked.pop_back();
+	}
+	this->pending_for_requests = !this->pending->Empty()
+		&& this->requests->Full();
+}
+
+// Answer @query, which has waited too long in the @pending queue,
+// with SERVFAIL, so the client can try elsewhere without waiting
+// for its own timeout.
+template <class Policy>
+void DNSProxy::fail_pending(struct FairQueue::query_st &query)
+{
+	DNSMessage view;
+
+	this->stats.pending_failed++;
+	if (!parse_message<Policy>(query.client, query.msg.data(),
+				   query.msg.size(), &view)
+	    || view.Qdcount() != 1)
+		return;
+	view.over_stream = query.stream != 0;
+
+	// Answer() is for local answers, but this one doesn't come
+	// from an authority.
+	view.Answer(this->response, ns_r_servfail);
+	reinterpret_cast<dns_header_st *>(&this->response[0])->aa = 0;
+	if (reply(query.client, query.stream,
+		  this->response.data(), this->response.size())
+	    && Policy::DEBUG)
+		common::Log_debug("%u <- %s:%u <- waited too long",
+				  view.Id(),
+				  inet_ntoa(query.client.sin_addr),
+				  ntohs(query.client.sin_port));
+}
+
+// Whether the congestion window of the @server:th upstream server lets
+// another query through.
+bool DNSProxy::window_open(unsigned server) const
+{
+	const CongestionWindow *window = this->servers[server].window;
+	return !window || window->Open();
+}
+
+// Whether any upstream server's congestion window lets another query
+// through.
+bool DNSProxy::any_window_open() const
+{
+	for (unsigned server = 0; server < this->servers.size(); server++)
+		if (window_open(server))
+			return true;
+	return false;
+}
+
+// The bytes held by the outstanding requests, the @pending queries and
+// the socket buffers grown over their default size.
+size_t DNSProxy::memory_usage() const
+{
+	return this->requests->Memory()
+		+ (this->pending ? this->pending->Memory() : 0)
+		+ this->buffers->Grown_size();
+}
+
+// Account the memory in use against @config.max_memory.  When it's
+// reached, give back what is only kept for speed and shed new queries
+// until the usage falls below @RESUME_PERCENT of the budget.  Returns
+// whether we're @shedding.
+bool DNSProxy::check_memory()
+{
+	size_t usage = memory_usage();
+	if (usage > this->peak_memory)
+		this->peak_memory = usage;
+	if (!this->config.max_memory)
+		return false;
+
+	bool over = this->shedding
+		? usage >= this->config.max_memory / 100 * RESUME_PERCENT
+		: usage >= this->config.max_memory;
+	if (over && !this->shedding)
+	{	// Maybe giving back the free request nodes and the grown
+		// socket buffers is enough.
+		this->requests->Trim();
+		this->buffers->Shrink();
+		over = memory_usage() >= this->config.max_memory;
+	}
+	if (over == this->shedding)
+		return over;
+
+	this->shedding = over;
+	this->buffers->Freeze(over);
+	if (over)
+		common::Log_error("Memory budget of %zu bytes reached, "
+				  "shedding queries.",
+				  this->config.max_memory);
+	else
+		common::Log_info("Memory usage is within the budget again.");
+
+	return over;
+}
+
+// Send @msg to the @server:th upstream server, over TCP if @over_tcp,
+// replacing its query ID with one free on the socket it's sent through.
+// Returns the ID of the request in *@request_idp, or false on error.
+bool DNSProxy::send_query(unsigned server, bool over_tcp,
+			  char *msg, size_t smsg,
+			  Requests::request_id_t *request_idp)
+{
+	int upstream_fd;
+	Requests::query_id_t query_id;
+	struct Upstream::socket_usage_st *upstream_socket;
+	dns_header_st *header = reinterpret_cast<dns_header_st *>(msg);
+	TLSUpstream *stream = over_tcp
+		? this->servers[server].tcp : this->servers[server].tls;
+
+	if (stream)
+	{
+		if ((upstream_fd = stream->Get()) < 0
+		    || !this->requests->Get_query_id(upstream_fd, &query_id))
+			return false;
+		DNSPROXY_PROBE3(id__allocated, server, upstream_fd, query_id);
+		header->id = htons(query_id);
+		if (!stream->Send(upstream_fd, msg, smsg))
+			return false;
+		DNSPROXY_PROBE4(query__sent, server, upstream_fd, query_id,
+				smsg);
+		this->servers[server].inflight++;
+		if (this->servers[server].window)
+			this->servers[server].window->Sent();
+
+		*request_idp = Requests::Request_id(upstream_fd, query_id);
+		return true;
+	}
+
+	if (!(upstream_socket = this->servers[server].sockets->Get(
+								&upstream_fd))
+	    || !this->requests->Get_query_id(upstream_fd, &query_id))
+		return false;
+	DNSPROXY_PROBE3(id__allocated, server, upstream_fd, query_id);
+	header->id = htons(query_id);
+	if (send(upstream_fd, msg, smsg, 0) < 0)
+	{
+		common::Log_error("send(upstream): %m");
+		return false;
+	}
+	DNSPROXY_PROBE4(query__sent, server, upstream_fd, query_id, smsg);
+
+	this->servers[server].sockets->Put(upstream_fd, upstream_socket);
+	this->servers[server].inflight++;
+	if (this->servers[server].window)
+		this->servers[server].window->Sent();
+	*request_idp = Requests::Request_id(upstream_fd, query_id);
+	return true;
+}
+
+// Read a message from @upstream_fd, connected to the @server:th upstream
+// server, and process_response() it.  Returns false if there was
+// a problem with receiving the message.
+template <class Policy>
+bool DNSProxy::return_response(unsigned server, int upstream_fd)
+{
+	int smsg;
+	char *msg;
+	Latency::duration queued;
+
+	if (!(msg = receive_message<Policy>(upstream_fd, &smsg,
+					    NULL, &queued)))
+		return false;
 	// Since @upstream_fd is connected to the upstream DNS server,
 	// this @msg must have the proper source address and port.
+	process_response<Policy>(server, upstream_fd, msg, smsg, queued);
+	delete[] msg;
+	return true;
+}
+
+// Handle @events on @upstream_fd, a DNS-over-TLS or TCP connection of
+// @upstream to the @server:th upstream server, and process_response()
+// the responses received.
+template <class Policy>
+void DNSProxy::return_stream_responses(unsigned server, TLSUpstream *upstream,
+				       int upstream_fd, uint32_t events)
+{
+	std::vector<std::vector<char>> responses;
+
+	const char *error = upstream->Process(upstream_fd, events, &responses);
+	for (auto &response: responses)
+		process_response<Policy>(server, upstream_fd,
+					 response.data(), response.size(),
+					 Latency::duration::zero());
+
+	// The requests answered before the connection failed are done,
+	// the rest are lost with it.
+	if (error)
+		upstream->Disconnect(upstream_fd, error);
+}
+
+// Validate @msg received through @upstream_fd as a DNS response,
+// replace its query ID and return it to the appropriate client.
+// @msg spent @queued time in the socket receive queue.
+template <class Policy>
+void DNSProxy::process_response(unsigned server, int upstream_fd,
+				char *msg, size_t smsg,
+				Latency::duration queued)
+{
+	const struct sockaddr_in &upstream = this->servers[server].addr;
+	dns_header_st *header;
+	DNSMessage view;
+	Requests::query_id_t proxied_query_id = 0;
+	Requests::request_id_t request_id;
+	const struct Requests::request_st *request;
+	Latency::duration rtt;
+	std::chrono::steady_clock::time_point dequeued;
+	const char *reason;
 
-	if (!(header = const_cast<dns_header_st *>(parse_message(
-						this->upstream,
-						msg, smsg,
-						&proxied_query_id,
-						question))))
-		goto out;
-	proxied_query_id = ntohs(header->id);
+	dequeued = std::chrono::steady_clock::now();
+
+	if (!parse_message<Policy>(upstream, msg, smsg, &view))
+	{
+		reason = "malformed";
+		goto drop;
+	}
+	header = const_cast<dns_header_st *>(view.Header());
+	proxied_query_id = view.Id();
+	DNSPROXY_PROBE5(response__received, server, upstream_fd,
+			proxied_query_id, smsg, Probe_ns(dequeued));
 
-	// Validate @msg.
+	// Validate @msg.  It's looked up by the socket it arrived through
+	// as well, so a response arriving through a different port than
+	// the query was forwarded through, which can be a sign of spoofing,
+	// is not found.
 	if (!header->qr)
 	{
 		common::Log_error("%s[%u]: message is not a response",
-				  inet_ntoa(this->upstream.sin_addr),
+				  inet_ntoa(upstream.sin_addr),
 				  proxied_query_id);
-		goto out;
-	} else if (!(request = this->requests->Find(proxied_query_id)))
-	{
-		if (common::Debug)
+		reason = "not a response";
+		goto drop;
+	} else if (!(request = this->requests->Find(request_id =
+			Requests::Request_id(upstream_fd, proxied_query_id)))
+		   || request->server != server)
+	{	// A request of another server could only have been left
+		// behind by a closed socket whose fd was reused, but they
+		// are Purge()d before the socket is closed.
+		if (Policy::DEBUG)
 			common::Log_debug("%s[%u]: request not found",
-					  inet_ntoa(this->upstream.sin_addr),
-					  proxied_query_id);
-		goto out;
-	} else if (upstream_fd != request->upstream_fd)
-	{	// @msg arrived through a different port than we had
-		// forwarded it throug, which can be a sign of spoofing.
-		if (common::Debug)
-			common::Log_debug("%s[%u]: response on wrong port",
-					  inet_ntoa(this->upstream.sin_addr),
+					  inet_ntoa(upstream.sin_addr),
 					  proxied_query_id);
-		goto out;
-	} else if (question != request->question)
-	{	// The response has to contain the exact same @question
-		// as the query.
-		//
-		// XXX RFC5452 9.1 says we should validate the QTYPE and
-		//     QCLASS too.
-		if (common::Debug)
-			common::Log_debug("%s[%u]: "
-					  "response to wrong question",
-					  inet_ntoa(this->upstream.sin_addr),
-					  proxied_query_id);
-		goto out;
-	}
+		reason = "request not found";
+		goto drop;
+	} else if (!view.Question_equals(request->question))
+	{	// The response has to contain the exact same question
+		// as the query, including the QTYPE and QCLASS of each
+		// question (RFC 5452 9.1), and the case of the QNAME.
+		if (request->case_mask
+		    && view.Question_equals_nocase(request->question))
+		{
+			case_mismatch(server);
+			reason = "wrong case";
+		} else
+			reason = "wrong question";
+		if (Policy::DEBUG)
+			common::Log_debug("%s[%u]: response to %s",
+					  inet_ntoa(upstream.sin_addr),
+					  proxied_query_id, reason);
+		goto drop;
+	} else if (header->tc && request->stream && !request->over_tcp
+		   && !this->servers[server].tls
+		   && resend_over_tcp<Policy>(request_id, request))
+		// The client will get the full response when it arrives.
+		return;
+
+	if (header->rcode == NXDOMAIN && this->top[TOP_NXDOMAINS])
+		count_name(TOP_NXDOMAINS, view.Qname(), view.Qname_size());
 
+	// Return the QNAME in the case the client sent it.
+	if (request->case_mask)
+	{
+		this->servers[server].case_mismatches = 0;
+		DNSMessage::Flip_case(const_cast<char *>(view.Qname()),
+				      view.Qname_size(), request->case_mask);
+	}
 	header->id = htons(request->original_query_id);
-	if (sendto(this->serverfd, msg, smsg, 0,
-		   reinterpret_cast<const struct sockaddr *>
-				   (&request->client),
-		   sizeof(request->client)) < 0)
-	{	// inet_ntoa() might change @errno.
-		auto serrno = errno;
-		const char *addr = inet_ntoa(request->client.sin_addr);
-		errno = serrno;
-		common::Log_error("sendto(%s:%u): %m",
-				  addr, ntohs(request->client.sin_port));
-	} else if (common::Debug)
+	if (request->udp_size && smsg > request->udp_size)
+	{	// Only the servers reached over TCP or TLS, or ones
+		// ignoring the payload size, send responses this large.
+		// Signed ones are sent as they are, and aren't counted.
+		size_t truncated = view.Truncate(request->udp_size);
+		if (truncated < smsg)
+			this->stats.truncated++;
+		smsg = truncated;
+	}
+	if (reply(request->client, request->stream, msg, smsg)
+	    && Policy::DEBUG)
 		common::Log_debug("%u <- %s:%u <- %u",
 				  request->original_query_id,
 				  inet_ntoa(request->client.sin_addr),
 				  ntohs(request->client.sin_port),
 				  proxied_query_id);
 
-	this->sockets->Done(upstream_fd);
-	this->requests->Done(proxied_query_id, request);
+	// @msg arrived @queued time before we got it.  The round-trip
+	// time of a request resent over TCP includes the UDP one too.
+	rtt = std::chrono::duration_cast<Latency::duration>(
+		dequeued - request->sent) - queued;
+	DNSPROXY_PROBE5(response__validated, server, upstream_fd,
+			proxied_query_id, request->original_query_id,
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				rtt).count());
+	if (!request->over_tcp)
+	{
+		this->servers[server].rtt.Add(rtt);
+		if (this->servers[server].window)
+			this->servers[server].window->Answered(rtt);
+	}
+	this->stages[UPSTREAM].Add(rtt);
+	if (Policy::TIMESTAMPING)
+		this->stages[RESPONSE_QUEUED].Add(queued);
+	this->stages[RESPONSE_PROCESSED].Add(
+		std::chrono::duration_cast<Latency::duration>(
+			std::chrono::steady_clock::now() - dequeued));
 
-out:
-	delete[] msg;
+	this->stats.answered++;
+	this->routes[this->servers[server].route].answered++;
+	done<Policy>(request_id, request);
+	return;
+
+drop:
+	DNSPROXY_PROBE4(response__rejected, server, upstream_fd,
+			proxied_query_id, reason);
+	this->stats.dropped++;
+}
+
+// Continue the lifecycle of @request, whose response has come back
+// truncated over UDP, by sending its query again to the same server
+// over TCP.  The client is a stream one, so it can take a response of
+// any size.  Returns false if the query couldn't be sent, in which case
+// the truncated response should be returned.
+template <class Policy>
+bool DNSProxy::resend_over_tcp(Requests::request_id_t request_id,
+			       const struct Requests::request_st *request)
+{
+	struct server_st &server = this->servers[request->server];
+	Requests::request_id_t tcp_request_id;
+	std::vector<char> question, query;
+
+	if (!server.tcp)
+	{
+		server.tcp = new TLSUpstream(NULL,
+					     this->config.tls_connections,
+					     this->pollfd, server.addr,
+					     std::string());
+		server.tcp->On_disconnect(lost_connection, this);
+	}
+
+	// The TCP connection has its own query IDs, so the query is
+	// forwarded as a new request, which replaces the current one.
+	query = request->query;
+	if (!send_query(request->server, true, &query[0], query.size(),
+			&tcp_request_id))
+		return false;
+	else if (Policy::DEBUG)
+		common::Log_debug("%u -> %s:%u truncated, retrying as %u "
+				  "over TCP",
+				  Requests::Query_id(request_id),
+				  inet_ntoa(server.addr.sin_addr),
+				  ntohs(server.addr.sin_port),
+				  Requests::Query_id(tcp_request_id));
+
+	question = request->question;
+	this->requests->Put(tcp_request_id, request->server,
+			    request->client, request->stream, question,
+			    request->original_query_id,
+			    request->recursion_desired, query,
+			    request->case_mask, request->udp_size, true);
+	done<Policy>(request_id, request);
+	this->stats.tcp_retries++;
 	return true;
 }
 
-void DNSProxy::Run()
+// Send the query of the request identified by @request_id
+// to a different upstream server than it was originally forwarded to.
+// Whichever response arrives first will be returned to the client.
+// Returns whether the hedge has been sent.
+template <class Policy>
+bool DNSProxy::hedge_query(Requests::request_id_t request_id)
 {
-	// Make sure we've been Init()ialized.
-	assert(this->requests != NULL);
-	assert(this->sockets  != NULL);
+	unsigned server;
+	Requests::request_id_t hedge_request_id;
+	std::vector<char> question, query;
+	const struct Requests::request_st *request;
+
+	// Hedges are cancelled when requests are done or expire,
+	// so @request must still be outstanding.
+	request = this->requests->Find(request_id);
+	assert(request != NULL && !request->hedged);
+	if (this->requests->Full())
+		return false;
+
+	// Choose a random server of the same route other than
+	// the original one.
+	const auto &candidates =
+		this->routes[this->servers[request->server].route].servers;
+	assert(candidates.size() > 1);
+	server = candidates[std::uniform_int_distribution<unsigned>
+				(0, candidates.size()-2)
+				(common::Rnd)];
+	if (server == request->server)
+		server = candidates.back();
+	if (!window_open(server))
+		return false;
+
+	query = request->query;
+	if (!send_query(server, false, &query[0], query.size(),
+			&hedge_request_id))
+		return false;
+	else if (Policy::DEBUG)
+		common::Log_debug("%u => %s:%u -> %u",
+				  Requests::Query_id(request_id),
+				  inet_ntoa(this->servers[server].addr.sin_addr),
+				  ntohs(this->servers[server].addr.sin_port),
+				  Requests::Query_id(hedge_request_id));
+
+	// @query is only kept for resending it over TCP:
+	// a hedge is never hedged again.
+	question = request->question;
+	if (!request->stream)
+		query.clear();
+	this->requests->Put(hedge_request_id, server,
+			    request->client, request->stream, question,
+			    request->original_query_id,
+			    request->recursion_desired, query,
+			    request->case_mask, request->udp_size);
+	this->requests->Link(request_id, hedge_request_id);
+	return true;
+}
+
+// Forget about @request, which has been answered.  If it was hedged,
+// its sibling is cancelled as well, and any late response to it will be
+// dropped.
+template <class Policy>
+void DNSProxy::done(Requests::request_id_t request_id,
+		    const struct Requests::request_st *request)
+{
+	if (request->hedged)
+	{
+		auto sibling_request_id = request->sibling;
+		auto sibling = this->requests->Find(sibling_request_id);
+		assert(sibling != NULL);
+
+		if (Policy::DEBUG)
+			common::Log_debug("Cancelling hedged request %u",
+					  Requests::Query_id(
+						sibling_request_id));
+		release_socket(sibling);
+		this->requests->Done(sibling_request_id, sibling);
+	}
+
+	if (Policy::HEDGING)
+		this->hedging->Cancel(request_id);
+	release_socket(request);
+	this->requests->Done(request_id, request);
+}
+
+// Called by Requests::Gc() for each expired @request.
+template <class Policy>
+void DNSProxy::expired(Requests::request_id_t request_id,
+		       const struct Requests::request_st *request)
+{
+	DNSPROXY_PROBE4(request__expired, request->server,
+			request->upstream_fd, Requests::Query_id(request_id),
+			Probe_ns(request->sent));
+	this->stats.expired++;
+	if (this->top[TOP_TIMEOUTS] && !request->question.empty())
+		count_name(TOP_TIMEOUTS, &request->question[0],
+			   DNSMessage::Name_size(&request->question[0],
+						 request->question.size()));
+
+	if (this->servers[request->server].window)
+		this->servers[request->server].window->Expired(request->sent);
+
+	// The sibling may still be answered on its own.
+	if (request->hedged)
+		this->requests->Unlink(request->sibling);
+	if (Policy::HEDGING)
+		this->hedging->Cancel(request_id);
+	release_socket(request);
+}
+
+// Called by a TLSUpstream when @upstream_fd is about to be closed.
+void DNSProxy::lost_connection(void *arg, int upstream_fd)
+{
+	DNSProxy *self = static_cast<DNSProxy *>(arg);
+
+	self->requests->Purge(upstream_fd,
+		[self](Requests::request_id_t request_id,
+		       const struct Requests::request_st *request)
+		{ self->lost(request_id, request); });
+}
+
+// Called by Requests::Purge() for each @request whose upstream connection
+// has failed.  Its client is answered with SERVFAIL so it can try again
+// without waiting for its timeout, unless the hedge may still answer it.
+void DNSProxy::lost(Requests::request_id_t request_id,
+		    const struct Requests::request_st *request)
+{
+	this->stats.lost++;
+	if (request->hedged)
+		this->requests->Unlink(request->sibling);
+	else if (!request->question.empty())
+	{	// Only the question of the query is kept.  @response may be
+		// in use by our caller.
+		std::vector<char> response(NS_HFIXEDSZ);
+		response.insert(response.end(), request->question.begin(),
+				request->question.end());
+
+		dns_header_st *header = reinterpret_cast<dns_header_st *>(
+								&response[0]);
+		header->id = htons(request->original_query_id);
+		header->qr = 1;
+		header->rd = request->recursion_desired;
+		header->ra = 1;
+		header->rcode = ns_r_servfail;
+		header->qdcount = htons(1);
+
+		// The QNAME must be in the case the client sent it in.
+		if (request->case_mask)
+			DNSMessage::Flip_case(&response[NS_HFIXEDSZ],
+					      DNSMessage::Name_size(
+						&response[NS_HFIXEDSZ],
+						request->question.size()),
+					      request->case_mask);
+		reply(request->client, request->stream,
+		      response.data(), response.size());
+	}
+
+	if (this->hedging)
+		this->hedging->Cancel(request_id);
+	release_socket(request);
+}
 
-	// Run the event loop.
-	common::Log_info("Ready to accept requests.");
-	for (;;)
+// Called when @request is done with its upstream connection or socket.
+void DNSProxy::release_socket(const struct Requests::request_st *request)
+{
+	struct server_st &server = this->servers[request->server];
+	int upstream_fd = request->upstream_fd;
+
+	assert(server.inflight > 0);
+	server.inflight--;
+	if (server.window)
+		server.window->Released();
+	if (request->over_tcp)
+	{
+		server.tcp->Done(upstream_fd);
+		return;
+	} else if (server.tls)
 	{
-		struct epoll_event event;
+		server.tls->Done(upstream_fd);
+		return;
+	}
+
+	server.sockets->Done(upstream_fd);
+	if (!server.sockets->Has(upstream_fd))
+		// Upstream has closed @upstream_fd.
+		this->buffers->Forget(upstream_fd);
+}
+
+// Called when a response from the @server:th upstream server had the right
+// question in the wrong case.  A few in a row mean that the server doesn't
+// preserve the case of names, so they're not randomized for it anymore.
+void DNSProxy::case_mismatch(unsigned server)
+{
+	struct server_st &upstream = this->servers[server];
+
+	this->stats.case_mismatches++;
+	if (!upstream.randomize_case
+	    || ++upstream.case_mismatches < MAX_CASE_MISMATCHES)
+		return;
+
+	upstream.randomize_case = false;
+	common::Log_info("%s:%u doesn't preserve the case of names, "
+			 "not randomizing it anymore",
+			 inet_ntoa(upstream.addr.sin_addr),
+			 ntohs(upstream.addr.sin_port));
+}
+
+// Count the wire-format @name of @sname bytes in the @top:th heavy hitters
+// case-insensitively.
+void DNSProxy::count_name(unsigned top, const char *name, size_t sname)
+{
+	char folded[NS_MAXCDNAME];
+
+	sname = std::min(sname, sizeof(folded));
+	DNSMessage::Fold_case(folded, name, sname);
+	this->top[top]->Add(folded, sname);
+}
 
-		// Process one event at a time.
-		if (epoll_wait(this->pollfd, &event, 1, -1) < 0)
+// Load the @local_records database and the @blocklist again, replacing
+// the current ones if successful.
+void DNSProxy::reload()
+{
+	if (this->local_records)
+	{
+		Records *records = new Records();
+		if (records->Load(this->config.records))
 		{
-			if (errno != EINTR)
-			{
-				common::Log_error("epoll_wait(): %m");
-				goto snooze;
-			} else
-				continue;
+			delete this->local_records;
+			this->local_records = records;
+			common::Log_info("%u RRsets reloaded from %s",
+					 records->Count(),
+					 this->config.records);
 		} else
-			assert(event.events & EPOLLIN);
+		{
+			common::Log_error("Keeping the current records");
+			delete records;
+		}
+	}
 
-		// Dispatch the event.
-		if (event.data.fd == this->serverfd)
+	if (this->blocklist)
+	{
+		Blocklist *blocklist = new Blocklist();
+		if (blocklist->Load(this->config.blocklist))
 		{
-			if (!forward_query())
-				goto snooze;
-		} else if (event.data.fd == this->timerfd)
+			delete this->blocklist;
+			this->blocklist = blocklist;
+			common::Log_info("%llu domains reloaded from %s",
+					 static_cast<unsigned long long>(
+						blocklist->Count()),
+					 this->config.blocklist);
+		} else
 		{
-			uint64_t n;
+			common::Log_error("Keeping the current blocklist");
+			delete blocklist;
+		}
+	}
+}
+
+// Accept the process replacing us on @handoff_fd and send it our sockets and
+// the requests it can answer: the ones of UDP clients forwarded over UDP.
+// The TCP and TLS connections are ours alone.  We carry on serving until
+// it confirms it's ready to take over, see finish_hand_over().
+void DNSProxy::hand_over()
+{
+	int sfd;
+	Handoff handoff;
+
+	if ((sfd = Handoff::Accept(this->handoff_fd)) < 0)
+		return;
+	else if (this->handoff_conn >= 0)
+	{
+		common::Log_error("Already handing over to a new process");
+		close(sfd);
+		return;
+	}
 
-			if (read(this->timerfd, &n, sizeof(n)) < 0)
+	handoff.Add_socket(Handoff::CLIENT_SOCKET, this->serverfd);
+	if (this->tcp_listener)
+		handoff.Add_socket(Handoff::LISTENER,
+				   this->tcp_listener->Fd());
+	if (this->tls_listener)
+		handoff.Add_socket(Handoff::LISTENER,
+				   this->tls_listener->Fd());
+	for (const auto &server: this->servers)
+		if (server.sockets)
+			server.sockets->For_each(
+				[&handoff](int upstream_fd, unsigned lifetime,
+					   bool retired)
 			{
-				common::Log_error("read(timerfd): %m");
-				goto snooze;
-			} else
+				handoff.Add_socket(Handoff::UPSTREAM_SOCKET,
+						   upstream_fd, lifetime,
+						   retired);
+			});
+
+	auto can_hand_over = [this](const struct Requests::request_st *request)
+	{
+		return !request->stream && !request->over_tcp
+			&& !this->servers[request->server].tls;
+	};
+
+	uint32_t nrequests = 0;
+	this->requests->For_each(
+		[&](Requests::request_id_t request_id,
+		    const struct Requests::request_st *request)
+		{
+			if (can_hand_over(request))
+				nrequests++;
+		});
+	handoff.Put(nrequests);
+	this->requests->For_each(
+		[&](Requests::request_id_t request_id,
+		    const struct Requests::request_st *request)
+		{
+			if (!can_hand_over(request))
+				return;
+			handoff.Put(request_id);
+			handoff.Put(request->sent);
+			handoff.Put(request->expiration);
+			handoff.Put(request->client);
+			handoff.Put(request->original_query_id);
+			handoff.Put(request->recursion_desired);
+			handoff.Put(request->case_mask);
+			handoff.Put(request->udp_size);
+			handoff.Put(request->hedged);
+			handoff.Put(request->sibling);
+			handoff.Put(request->question);
+			handoff.Put(request->query);
+		});
+
+	common::Log_info("Handing over %u outstanding requests to a new "
+			 "process", nrequests);
+	if (!handoff.Send(sfd))
+	{
+		common::Log_error("The new process failed to take over, "
+				  "carrying on");
+		close(sfd);
+		return;
+	}
+
+	struct epoll_event event = { EPOLLIN };
+	event.data.fd = sfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, sfd, &event) < 0)
+	{
+		common::Log_error("epoll_ctl(add): %m");
+		close(sfd);
+		return;
+	}
+
+	this->handoff_conn = sfd;
+	this->handoff_deadline = std::chrono::steady_clock::now()
+		+ std::chrono::seconds(Handoff::TIMEOUT);
+}
+
+// Called when the process replacing us has sent its confirmation on
+// @handoff_conn, or gone away.  Returns true if it has taken over, after
+// which we must leave the sockets alone, otherwise we carry on.
+bool DNSProxy::finish_hand_over()
+{
+	if (!Handoff::Confirmed(this->handoff_conn))
+	{
+		common::Log_error("The new process failed to take over, "
+				  "carrying on");
+		close(this->handoff_conn);
+		this->handoff_conn = -1;
+		return false;
+	}
+
+	close(this->handoff_conn);
+	this->handoff_conn = -1;
+	common::Log_info("Handed over to the new process, exiting");
+	dump_stats();
+	this->handed_over = true;
+	return true;
+}
+
+// Stop waiting for the process replacing us when @handoff_deadline has
+// passed.  Closing the connection tells it that we carry on, even if
+// its confirmation is already on the way.
+void DNSProxy::give_up_hand_over()
+{
+	common::Log_error("The new process didn't take over in time, "
+			  "carrying on");
+	close(this->handoff_conn);
+	this->handoff_conn = -1;
+}
+
+// Log the statistics collected so far.
+void DNSProxy::dump_stats() const
+{
+	static const char *const stage_names[NSTAGES] =
+	{
+		"query queueing",
+		"query processing",
+		"upstream",
+		"response queueing",
+		"response processing",
+	};
+
+	common::Log_info("Queries received: %llu, forwarded: %llu, "
+			 "answered: %llu, expired: %llu",
+			 this->stats.queries, this->stats.forwarded,
+			 this->stats.answered, this->stats.expired);
+	if (this->local_records)
+		common::Log_info("Answered from local records: %llu",
+				 this->stats.local_answers);
+	if (this->synthesizer)
+	{
+		common::Log_info("Synthesized answers: %llu",
+				 this->stats.synthesized);
+		for (const auto &rule: this->synthesizer->Rules())
+			if (rule.hits)
+				common::Log_info("Rule %s: %llu hits",
+						 rule.text.c_str(), rule.hits);
+	}
+	if (this->blocklist)
+		common::Log_info("Blocked queries: %llu",
+				 this->stats.blocked);
+	common::Log_info("Dropped responses: %llu", this->stats.dropped);
+	if (this->stats.lost)
+		common::Log_info("Requests lost with their upstream "
+				 "connection: %llu", this->stats.lost);
+	if (this->config.randomize_case)
+		common::Log_info("Responses with the QNAME in the wrong case: "
+				 "%llu", this->stats.case_mismatches);
+	common::Log_info("Truncated responses retried over TCP: %llu",
+			 this->stats.tcp_retries);
+	common::Log_info("EDNS payload sizes lowered: %llu, responses "
+			 "truncated for the client: %llu",
+			 this->stats.edns_limited, this->stats.truncated);
+	if (this->config.name_affinity)
+		common::Log_info("Queries spilled over from the server of "
+				 "their name: %llu",
+				 this->stats.affinity_spills);
+	common::Log_info("Queries discarded at --max-requests: %llu",
+			 this->stats.over_max_requests);
+	if (this->pending)
+		common::Log_info("Queries queued: %llu, dropped from the "
+				 "full queue: %llu, failed after waiting: %llu",
+				 this->pending->nqueued,
+				 this->pending->ndropped,
+				 this->stats.pending_failed);
+	common::Log_info("Messages dropped by the kernel: from clients: "
+			 "%llu, from upstream: %llu",
+			 this->stats.client_drops, this->stats.upstream_drops);
+	common::Log_info("Socket buffers: %llu bytes",
+			 this->buffers->Total_size());
+	size_t usage = memory_usage();
+	common::Log_info("Memory held: %zu bytes, peak: %zu bytes", usage,
+			 usage > this->peak_memory ? usage : this->peak_memory);
+	if (size_t per_request = this->requests->Memory_per_request())
+		common::Log_info("Memory per outstanding request: %zu bytes",
+				 per_request);
+	if (this->config.max_memory)
+		common::Log_info("Queries shed over the memory budget "
+				 "of %zu bytes: %llu",
+				 this->config.max_memory, this->stats.shed);
+	if (this->route_table)
+		for (const auto &route: this->routes)
+			common::Log_info("Route %s: forwarded %llu, "
+					 "answered %llu",
+					 route.domain.c_str(),
+					 route.queries, route.answered);
+	for (const auto &server: this->servers)
+		if (server.window)
+			common::Log_info("Congestion window of %s:%u: %u, "
+					 "in flight: %u, halved on timeouts: "
+					 "%llu times, queries held back: %llu",
+					 inet_ntoa(server.addr.sin_addr),
+					 ntohs(server.addr.sin_port),
+					 server.window->Limit(),
+					 server.window->Inflight(),
+					 server.window->ntimeouts,
+					 server.window->nclosed);
+	for (const auto &server: this->servers)
+		if (server.tls)
+			common::Log_info("TLS connections to %s:%u: %llu "
+					 "(%llu resumed)",
+					 inet_ntoa(server.addr.sin_addr),
+					 ntohs(server.addr.sin_port),
+					 server.tls->nconnects,
+					 server.tls->nresumed);
+	if (this->tcp_listener)
+		common::Log_info("TCP connections: %llu, queries: %llu, "
+				 "I/O time per query: %lluns",
+				 this->tcp_listener->naccepted,
+				 this->tcp_listener->nqueries,
+				 static_cast<unsigned long long>(
+				   this->tcp_listener->io_time.count()
+				   / std::max(this->tcp_listener->nqueries,
+					      1ull)));
+	if (this->tls_listener)
+		common::Log_info("TLS connections: %llu (%llu with kTLS), "
+				 "queries: %llu, I/O time per query: %lluns",
+				 this->tls_listener->naccepted,
+				 this->tls_listener->nktls,
+				 this->tls_listener->nqueries,
+				 static_cast<unsigned long long>(
+				   this->tls_listener->io_time.count()
+				   / std::max(this->tls_listener->nqueries,
+					      1ull)));
+	if (this->hedging)
+		common::Log_info("Hedged queries: %llu (%llu over budget)",
+				 this->hedging->nhedged,
+				 this->hedging->nover_budget);
+
+	if (this->top[0])
+	{
+		static const char *const top_names[NTOPS] =
+		{
+			"clients",
+			"QNAMEs",
+			"NXDOMAIN QNAMEs",
+			"timed out QNAMEs",
+		};
+
+		for (unsigned i = 0; i < NTOPS; i++)
+		{
+			std::string list;
+			for (const auto &hitter: this->top[i]->Top())
 			{
-				common::Log_debug("Deleting "
-						  "expired requests...");
-				this->requests->Gc(
-					[this]
-					(const struct Requests::request_st *request)
-					{ this->sockets->Done(request->upstream_fd); });
+				list += list.empty() ? " " : ", ";
+				if (i == TOP_CLIENTS)
+				{
+					struct in_addr addr;
+					memcpy(&addr, hitter.key.data(),
+					       sizeof(addr));
+					list += inet_ntoa(addr);
+				} else
+					list += DNSMessage::Name_str(
+							hitter.key.data(),
+							hitter.key.size());
+				list += " (" + std::to_string(hitter.count)
+					+ ")";
 			}
-		} else if (!return_response(event.data.fd))
-			goto snooze;
+			common::Log_info("Top %s:%s", top_names[i],
+					 list.empty() ? " none" : list.c_str());
+		}
+	}
 
-		continue;
+	for (unsigned i = 0; i < NSTAGES; i++)
+		if (this->stages[i].Count())
+			common::Log_info("Latency of %s: p50 %lldus, "
+					 "p90 %lldus, p99 %lldus",
+					 stage_names[i],
+					 static_cast<long long>(
+					   this->stages[i].Percentile(50)
+						.count()),
+					 static_cast<long long>(
+					   this->stages[i].Percentile(90)
+						.count()),
+					 static_cast<long long>(
+					   this->stages[i].Percentile(99)
+						.count()));
+}
+
+void DNSProxy::Run()
+{
+	// Make sure we've been Init()ialized.
+	assert(this->requests != NULL);
+	assert(!this->servers.empty());
+
+	// The @pipeline says when it's ready.
+	if (!this->pipeline)
+		common::Log_info("Ready to accept requests.");
+	while (!this->handed_over)
+		if (!Step(Timeout()))
+			// We have experienced an unaccountable error.
+			// Let's sleep a bit to prevent busy-looping.
+			sleep(1);
+}
 
-snooze:		// We have experienced an unaccountable error.
-		// Let's sleep a bit to prevent busy-looping.
-		sleep(1);
+int DNSProxy::Timeout() const
+{	// Wake up in time to fail the @pending queries which have waited
+	// too long, and to give up on the process replacing us.
+	int timeout = -1;
+
+	if (this->spinning)
+		return 0;
+	if (this->pending && !this->pending->Empty())
+		timeout = this->config.pending_timeout;
+	if (this->handoff_conn >= 0)
+	{
+		auto left = std::chrono::duration_cast<
+			std::chrono::milliseconds>(this->handoff_deadline
+					- std::chrono::steady_clock::now());
+		int handoff_timeout = std::max<int>(left.count() + 1, 0);
+		if (timeout < 0 || handoff_timeout < timeout)
+			timeout = handoff_timeout;
 	}
+
+	return timeout;
+}
+
+// Step() with the features of @Policy compiled in.
+template <class Policy>
+bool DNSProxy::step(int timeout)
+{
+	int nevents;
+	struct epoll_event event;
+
+	// Process one event at a time.
+	if ((nevents = epoll_wait(this->pollfd, &event, 1, timeout)) < 0)
+	{
+		if (errno == EINTR)
+			return true;
+		common::Log_error("epoll_wait(): %m");
+		return false;
+	} else if (!nevents)
+	{	// We're @spinning or waiting for @pending queries.
+		// Go back to sleep if we've been idle for too long.
+		if (this->spinning && std::chrono::steady_clock::now()
+				>= this->idle_deadline)
+			this->spinning = false;
+		goto end_of_round;
+	}
+
+	if (this->config.busy_poll)
+	{
+		this->spinning = true;
+		this->idle_deadline = std::chrono::steady_clock::now()
+			+ std::chrono::microseconds(this->config.busy_poll);
+	}
+
+	// Dispatch the event.
+	if (event.data.fd == this->serverfd)
+	{
+		if (!forward_query<Policy>())
+			return false;
+	} else if (this->pipeline && event.data.fd
+		   == this->pipeline->Wakeup_fd(this->worker))
+		receive_pipelined_queries<Policy>();
+	else if (this->tcp_listener
+		   && event.data.fd == this->tcp_listener->Fd())
+		this->tcp_listener->Accept();
+	else if (this->tcp_listener
+		 && this->tcp_listener->Has(event.data.fd))
+		receive_stream_queries<Policy>(this->tcp_listener,
+					       event.data.fd, event.events);
+	else if (this->tls_listener
+		 && event.data.fd == this->tls_listener->Fd())
+		this->tls_listener->Accept();
+	else if (this->tls_listener
+		 && this->tls_listener->Has(event.data.fd))
+		receive_stream_queries<Policy>(this->tls_listener,
+					       event.data.fd, event.events);
+	else if (event.data.fd == this->timerfd)
+	{
+		uint64_t n;
+
+		if (read(this->timerfd, &n, sizeof(n)) < 0)
+		{
+			common::Log_error("read(timerfd): %m");
+			return false;
+		}
+
+		common::Log_debug("Deleting expired requests...");
+		this->requests->Gc(
+			[this](Requests::request_id_t request_id,
+			       const struct Requests::request_st *request)
+			{ expired<Policy>(request_id, request); });
+	} else if (event.data.fd == this->sigfd)
+	{
+		struct signalfd_siginfo info;
+
+		if (read(this->sigfd, &info, sizeof(info)) < 0)
+		{
+			common::Log_error("read(sigfd): %m");
+			return false;
+		} else if (info.ssi_signo == SIGHUP)
+			reload();
+		else
+			dump_stats();
+	} else if (event.data.fd == this->handoff_fd)
+		hand_over();
+	else if (this->handoff_conn >= 0 && event.data.fd == this->handoff_conn)
+	{	// If the new process has taken over, the sockets are its.
+		if (finish_hand_over())
+			return true;
+	} else if (event.data.fd == this->hedgefd)
+	{
+		uint64_t n;
+
+		if (read(this->hedgefd, &n, sizeof(n)) < 0)
+		{
+			common::Log_error("read(hedgefd): %m");
+			return false;
+		}
+
+		this->hedging->Due(
+			[this](Requests::request_id_t request_id)
+			{ return hedge_query<Policy>(request_id); });
+	} else
+	{	// Find out which server @event.data.fd belongs to.
+		TLSUpstream *stream;
+		unsigned server = find_server(event.data.fd, &stream);
+
+		if (stream)
+			return_stream_responses<Policy>(server, stream,
+							event.data.fd,
+							event.events);
+		else if (!return_response<Policy>(server, event.data.fd))
+			return false;
+	}
+
+end_of_round:
+	if (this->handoff_conn >= 0 && std::chrono::steady_clock::now()
+			>= this->handoff_deadline)
+		give_up_hand_over();
+
+	// The event may have freed up requests for queries waiting.
+	if (this->pending && !this->pending->Empty())
+		dispatch_pending<Policy>();
+
+	// Let the TX thread send what we have queued in this round.
+	if (this->tx_pending)
+	{
+		this->pipeline->Flush_responses();
+		this->tx_pending = false;
+	}
+
+	return true;
+}
+
+// Inject() with the features of @Policy compiled in.
+template <class Policy>
+void DNSProxy::inject(const struct sockaddr_in &client, uint64_t tag,
+		      char *msg, size_t smsg)
+{
+	assert(!(tag & INJECTED));
+	this->stats.queries++;
+	handle_query<Policy>(client, tag | INJECTED, msg, smsg,
+			     std::chrono::steady_clock::now(),
+			     !check_memory() && !this->requests->Full());
 }
 
 // End of DNSProxy.cc
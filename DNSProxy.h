@@ -1,16 +1,34 @@
 #ifndef DNS_PROXY_H
 #define DNS_PROXY_H
 
+#include <string>
 #include <vector>
 
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 
+#include "common.h"
 #include "Requests.h"
+#include "Latency.h"
+#include "DNSMessage.h"
+#include "FairQueue.h"
 
 // Forward declarations
 class Requests;
 class Upstream;
+class Hedging;
+class SocketBuffers;
+class Records;
+class Blocklist;
+class Routes;
+class TLSUpstream;
+class StreamListener;
+class Pipeline;
+class HeavyHitters;
+class CongestionWindow;
+class Synthesizer;
+class Handoff;
+typedef struct ssl_ctx_st SSL_CTX;
 
 // Class taking DNS queries from clients, forwarding them to the upstream
 // server and returning the response to the appropriate client.
@@ -24,52 +42,468 @@ public:
 		unsigned max_ports;
 		unsigned max_port_lifetime;
 		unsigned min_gc_time;
+		unsigned hedge_percentile;
+		unsigned hedge_budget;
+		unsigned busy_poll;
+		bool timestamping;
+		unsigned max_socket_buffer;
+
+		// Records database to answer queries from (or NULL).
+		const char *records;
+
+		// Blocklist to refuse queries by (or NULL), and whether
+		// to answer blocked A and AAAA queries with the null
+		// address instead of NXDOMAIN.
+		const char *blocklist;
+		bool block_with_null;
+
+		// CA certificates to verify DNS-over-TLS servers with
+		// (or NULL for the system's default), and the maximum
+		// number of connections to each of them.
+		const char *tls_ca;
+		unsigned tls_connections;
+
+		// Ports to accept TCP and DNS-over-TLS connections from
+		// clients on (0 to disable), the certificate and private
+		// key of the latter, and the maximum number of connections
+		// on each.
+		unsigned tcp_port, tls_port;
+		const char *tls_cert, *tls_key;
+		unsigned max_connections;
+
+		// The number of most frequent clients and names to track
+		// (0 to disable).
+		unsigned heavy_hitters;
+
+		// The maximum number of queries waiting for a free request
+		// (0 to discard them right away), and how long they can
+		// wait in milliseconds.
+		unsigned max_pending;
+		unsigned pending_timeout;
+
+		// Whether to adapt the number of queries in flight to each
+		// upstream server to its round-trip times.
+		bool congestion_control;
+
+		// Whether to randomize the case of QNAMEs forwarded
+		// to UDP servers.
+		bool randomize_case;
+
+		// The bytes the requests, the pending queries and the grown
+		// socket buffers may take up before new queries are shed
+		// (0 for no limit).
+		size_t max_memory;
+
+		// The number of trailing labels of the QNAME by which
+		// queries are spread over the servers of their route
+		// (0 to forward them to the first one).
+		unsigned name_affinity;
+
+		// The largest EDNS UDP payload size forwarded queries may
+		// advertise (0 to leave them alone).
+		unsigned edns_size;
+
+		// The unix socket through which we take over the sockets
+		// and the outstanding requests of the process we replace,
+		// and hand them over to the one replacing us (or NULL).
+		const char *hot_restart;
 	};
 
+	// Called with the response to a query Inject()ed with @tag.
+	typedef void response_callback_t(void *arg, uint64_t tag,
+					 const char *msg, size_t smsg);
+
 protected:
-	typedef HEADER dns_header_st;
+	typedef DNSMessage::dns_header_st dns_header_st;
+
+	// An upstream DNS server we can forward queries to.
+	struct server_st
+	{
+		// Used to connect the @sockets and in log messages.
+		struct sockaddr_in addr;
+
+		// Either @sockets or @tls is used, depending on @use_tls.
+		// The certificate of a DNS-over-TLS server is verified
+		// against @tls_name, or @addr if it's empty.  Queries
+		// whose response over UDP was truncated are sent again
+		// through the @tcp connections, created when first needed.
+		bool use_tls;
+		std::string tls_name;
+		Upstream *sockets;
+		TLSUpstream *tls, *tcp;
+
+		// Round-trip times of the queries forwarded to this server.
+		Latency rtt;
+
+		// Limits the queries in flight to this server (or NULL if
+		// @config.congestion_control is disabled).
+		CongestionWindow *window;
+
+		// Whether the case of QNAMEs forwarded to this server is
+		// randomized, and the number of responses in a row
+		// with the wrong case.
+		bool randomize_case;
+		unsigned case_mismatches;
+
+		// The index of the route in @routes this server belongs to.
+		unsigned route;
+
+		// Hash of @addr which ranks the server for a QNAME with
+		// @config.name_affinity, and the number of its outstanding
+		// requests.
+		uint64_t seed;
+		unsigned inflight;
+	};
+
+	// The number of responses in a row with the QNAME in the wrong
+	// case after which it's not randomized for the server anymore.
+	static const unsigned MAX_CASE_MISMATCHES = 8;
+
+	// With @config.name_affinity a server can take this percentage
+	// of its share of the queries in flight before the QNAMEs hashed
+	// to it spill over to the other servers of the route.
+	static const unsigned MAX_LOAD_PERCENT = 125;
+
+	// A group of upstream servers queries for a domain and its
+	// subdomains are forwarded to.
+	struct route_st
+	{
+		// In presentation format, "." for the default route.
+		std::string domain;
+
+		// Indexes into @servers.  Queries are forwarded to the
+		// first one, the rest are only used for hedging, unless
+		// the queries are spread by @config.name_affinity.
+		std::vector<unsigned> servers;
+
+		// Statistics
+		unsigned long long queries, answered;
+	};
 
 	// Config options for the Requests and Upstream classes.
 	const struct config_st config;
 
+	// If we're a worker of a @pipeline, queries are received from
+	// and responses are sent to it instead of @serverfd, which is
+	// not used.  @tx_pending tells whether we have responses queued
+	// which the TX thread hasn't been notified about yet.
+	Pipeline *const pipeline;
+	const unsigned worker;
+	bool tx_pending = false;
+
 	// @serverfd is a socket receiving queries from clients.
 	// @pollfd is an epoll fd used in the main loop.
 	// @timerfd is used to call Requests::Gc() at the appropriate time.
-	int serverfd = -1, pollfd = -1, timerfd = -1;
+	// @hedgefd is used to call Hedging::Due() if hedging is enabled.
+	// @sigfd receives SIGUSR1, which makes us log the statistics,
+	// and SIGHUP, which makes us reload the @local_records and the
+	// @blocklist.
+	int serverfd = -1, pollfd = -1, timerfd = -1, hedgefd = -1;
+	int sigfd = -1;
+
+	// With @config.hot_restart @handoff_fd accepts the process
+	// replacing us.  During Init() @handoff holds what we've received
+	// from the process we replace through @handoff_conn.  Afterwards
+	// @handoff_conn is the connection of the process replacing us,
+	// whose confirmation we wait for until @handoff_deadline.
+	// Once we've @handed_over, our sockets belong to the new process.
+	int handoff_fd = -1, handoff_conn = -1;
+	Handoff *handoff = NULL;
+	std::chrono::steady_clock::time_point handoff_deadline;
+	bool handed_over = false;
+
+	// Applied to @serverfd and the Upstream sockets.
+	common::sockopts_st sockopts;
+
+	// The servers of all @routes.  The first one is the primary
+	// upstream server of the default route.
+	std::vector<struct server_st> servers;
 
-	// The upstream server address is used in log messages.
-	struct sockaddr_in upstream;
+	// @routes[0] is the default route, made up of the primary and
+	// the secondary upstream servers.  The others are looked up
+	// in @route_table by the QNAME, if there are any.
+	std::vector<struct route_st> routes;
+	Routes *route_table = NULL;
 
 	Requests *requests = NULL;
-	Upstream *sockets  = NULL;
+	Hedging *hedging   = NULL;
+
+	// Queries waiting for @requests to be freed up (or NULL if
+	// @config.max_pending is 0).
+	FairQueue *pending = NULL;
+
+	// Whether the last dispatch_pending() left queries waiting for
+	// @requests, rather than only for the congestion windows of their
+	// servers, and the ones it set aside to put back in the @pending
+	// queue after it.
+	bool pending_for_requests = false;
+	std::vector<struct FairQueue::query_st> blocked;
+
+	SocketBuffers *buffers = NULL;
+	SSL_CTX *tls_ctx = NULL;
+
+	// Stream transports for clients (or NULL if disabled).
+	StreamListener *tcp_listener = NULL, *tls_listener = NULL;
+	SSL_CTX *tls_listener_ctx = NULL;
+	Records *local_records = NULL;
+	Blocklist *blocklist = NULL;
+
+	// Rules to answer queries locally by (or NULL if none are given).
+	Synthesizer *synthesizer = NULL;
+
+	// Locally generated responses are built here.
+	std::vector<char> response;
+
+	// Whether @config.max_memory has been reached, in which case
+	// queries which can't be answered locally are discarded, and
+	// the highest memory usage seen.
+	bool shedding = false;
+	size_t peak_memory = 0;
+
+	// Queries are forwarded again once the memory usage falls below
+	// this percentage of @config.max_memory, so a little headroom is
+	// gained before shedding starts anew.
+	static const unsigned RESUME_PERCENT = 90;
+
+	// Statistics
+	struct
+	{
+		unsigned long long queries, forwarded, answered;
+		unsigned long long local_answers, synthesized, blocked;
+		unsigned long long dropped, expired, lost, tcp_retries;
+		unsigned long long pending_failed, case_mismatches;
+		unsigned long long shed, over_max_requests, affinity_spills;
+		unsigned long long edns_limited, truncated;
+
+		// Messages dropped by the kernel on @serverfd and the
+		// Upstream sockets.
+		unsigned long long client_drops, upstream_drops;
+	} stats = { };
+
+	// The stages of a request's lifetime whose latency is measured.
+	// The time spent in the socket receive queues is only known if
+	// @config.timestamping is enabled.
+	enum
+	{
+		QUERY_QUEUED,		// kernel arrival -> dequeued
+		QUERY_PROCESSED,	// dequeued -> sent upstream
+		UPSTREAM,		// sent upstream -> kernel arrival
+		RESPONSE_QUEUED,	// kernel arrival -> dequeued
+		RESPONSE_PROCESSED,	// dequeued -> sent to the client
+		NSTAGES
+	};
+	Latency stages[NSTAGES];
+
+	// The most frequent clients and QNAMEs of the queries, and QNAMEs
+	// of the NXDOMAIN responses and the expired requests, or NULLs if
+	// @config.heavy_hitters is disabled.
+	enum
+	{
+		TOP_CLIENTS,
+		TOP_QNAMES,
+		TOP_NXDOMAINS,
+		TOP_TIMEOUTS,
+		NTOPS
+	};
+	HeavyHitters *top[NTOPS] = { };
+
+	// Features of the per-packet path which are fixed at startup.
+	// Init() chooses the step() and inject() instantiated with the
+	// policy matching the configuration, so checking them costs
+	// nothing and the code of the disabled ones is compiled out.
+	template <bool D, bool T, bool H>
+	struct policy_st
+	{
+		// Whether debug messages are logged,
+		// @config.timestamping is enabled,
+		// and there is @hedging.
+		static const bool DEBUG = D;
+		static const bool TIMESTAMPING = T;
+		static const bool HEDGING = H;
+	};
+	bool (DNSProxy::*step_fn)(int timeout) = NULL;
+	void (DNSProxy::*inject_fn)(const struct sockaddr_in &client,
+				    uint64_t tag, char *msg, size_t smsg)
+		= NULL;
+
+	// In busy-poll mode Step() doesn't block until @idle_deadline,
+	// which is @config.busy_poll after the last event.
+	bool spinning = false;
+	std::chrono::steady_clock::time_point idle_deadline;
+
+	// The streams of Inject()ed queries are their tags with this bit
+	// set, so they are told apart from the StreamListener connections.
+	static const uint64_t INJECTED = 1ull << 63;
+	response_callback_t *response_callback = NULL;
+	void *response_arg = NULL;
 
 public:
-	DNSProxy(const struct config_st &config);
+	DNSProxy(const struct config_st &config,
+		 Pipeline *pipeline = NULL, unsigned worker = 0);
 	~DNSProxy();
 
-	// Creates @serverfd, @pollfd and @timerfd.
-	// @serverfd is bound to @local_addr:@local_port.
+	// Creates @serverfd, @pollfd, @timerfd and @hedgefd.
+	// @serverfd is bound to @local_addr:@local_port, unless we're
+	// a @pipeline worker, in which case only the stream listeners of
+	// the first worker are.  If @local_addr is NULL, the proxy is
+	// embedded in another program: nothing is listening for clients,
+	// queries are Inject()ed, and signals are left alone.  @secondaries
+	// are "<address>[:<port>]" strings of additional upstream servers.
+	// @routes are "<domain>=<address>[:<port>][,...]" strings of
+	// the servers to forward queries for <domain> to.  Any server
+	// can be given as "tls:<address>[:<port>][#<name>]" to reach it
+	// via DNS-over-TLS.  With @config.hot_restart the sockets and the
+	// requests of the process listening there are taken over.
 	// On error false is returned and the object must be destroyed.
 	bool Init(const char *local_addr, unsigned local_port,
-		  const char *upstream_addr, unsigned upstream_port);
+		  const char *upstream_addr, unsigned upstream_port,
+		  const std::vector<const char *> &secondaries,
+		  const std::vector<const char *> &routes,
+		  const std::vector<const char *> &rules);
 
-	// Runs the main loop.  It never ends actually.
+	// Runs the main loop until we've handed over to a new process
+	// with @config.hot_restart, otherwise it never ends.
 	void Run();
 
+	// The rest is the interface for driving the proxy from the event
+	// loop of the program it's embedded in.  Responses to Inject()ed
+	// queries are passed to @callback(@arg, tag, msg, smsg).
+	void On_response(response_callback_t *callback, void *arg)
+	{
+		this->response_callback = callback;
+		this->response_arg = arg;
+	}
+
+	// All our sockets and timers are watched through this epoll fd,
+	// which becomes readable when Step() has something to do.
+	int Fd() const { return this->pollfd; }
+
+	// How many milliseconds later Step() must be called even if Fd()
+	// doesn't become readable, or -1 if it needn't be.
+	int Timeout() const;
+
+	// Handle one event, waiting up to @timeout milliseconds for it
+	// (-1 for as long as it takes).  Returns false on an unexpected
+	// error, after which the caller should back off for a while.
+	bool Step(int timeout = 0)
+	{
+		return (this->*step_fn)(timeout);
+	}
+
+	// Handle @msg, a query from @client identified by @tag, which must
+	// be less than 2^63.  The response may be of any size and may be
+	// passed to the callback before this returns, if the query is
+	// answered locally.  @msg is clobbered.  Like UDP, the query may
+	// be dropped without a response.
+	void Inject(const struct sockaddr_in &client, uint64_t tag,
+		    char *msg, size_t smsg)
+	{
+		(this->*inject_fn)(client, tag, msg, smsg);
+	}
+
 protected:
 	bool str2addr(struct sockaddr_in *saddr,
 		      const char *addr, unsigned port) const;
+	bool add_server(const char *addr, unsigned port, unsigned route);
+	bool add_servers(const std::string &servers, unsigned port,
+			 unsigned route);
+	bool add_route(const char *route, unsigned port);
+	unsigned find_route(const DNSMessage &query) const;
+	unsigned choose_server(unsigned route, const DNSMessage &query);
+	unsigned find_server(int upstream_fd, TLSUpstream **streamp) const;
 
+	template <class Policy>
 	char *receive_message(int fd, int *smsgp,
-			      struct sockaddr_in *sender = NULL) const;
+			      struct sockaddr_in *sender = NULL,
+			      Latency::duration *queuedp = NULL);
+	template <class Policy>
 	void discard_message(int fd) const;
-	const dns_header_st *parse_message(const struct sockaddr_in &sender,
-					   const char *msg, size_t smsg,
-					   Requests::query_id_t *query_idp,
-					   std::vector<char> &question) const;
+	bool reply(const struct sockaddr_in &client, uint64_t stream,
+		   const char *msg, size_t smsg);
+	template <class Policy>
+	bool parse_message(const struct sockaddr_in &sender,
+			   const char *msg, size_t smsg,
+			   DNSMessage *view) const;
+
+	template <class Policy>
+	bool answer_locally(const struct sockaddr_in &client, uint64_t stream,
+			    const DNSMessage &query);
+	template <class Policy>
+	bool answer_synthesized(const struct sockaddr_in &client,
+				uint64_t stream, const DNSMessage &query);
+	template <class Policy>
+	bool answer_blocked(const struct sockaddr_in &client, uint64_t stream,
+			    const DNSMessage &query);
+	template <class Policy>
+	bool forward_query();
+	template <class Policy>
+	void receive_pipelined_queries();
+	template <class Policy>
+	void receive_stream_queries(StreamListener *listener, int sfd,
+				    uint32_t events);
+	template <class Policy>
+	void handle_query(const struct sockaddr_in &client, uint64_t stream,
+			  char *msg, size_t smsg,
+			  std::chrono::steady_clock::time_point dequeued,
+			  bool can_forward);
+	template <class Policy>
+	void forward_request(const struct sockaddr_in &client,
+			     uint64_t stream, DNSMessage &view,
+			     unsigned server, char *msg, size_t smsg,
+			     std::chrono::steady_clock::time_point dequeued);
+	template <class Policy>
+	void dispatch_pending();
+	template <class Policy>
+	void fail_pending(struct FairQueue::query_st &query);
+	bool window_open(unsigned server) const;
+	bool any_window_open() const;
+	size_t memory_usage() const;
+	bool check_memory();
+	bool send_query(unsigned server, bool over_tcp, char *msg, size_t smsg,
+			Requests::request_id_t *request_idp);
+	template <class Policy>
+	bool return_response(unsigned server, int upstream_fd);
+	template <class Policy>
+	void return_stream_responses(unsigned server, TLSUpstream *upstream,
+				     int upstream_fd, uint32_t events);
+	template <class Policy>
+	void process_response(unsigned server, int upstream_fd,
+			      char *msg, size_t smsg,
+			      Latency::duration queued);
+	template <class Policy>
+	bool resend_over_tcp(Requests::request_id_t request_id,
+			     const struct Requests::request_st *request);
+	template <class Policy>
+	bool hedge_query(Requests::request_id_t request_id);
+	template <class Policy>
+	void done(Requests::request_id_t request_id,
+		  const struct Requests::request_st *request);
+	void release_socket(const struct Requests::request_st *request);
+	template <class Policy>
+	void expired(Requests::request_id_t request_id,
+		     const struct Requests::request_st *request);
+	static void lost_connection(void *arg, int upstream_fd);
+	void lost(Requests::request_id_t request_id,
+		  const struct Requests::request_st *request);
+
+	void case_mismatch(unsigned server);
+	void count_name(unsigned top, const char *name, size_t sname);
+	void reload();
+	void dump_stats() const;
+
+	bool take_over();
+	bool adopt_requests();
+	void hand_over();
+	bool finish_hand_over();
+	void give_up_hand_over();
 
-	bool forward_query() const;
-	bool return_response(int upstream_fd) const;
+	template <bool D, bool T, bool H>
+	void use_policy();
+	template <class Policy>
+	bool step(int timeout);
+	template <class Policy>
+	void inject(const struct sockaddr_in &client, uint64_t tag,
+		    char *msg, size_t smsg);
 };
 
 #endif // ! DNS_PROXY_H
@@ -0,0 +1,109 @@
+// Include files
+#include <cassert>
+#include <utility>
+
+#include "FairQueue.h"
+
+// Static member definitions
+const unsigned FairQueue::NFLOWS;
+const unsigned FairQueue::QUANTUM;
+
+// Program code
+FairQueue::FairQueue(unsigned max_queries):
+	MAX_QUERIES(max_queries), flows(NFLOWS)
+{
+	assert(MAX_QUERIES > 0);
+}
+
+// Fibonacci hashing of the client's address.  Clients behind the same
+// address share a flow.
+unsigned FairQueue::flow_of(const struct sockaddr_in &client)
+{
+	return (client.sin_addr.s_addr * 2654435769u) >> 24;
+}
+
+void FairQueue::Push(struct query_st &query)
+{
+	unsigned i = flow_of(query.client);
+	struct flow_st &flow = this->flows[i];
+
+	this->nbytes += size_of(query);
+	flow.queries.push_back(std::move(query));
+	this->nqueued++;
+	this->nqueries++;
+	if (!flow.scheduled)
+	{
+		this->active.push_back(i);
+		flow.scheduled = true;
+	}
+
+	if (this->nqueries <= MAX_QUERIES)
+		return;
+
+	// Make room by dropping from the longest flow.
+	struct flow_st *longest = &flow;
+	for (auto &candidate: this->flows)
+		if (candidate.queries.size() > longest->queries.size())
+			longest = &candidate;
+
+	this->nbytes -= size_of(longest->queries.back());
+	longest->queries.pop_back();
+	this->nqueries--;
+	this->ndropped++;
+}
+
+bool FairQueue::Pop(struct query_st *queryp)
+{
+	while (!this->active.empty())
+	{
+		unsigned i = this->active.front();
+		struct flow_st &flow = this->flows[i];
+
+		if (flow.queries.empty())
+		{	// The flow has no more queries, so it loses its turn
+			// and the credit it has left.
+			this->active.pop_front();
+			flow.scheduled = false;
+			flow.deficit = 0;
+			continue;
+		}
+
+		size_t cost = flow.queries.front().msg.size();
+		if (flow.deficit < cost)
+		{	// Not enough credit for the next query, move on
+			// to the next flow.
+			flow.deficit += QUANTUM;
+			this->active.pop_front();
+			this->active.push_back(i);
+			continue;
+		}
+
+		flow.deficit -= cost;
+		this->nbytes -= size_of(flow.queries.front());
+		*queryp = std::move(flow.queries.front());
+		flow.queries.pop_front();
+		this->nqueries--;
+		return true;
+	}
+
+	return false;
+}
+
+void FairQueue::Unpop(struct query_st &query)
+{	// If the flow of @query has lost its turn since, having been left
+	// empty, it waits for a new one.
+	unsigned i = flow_of(query.client);
+	struct flow_st &flow = this->flows[i];
+
+	if (!flow.scheduled)
+	{
+		this->active.push_back(i);
+		flow.scheduled = true;
+	} else
+		flow.deficit += query.msg.size();
+	this->nbytes += size_of(query);
+	flow.queries.push_front(std::move(query));
+	this->nqueries++;
+}
+
+// End of FairQueue.cc
@@ -0,0 +1,111 @@
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include <cstdint>
+#include <chrono>
+#include <vector>
+#include <deque>
+
+#include <netinet/in.h>
+
+// Bounded queue of the queries waiting for a request to be freed up,
+// shared fairly between the clients with deficit round-robin.  Clients
+// are hashed by address into @NFLOWS flows, each a FIFO.  The active
+// flows take turns, each earning @QUANTUM bytes of credit per turn,
+// which is spent on the size of the queries taken from it.  When the
+// queue is full, the newest query of the longest flow is dropped, so
+// a client flooding the proxy mostly loses its own queries.
+class FairQueue
+{
+public:
+	struct query_st
+	{
+		struct sockaddr_in client;
+		uint64_t stream;
+		std::chrono::steady_clock::time_point received;
+		std::vector<char> msg;
+	};
+
+protected:
+	static const unsigned NFLOWS = 256;
+	static const unsigned QUANTUM = 512;
+
+	// Initialized from command line options.
+	const unsigned MAX_QUERIES;
+
+	struct flow_st
+	{
+		std::deque<struct query_st> queries;
+		unsigned deficit = 0;
+
+		// Whether the flow is in @active.
+		bool scheduled = false;
+	};
+	std::vector<struct flow_st> flows;
+
+	// The flows with queries in round-robin order.  Flows emptied
+	// by dropping or expiring their queries are only removed from it
+	// when their turn comes.
+	std::deque<unsigned> active;
+
+	// The total number of queries in the @flows and the bytes
+	// they hold.
+	unsigned nqueries = 0;
+	size_t nbytes = 0;
+
+public:
+	// Statistics: the number of queries queued and dropped because
+	// the queue was full.
+	unsigned long long nqueued = 0, ndropped = 0;
+
+	FairQueue(unsigned max_queries);
+
+	bool Empty() const { return !this->nqueries; }
+	size_t Memory() const { return this->nbytes; }
+
+	// Queue @query, moving its contents.  If the queue is full,
+	// the newest query of the longest flow is dropped, which may be
+	// @query itself.
+	void Push(struct query_st &query);
+
+	// Take the next query in turn.  Returns false if the queue
+	// is empty.
+	bool Pop(struct query_st *queryp);
+
+	// Put back @query, taken by Pop(), at the front of its flow,
+	// giving back the credit it took.
+	void Unpop(struct query_st &query);
+
+	// Remove the queries received before @deadline, calling
+	// @callback(struct query_st &) for each.
+	template <typename Callback>
+	void Expire(std::chrono::steady_clock::time_point deadline,
+		    Callback callback);
+
+protected:
+	static unsigned flow_of(const struct sockaddr_in &client);
+	static size_t size_of(const struct query_st &query)
+	{
+		return sizeof(query) + query.msg.capacity();
+	}
+};
+
+// Template definitions
+template <typename Callback>
+void FairQueue::Expire(std::chrono::steady_clock::time_point deadline,
+		       Callback callback)
+{	// Every flow is a FIFO, so the old queries are at their fronts.
+	for (unsigned i: this->active)
+	{
+		auto &queries = this->flows[i].queries;
+		while (!queries.empty() && queries.front().received < deadline)
+		{
+			callback(queries.front());
+			this->nbytes -= size_of(queries.front());
+			queries.pop_front();
+			this->nqueries--;
+		}
+	}
+}
+
+#endif // ! FAIR_QUEUE_H
@@ -0,0 +1,439 @@
+// Include files
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "Handoff.h"
+
+// Static member definitions
+const uint32_t Handoff::MAGIC;
+const unsigned Handoff::MAX_FDS_PER_MESSAGE;
+const unsigned Handoff::TIMEOUT;
+
+// Program code
+// Write all @sbuf bytes of @buf to @sfd.  On error logs it and returns false.
+static bool write_all(int sfd, const void *buf, size_t sbuf)
+{
+	const char *p = static_cast<const char *>(buf);
+
+	while (sbuf > 0)
+	{
+		ssize_t n = write(sfd, p, sbuf);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			common::Log_error("write(handoff): %m");
+			return false;
+		}
+		p += n;
+		sbuf -= n;
+	}
+
+	return true;
+}
+
+// Read exactly @sbuf bytes from @sfd into @buf.  On error or if the peer
+// goes away logs it and returns false.
+static bool read_all(int sfd, void *buf, size_t sbuf)
+{
+	char *p = static_cast<char *>(buf);
+
+	while (sbuf > 0)
+	{
+		ssize_t n = read(sfd, p, sbuf);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			if (n < 0)
+				common::Log_error("read(handoff): %m");
+			else
+				common::Log_error("read(handoff): "
+						  "connection closed");
+			return false;
+		}
+		p += n;
+		sbuf -= n;
+	}
+
+	return true;
+}
+
+// Don't let a stuck peer block us for more than @timeout seconds.
+static void set_timeouts(int sfd, unsigned timeout)
+{
+	struct timeval tv = { static_cast<time_t>(timeout), 0 };
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0
+	    || setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		common::Log_error("setsockopt(SO_RCVTIMEO): %m");
+}
+
+// Whether the process at the other end of @sfd runs as our user, who alone
+// may take our sockets or give us theirs.  If not logs it.
+static bool same_user(int sfd)
+{
+	struct ucred cred;
+	socklen_t scred = sizeof(cred);
+
+	if (getsockopt(sfd, SOL_SOCKET, SO_PEERCRED, &cred, &scred) < 0)
+	{
+		common::Log_error("getsockopt(SO_PEERCRED): %m");
+		return false;
+	} else if (cred.uid != geteuid())
+	{
+		common::Log_error("Refusing hot restart with process %d "
+				  "of user %u", cred.pid, cred.uid);
+		return false;
+	}
+
+	return true;
+}
+
+// Fill @addr with @path.  Returns false if it's too long.
+static bool unix_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		common::Log_error("%s: path too long", path);
+		return false;
+	}
+
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+Handoff::~Handoff()
+{
+	if (!this->received)
+		return;
+
+	for (const auto &socket: this->sockets)
+		if (socket.fd >= 0)
+			close(socket.fd);
+}
+
+int Handoff::Listen(const char *path)
+{
+	int sfd;
+	struct sockaddr_un addr;
+
+	if (!unix_addr(&addr, path))
+		return -1;
+
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			  0)) < 0)
+	{
+		common::Log_error("socket(handoff): %m");
+		return -1;
+	}
+
+	// The process we've taken over from, if any, is done with it.
+	// Only our user may connect to the new one, which is created
+	// with mode 0600.
+	if (unlink(path) < 0 && errno != ENOENT)
+		common::Log_error("unlink(%s): %m", path);
+	mode_t umask_was = umask(S_IRWXG | S_IRWXO);
+	int ret = bind(sfd, reinterpret_cast<const struct sockaddr *>(&addr),
+		       sizeof(addr));
+	umask(umask_was);
+	if (ret < 0)
+	{
+		common::Log_error("bind(%s): %m", path);
+		close(sfd);
+		return -1;
+	} else if (listen(sfd, 1) < 0)
+	{
+		common::Log_error("listen(%s): %m", path);
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+bool Handoff::Connect(const char *path, int *sfdp)
+{
+	struct sockaddr_un addr;
+
+	if (!unix_addr(&addr, path))
+		return false;
+
+	if ((*sfdp = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+	{
+		common::Log_error("socket(handoff): %m");
+		return false;
+	} else if (connect(*sfdp,
+			   reinterpret_cast<const struct sockaddr *>(&addr),
+			   sizeof(addr)) < 0)
+	{	// No process is running at @path, or it's gone
+		// without removing it.
+		bool nobody = errno == ENOENT || errno == ECONNREFUSED;
+		if (!nobody)
+			common::Log_error("connect(%s): %m", path);
+		close(*sfdp);
+		*sfdp = -1;
+		return nobody;
+	} else if (!same_user(*sfdp))
+	{
+		close(*sfdp);
+		*sfdp = -1;
+		return false;
+	}
+
+	set_timeouts(*sfdp, TIMEOUT);
+	return true;
+}
+
+int Handoff::Accept(int listenfd)
+{
+	int sfd;
+
+	// Unlike the listening socket, @sfd is blocking.
+	if ((sfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+	{
+		if (errno != EAGAIN)
+			common::Log_error("accept(handoff): %m");
+		return -1;
+	} else if (!same_user(sfd))
+	{
+		close(sfd);
+		return -1;
+	}
+
+	set_timeouts(sfd, TIMEOUT);
+	return sfd;
+}
+
+void Handoff::Add_socket(enum kind_t kind, int fd,
+			 unsigned lifetime, bool retired)
+{
+	this->sockets.push_back(
+		socket_st { kind, fd, fd, lifetime, retired });
+}
+
+void Handoff::Put(const std::vector<char> &bytes)
+{
+	Put(static_cast<uint32_t>(bytes.size()));
+	this->state.insert(this->state.end(), bytes.begin(), bytes.end());
+}
+
+bool Handoff::Get(std::vector<char> *bytesp)
+{
+	uint32_t size;
+
+	if (!Get(&size) || this->state.size() - this->offset < size)
+		return false;
+	bytesp->assign(&this->state[this->offset],
+		       &this->state[this->offset] + size);
+	this->offset += size;
+	return true;
+}
+
+// The header is followed by the @sockets, whose fds are meaningless to the
+// receiving process except as @orig_fd, then the fds themselves in batches
+// of at most @MAX_FDS_PER_MESSAGE, each attached to a single byte, and
+// finally the @state.
+bool Handoff::Send(int sfd) const
+{
+	struct header_st header =
+	{
+		MAGIC,
+		static_cast<uint32_t>(this->sockets.size()),
+		this->state.size(),
+	};
+
+	if (!write_all(sfd, &header, sizeof(header)))
+		return false;
+	for (const auto &socket: this->sockets)
+		if (!write_all(sfd, &socket, sizeof(socket)))
+			return false;
+
+	for (size_t i = 0; i < this->sockets.size(); )
+	{
+		union
+		{
+			char buf[CMSG_SPACE(sizeof(int)
+					    * MAX_FDS_PER_MESSAGE)];
+			struct cmsghdr align;
+		} control;
+		char byte = 0;
+		struct iovec iov = { &byte, sizeof(byte) };
+		struct msghdr msg = { };
+		size_t n = std::min(this->sockets.size() - i,
+				    size_t(MAX_FDS_PER_MESSAGE));
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		int *fds = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+		for (size_t j = 0; j < n; j++)
+			fds[j] = this->sockets[i + j].fd;
+
+		if (sendmsg(sfd, &msg, 0) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			common::Log_error("sendmsg(handoff): %m");
+			return false;
+		}
+		i += n;
+	}
+
+	return this->state.empty()
+		|| write_all(sfd, &this->state[0], this->state.size());
+}
+
+bool Handoff::Receive(int sfd)
+{
+	struct header_st header;
+
+	if (!read_all(sfd, &header, sizeof(header)))
+		return false;
+	if (header.magic != MAGIC)
+	{
+		common::Log_error("The running process is of an incompatible "
+				  "version");
+		return false;
+	}
+
+	// Until the fds are received they're not ours to close.
+	this->sockets.resize(header.nsockets);
+	if (!this->sockets.empty()
+	    && !read_all(sfd, &this->sockets[0],
+			 sizeof(this->sockets[0]) * this->sockets.size()))
+	{
+		this->sockets.clear();
+		return false;
+	}
+	for (auto &socket: this->sockets)
+		socket.fd = -1;
+	this->received = true;
+
+	for (size_t i = 0; i < this->sockets.size(); )
+	{
+		union
+		{
+			char buf[CMSG_SPACE(sizeof(int)
+					    * MAX_FDS_PER_MESSAGE)];
+			struct cmsghdr align;
+		} control;
+		char byte;
+		struct iovec iov = { &byte, sizeof(byte) };
+		struct msghdr msg = { };
+		ssize_t ret;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if ((ret = recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			common::Log_error("recvmsg(handoff): %m");
+			return false;
+		} else if (!ret)
+		{
+			common::Log_error("recvmsg(handoff): "
+					  "connection closed");
+			return false;
+		}
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		size_t n = 0;
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SCM_RIGHTS)
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for (size_t j = 0; j < n; j++)
+		{
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + j * sizeof(fd),
+			       sizeof(fd));
+			if (i + j < this->sockets.size())
+				this->sockets[i + j].fd = fd;
+			else
+				close(fd);
+		}
+
+		if (!n || (msg.msg_flags & MSG_CTRUNC)
+		    || i + n > this->sockets.size())
+		{
+			common::Log_error("recvmsg(handoff): "
+					  "sockets missing");
+			return false;
+		}
+		i += n;
+	}
+
+	this->state.resize(header.sstate);
+	this->offset = 0;
+	return this->state.empty()
+		|| read_all(sfd, &this->state[0], this->state.size());
+}
+
+int Handoff::Take_socket(enum kind_t kind, const struct sockaddr_in &addr)
+{
+	for (auto &socket: this->sockets)
+	{
+		struct sockaddr_in bound;
+
+		if (socket.kind != kind || socket.fd < 0
+		    || !common::GetSockName(socket.fd, &bound))
+			continue;
+		if (bound.sin_addr.s_addr != addr.sin_addr.s_addr
+		    || bound.sin_port != addr.sin_port)
+			continue;
+
+		int fd = socket.fd;
+		socket.fd = -1;
+		return fd;
+	}
+
+	return -1;
+}
+
+bool Handoff::Confirm(int sfd)
+{
+	const char byte = 1;
+	char ack;
+
+	if (!write_all(sfd, &byte, sizeof(byte)))
+		return false;
+
+	// The sending process acknowledges right away, or closes the
+	// connection if it has given up on us, or dies, so we don't time
+	// out: that could leave neither process with the sockets.
+	set_timeouts(sfd, 0);
+	return read_all(sfd, &ack, sizeof(ack)) && ack == 1;
+}
+
+bool Handoff::Confirmed(int sfd)
+{
+	char byte;
+	const char ack = 1;
+
+	return read_all(sfd, &byte, sizeof(byte)) && byte == 1
+		&& write_all(sfd, &ack, sizeof(ack));
+}
+
+// End of Handoff.cc
@@ -0,0 +1,148 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <netinet/in.h>
+
+// Class carrying the sockets and the state of a running proxy over to the
+// process replacing it (hot restart).  The running process listens on
+// a unix socket.  The new one connects to it and is sent the sockets with
+// SCM_RIGHTS, along with the state serialized by Put().  The sockets are
+// shared by the two processes until the old one exits: it keeps serving
+// until the new one has confirmed it's ready, and it has acknowledged it.
+class Handoff
+{
+public:
+	enum kind_t
+	{
+		// The UDP socket receiving the queries of clients,
+		// and the TCP and TLS listening sockets.
+		CLIENT_SOCKET,
+		LISTENER,
+
+		// A socket connected to an upstream server.
+		UPSTREAM_SOCKET,
+	};
+
+	struct socket_st
+	{
+		enum kind_t kind;
+
+		// The socket in this process, or -1 if it has been taken,
+		// and its fd in the sending process, which the state may
+		// refer to.
+		int fd, orig_fd;
+
+		// For upstream sockets the number of queries forwarded
+		// through it, and whether it won't be used for new ones.
+		unsigned lifetime;
+		bool retired;
+	};
+
+	// How long either process waits for the other one, in seconds.
+	static const unsigned TIMEOUT = 10;
+
+protected:
+	// Identifies the format of the messages.  Changing them or the state
+	// serialized by Put() needs a new one, so a process can't take over
+	// from another one it doesn't understand.
+	static const uint32_t MAGIC = 0x444e5303;
+
+	// SCM_MAX_FD of the kernel is 253.
+	static const unsigned MAX_FDS_PER_MESSAGE = 250;
+
+	// Preceding the sockets and the state on the wire.
+	struct header_st
+	{
+		uint32_t magic;
+		uint32_t nsockets;
+		uint64_t sstate;
+	};
+
+	std::vector<struct socket_st> sockets;
+	std::vector<char> state;
+
+	// Where Get() continues reading the @state, and whether
+	// the @sockets have been received, so we own them.
+	size_t offset = 0;
+	bool received = false;
+
+public:
+	~Handoff();
+
+	// Create the unix socket a new process can connect to at @path,
+	// replacing any stale one.  Only our user can connect to it.
+	// Returns -1 on error.
+	static int Listen(const char *path);
+
+	// Connect to the process listening at @path and return the socket
+	// in *@sfdp, or -1 if there's none.  Returns false on error,
+	// or if the process doesn't run as our user.
+	static bool Connect(const char *path, int *sfdp);
+
+	// Accept the connection of a new process on @listenfd.
+	// Returns -1 on error, or if it doesn't run as our user.
+	static int Accept(int listenfd);
+
+	// Called by the sending process to add a socket to be sent,
+	// and to serialize the state, which must be done in the order
+	// the receiving process will Get() it.
+	void Add_socket(enum kind_t kind, int fd,
+			unsigned lifetime = 0, bool retired = false);
+	template <typename T>
+	void Put(const T &value);
+	void Put(const std::vector<char> &bytes);
+
+	// Send the sockets and the state over @sfd, or receive them.
+	// Returns false on error.
+	bool Send(int sfd) const;
+	bool Receive(int sfd);
+
+	// The sockets received.  The ones not taken by setting their
+	// @fd to -1 are closed when the object is destroyed.
+	std::vector<struct socket_st> &Sockets() { return this->sockets; }
+
+	// Take the socket of @kind bound to @addr if it was received,
+	// otherwise return -1.
+	int Take_socket(enum kind_t kind, const struct sockaddr_in &addr);
+
+	// Read the next piece of the state received.  Returns false if
+	// there isn't any more.
+	template <typename T>
+	bool Get(T *valuep);
+	bool Get(std::vector<char> *bytesp);
+
+	// Called by the receiving process when it's ready to take over.
+	// Returns true once the sending process has acknowledged it,
+	// after which the sockets are ours.  Returns false if it has
+	// given up on us instead.
+	static bool Confirm(int sfd);
+
+	// Called by the sending process when @sfd becomes readable.
+	// Returns true if the receiving process has confirmed and we've
+	// acknowledged it, after which the sockets are no longer ours.
+	static bool Confirmed(int sfd);
+};
+
+// Template definitions
+template <typename T>
+void Handoff::Put(const T &value)
+{
+	const char *bytes = reinterpret_cast<const char *>(&value);
+	this->state.insert(this->state.end(), bytes, bytes + sizeof(value));
+}
+
+template <typename T>
+bool Handoff::Get(T *valuep)
+{
+	if (this->state.size() - this->offset < sizeof(*valuep))
+		return false;
+	memcpy(valuep, &this->state[this->offset], sizeof(*valuep));
+	this->offset += sizeof(*valuep);
+	return true;
+}
+
+#endif // ! HANDOFF_H
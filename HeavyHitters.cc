@@ -0,0 +1,168 @@
+// Include files
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+#include "HeavyHitters.h"
+
+// Static member definitions
+const unsigned HeavyHitters::DEPTH;
+const unsigned HeavyHitters::WIDTH;
+const unsigned HeavyHitters::WINDOW;
+
+// Program code
+HeavyHitters::HeavyHitters(unsigned k): K(k)
+{
+	assert(K > 0);
+	this->top.reserve(K);
+	this->positions.reserve(K);
+}
+
+// FNV-1a finalized with the mixer of splitmix64, like the Blocklist's.
+uint64_t HeavyHitters::hash_of(const char *key, size_t skey)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < skey; i++)
+	{
+		hash ^= static_cast<uint8_t>(key[i]);
+		hash *= 0x100000001b3ull;
+	}
+
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+	return hash ^ (hash >> 31);
+}
+
+void HeavyHitters::Add(const char *key, size_t skey)
+{
+	const uint64_t hash = hash_of(key, skey);
+
+	// Each row of the @sketch is indexed by a different part of @hash
+	// (double hashing).  The estimate is the smallest counter, which
+	// is the least inflated by collisions.
+	const unsigned h1 = hash, h2 = (hash >> 32) | 1;
+	unsigned estimate = ~0u;
+	for (unsigned row = 0; row < DEPTH; row++)
+	{
+		unsigned &counter = this->sketch[row][(h1 + row*h2) % WIDTH];
+		estimate = std::min(estimate, ++counter);
+	}
+
+	// Keys estimated below the @threshold can't be in the @top.
+	if (estimate >= this->threshold)
+		update_top(hash, estimate, key, skey);
+
+	if (++this->nadded >= WINDOW)
+		decay();
+}
+
+// Update @key if it's already in the @top, otherwise replace the least
+// frequent one if @key is more frequent.
+void HeavyHitters::update_top(uint64_t hash, unsigned estimate,
+			      const char *key, size_t skey)
+{
+	auto found = this->positions.find(hash);
+	if (found != this->positions.end())
+	{
+		unsigned pos = found->second;
+		struct entry_st &entry = this->top[pos];
+		if (entry.key.size() != skey
+		    || memcmp(entry.key.data(), key, skey))
+			// Hash collision, very unlikely.
+			return;
+
+		bool increased = estimate >= entry.count;
+		entry.count = estimate;
+		if (increased)
+			sift_down(pos);
+		else
+			sift_up(pos);
+	} else if (this->top.size() < K)
+	{
+		this->top.push_back(entry_st{ hash, estimate,
+					      std::string(key, skey) });
+		this->positions[hash] = this->top.size() - 1;
+		sift_up(this->top.size() - 1);
+	} else if (estimate > this->top[0].count)
+	{
+		struct entry_st &least = this->top[0];
+		this->positions.erase(least.hash);
+		least.hash = hash;
+		least.count = estimate;
+		least.key.assign(key, skey);
+		this->positions[hash] = 0;
+		sift_down(0);
+	}
+
+	update_threshold();
+}
+
+void HeavyHitters::update_threshold()
+{
+	this->threshold = this->top.size() < K ? 0 : this->top[0].count;
+}
+
+// Move the entry at @pos up the heap while it's less than its parent.
+void HeavyHitters::sift_up(unsigned pos)
+{
+	while (pos > 0)
+	{
+		unsigned parent = (pos - 1) / 2;
+		if (this->top[parent].count <= this->top[pos].count)
+			break;
+		swap_entries(parent, pos);
+		pos = parent;
+	}
+}
+
+// Move the entry at @pos down the heap while it's greater than
+// the lesser of its children.
+void HeavyHitters::sift_down(unsigned pos)
+{
+	for (;;)
+	{
+		unsigned least = pos, child = 2*pos + 1;
+		for (unsigned i = child; i < child + 2 && i < this->top.size();
+		     i++)
+			if (this->top[i].count < this->top[least].count)
+				least = i;
+		if (least == pos)
+			break;
+		swap_entries(pos, least);
+		pos = least;
+	}
+}
+
+void HeavyHitters::swap_entries(unsigned i, unsigned j)
+{
+	std::swap(this->top[i], this->top[j]);
+	this->positions[this->top[i].hash] = i;
+	this->positions[this->top[j].hash] = j;
+}
+
+void HeavyHitters::decay()
+{
+	for (auto &row: this->sketch)
+		for (auto &counter: row)
+			counter /= 2;
+	// Halving keeps the order of the counts, and so the heap.
+	for (auto &entry: this->top)
+		entry.count /= 2;
+	this->nadded = 0;
+	update_threshold();
+}
+
+std::vector<struct HeavyHitters::hitter_st> HeavyHitters::Top() const
+{
+	std::vector<struct hitter_st> top;
+
+	for (const auto &entry: this->top)
+		if (entry.count > 0)
+			top.push_back(hitter_st{ entry.key, entry.count });
+	std::sort(top.begin(), top.end(),
+		  [](const struct hitter_st &lhs, const struct hitter_st &rhs)
+		  { return lhs.count > rhs.count; });
+	return top;
+}
+
+// End of HeavyHitters.cc
@@ -0,0 +1,76 @@
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Class finding the most frequent keys (client addresses or names) in
+// a stream of them in constant space.  A count-min sketch estimates how
+// many times each key has been seen, and the @K keys with the highest
+// estimates are kept in a min-heap, so keys which can't make it into
+// the top are rejected by comparing with its root, and the others cost
+// O(log K).  Like Latency, all counts are halved every @WINDOW keys,
+// so the top keys follow the recent traffic.
+class HeavyHitters
+{
+public:
+	struct hitter_st
+	{
+		std::string key;
+		unsigned count;
+	};
+
+protected:
+	// The dimensions of @sketch.  The estimates are too high by at most
+	// 2/@WIDTH of the window with a probability of 1 - 2^-@DEPTH.
+	static const unsigned DEPTH = 4;
+	static const unsigned WIDTH = 1024;
+
+	// The number of keys after which all counts are halved.
+	static const unsigned WINDOW = 65536;
+
+	const unsigned K;
+
+	unsigned sketch[DEPTH][WIDTH] = { };
+	unsigned nadded = 0;
+
+	// The top keys in a min-heap by their count, and the positions
+	// of their hashes in it.
+	struct entry_st
+	{
+		uint64_t hash;
+		unsigned count;
+		std::string key;
+	};
+	std::vector<struct entry_st> top;
+	std::unordered_map<uint64_t, unsigned> positions;
+
+	// The lowest count in the @top once it's full, and 0 until then.
+	unsigned threshold = 0;
+
+public:
+	// Keep track of the top @k keys.
+	HeavyHitters(unsigned k);
+
+	// Count an occurrence of @key of @skey bytes.
+	void Add(const char *key, size_t skey);
+
+	// Return the top keys ordered by their estimated count, highest
+	// first.
+	std::vector<struct hitter_st> Top() const;
+
+protected:
+	static uint64_t hash_of(const char *key, size_t skey);
+	void update_top(uint64_t hash, unsigned estimate,
+			const char *key, size_t skey);
+	void update_threshold();
+	void sift_up(unsigned pos);
+	void sift_down(unsigned pos);
+	void swap_entries(unsigned i, unsigned j);
+	void decay();
+};
+
+#endif // ! HEAVY_HITTERS_H
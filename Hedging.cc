@@ -0,0 +1,88 @@
+// Include files
+#include <cassert>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "Latency.h"
+#include "Hedging.h"
+
+// Program code
+Hedging::Hedging(unsigned percentile, unsigned budget, int timerfd):
+	PERCENTILE(percentile),
+	BUDGET(budget),
+	hedge_timer(timerfd),
+	credit(0)
+{
+	assert(PERCENTILE > 0 && PERCENTILE <= 100);
+}
+
+Hedging::~Hedging()
+{	// Make sure @hedge_timer is stopped.
+	this->scheduled.clear();
+	this->deadlines.clear();
+	update_hedge_timer();
+}
+
+void Hedging::Schedule(Requests::request_id_t request_id, const Latency &rtt)
+{
+	// Every forwarded query contributes to the budget.
+	this->credit += BUDGET;
+	if (this->credit > MAX_BURST*100)
+		this->credit = MAX_BURST*100;
+
+	if (rtt.Count() < MIN_SAMPLES)
+		return;
+
+	auto deadline = std::chrono::steady_clock::now()
+		+ rtt.Percentile(PERCENTILE);
+	auto ret = this->scheduled.emplace(request_id, deadline);
+	assert(ret.second == true);
+
+	bool is_first = this->deadlines.empty()
+		|| deadline < this->deadlines.begin()->first;
+	this->deadlines.emplace(deadline, request_id);
+	if (is_first)
+		update_hedge_timer();
+}
+
+void Hedging::Cancel(Requests::request_id_t request_id)
+{
+	auto i = this->scheduled.find(request_id);
+	if (i == this->scheduled.end())
+		return;
+
+	auto o = this->deadlines.find(std::make_pair(i->second, request_id));
+	assert(o != this->deadlines.end());
+	bool is_first = o == this->deadlines.begin();
+
+	this->deadlines.erase(o);
+	this->scheduled.erase(i);
+	if (is_first)
+		update_hedge_timer();
+}
+
+void Hedging::update_hedge_timer()
+{
+	struct itimerspec ts_expiry = { { 0, 0 }, { 0, 0 } };
+
+	if (!this->deadlines.empty())
+	{
+		const auto t = this->deadlines.begin()->first
+			.time_since_epoch();
+		ts_expiry.it_value.tv_sec = t.count()
+			* decltype(t)::period::num
+			/ decltype(t)::period::den;
+		ts_expiry.it_value.tv_nsec =
+			common::XsofT<std::chrono::nanoseconds>(t);
+
+		// All zeroes would disarm the timer.
+		if (!ts_expiry.it_value.tv_sec && !ts_expiry.it_value.tv_nsec)
+			ts_expiry.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(this->hedge_timer, TFD_TIMER_ABSTIME,
+			    &ts_expiry, NULL) < 0)
+		common::Log_error("timerfd_settime(hedge): %m");
+}
+
+// End of Hedging.cc
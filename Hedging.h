@@ -0,0 +1,101 @@
+#ifndef HEDGING_H
+#define HEDGING_H
+
+#include <chrono>
+#include <set>
+#include <unordered_map>
+
+#include "common.h"
+#include "Requests.h"
+
+// Forward declarations
+class Latency;
+
+// Class deciding when a forwarded query should be sent to a second
+// upstream server as well, because the first one is slower than usual
+// to respond.
+class Hedging
+{
+protected:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	// Initialized from command line options.
+	const unsigned PERCENTILE;
+	const unsigned BUDGET;
+
+	// Don't hedge until the upstream server's Latency is known
+	// from at least this many responses.
+	static const unsigned MIN_SAMPLES = 20;
+
+	// At most this many hedged queries can be sent in a burst,
+	// regardless of the accumulated budget.
+	static const unsigned MAX_BURST = 10;
+
+	// A timerfd which ticks when the earliest hedge is due.
+	int hedge_timer;
+
+	// Hedges are paid for by @credit, which increases by @BUDGET
+	// with every forwarded query.  A hedge costs 100.
+	unsigned credit;
+
+	// Request ID -> hedging time.
+	std::unordered_map<Requests::request_id_t, time_point> scheduled;
+
+	// Set of <hedging time, request ID>s.
+	std::set<std::pair<time_point, Requests::request_id_t>> deadlines;
+
+public:
+	// Statistics
+	unsigned long long nhedged = 0, nover_budget = 0;
+
+	Hedging(unsigned percentile, unsigned budget, int timerfd);
+	~Hedging();
+
+	// Called when a query is forwarded to a server with @rtt.
+	// Schedules the hedging of @request_id if the server is well-known.
+	void Schedule(Requests::request_id_t request_id, const Latency &rtt);
+
+	// Called when @request_id is answered or expired.
+	void Cancel(Requests::request_id_t request_id);
+
+	// Called when @hedge_timer ticks.  @callback is called for every
+	// query whose hedge is due and which fits in the budget, with its
+	// Requests::request_id_t, and returns whether it has sent the hedge.
+	// Only hedges sent are paid for.
+	template <typename Callback>
+	void Due(Callback callback);
+
+protected:
+	void update_hedge_timer();
+};
+
+// Template definitions
+template <typename Callback>
+void Hedging::Due(Callback callback)
+{
+	auto now = std::chrono::steady_clock::now();
+	while (!this->deadlines.empty()
+	       && this->deadlines.begin()->first <= now)
+	{
+		auto request_id = this->deadlines.begin()->second;
+		this->deadlines.erase(this->deadlines.begin());
+		this->scheduled.erase(request_id);
+
+		if (this->credit < 100)
+		{
+			common::Log_debug("Request %u: hedging over budget",
+					  Requests::Query_id(request_id));
+			this->nover_budget++;
+			continue;
+		}
+
+		if (!callback(request_id))
+			continue;
+		this->credit -= 100;
+		this->nhedged++;
+	}
+
+	update_hedge_timer();
+}
+
+#endif // ! HEDGING_H
@@ -0,0 +1,70 @@
+// Include files
+#include <cassert>
+
+#include "Latency.h"
+
+// Program code
+unsigned Latency::bucket_of(duration rtt)
+{
+	auto v = rtt.count() > 0 ? static_cast<unsigned long long>(rtt.count())
+				 : 0ull;
+	if (v < 4)
+		return v;
+
+	// @e is the index of the highest bit set in @v, the next two bits
+	// select the sub-bucket.
+	unsigned e = 63 - __builtin_clzll(v);
+	unsigned bucket = 4*(e-1) + ((v >> (e-2)) & 3);
+	return bucket < NBUCKETS ? bucket : NBUCKETS-1;
+}
+
+Latency::duration Latency::upper_bound(unsigned bucket)
+{
+	if (bucket < 4)
+		return duration(bucket);
+
+	unsigned e = bucket/4 + 1;
+	unsigned long long lower = (4ull + bucket%4) << (e-2);
+	return duration(lower + (1ull << (e-2)) - 1);
+}
+
+void Latency::Add(duration rtt)
+{
+	if (rtt < this->floor)
+		this->floor = rtt;
+
+	this->buckets[bucket_of(rtt)]++;
+	if (++this->total < WINDOW)
+		return;
+
+	// Decay the histogram.
+	this->total = 0;
+	for (auto &n: this->buckets)
+	{
+		n /= 2;
+		this->total += n;
+	}
+}
+
+Latency::duration Latency::Percentile(unsigned pct) const
+{
+	assert(pct <= 100);
+	if (!this->total)
+		return duration::zero();
+
+	// @rank is the number of samples which must be at or below
+	// the returned value, rounded up.
+	unsigned long long rank = (this->total*pct + 99) / 100;
+	if (!rank)
+		rank = 1;
+
+	unsigned long long seen = 0;
+	for (unsigned i = 0; i < NBUCKETS; i++)
+		if ((seen += this->buckets[i]) >= rank)
+			return upper_bound(i);
+
+	// Not reached.
+	return upper_bound(NBUCKETS-1);
+}
+
+// End of Latency.cc
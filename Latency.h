@@ -0,0 +1,47 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <chrono>
+
+// Class keeping a decaying histogram of round-trip times and answering
+// percentile queries about them in constant space.
+class Latency
+{
+public:
+	typedef std::chrono::microseconds duration;
+
+protected:
+	// Values below 4us have their own bucket, beyond that every power
+	// of two is split into 4 buckets, giving at most 25% error.
+	// The largest value tracked is about 2^33us (2.4 hours).
+	static const unsigned NBUCKETS = 128;
+
+	// When this many samples are collected all @buckets are halved,
+	// so the percentiles follow the recent behavior of the server.
+	static const unsigned WINDOW = 1024;
+
+	unsigned buckets[NBUCKETS] = { };
+	unsigned total = 0;
+
+	// The smallest sample ever seen.
+	duration floor = duration::max();
+
+public:
+	void Add(duration rtt);
+
+	// Number of samples in the current window.
+	unsigned Count() const { return this->total; }
+
+	// Return the upper bound of the bucket containing the @pct:th
+	// percentile (0-100) of the samples.  If there are no samples
+	// duration::zero() is returned.
+	duration Percentile(unsigned pct) const;
+
+	duration Min() const { return this->floor; }
+
+protected:
+	static unsigned bucket_of(duration rtt);
+	static duration upper_bound(unsigned bucket);
+};
+
+#endif // ! LATENCY_H
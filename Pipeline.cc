@@ -0,0 +1,439 @@
+// Include files
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include "common.h"
+#include "SocketBuffers.h"
+#include "Pipeline.h"
+
+// Static member definitions
+const unsigned Pipeline::MAX_WORKERS;
+const unsigned Pipeline::RING_SIZE;
+const unsigned Pipeline::BATCH;
+
+// Program code
+Pipeline::Pipeline(const struct DNSProxy::config_st &config,
+		   unsigned nworkers):
+	config(config),
+	NWORKERS(nworkers),
+	nsends(0), nsent(0)
+{
+	assert(NWORKERS > 0 && NWORKERS <= MAX_WORKERS);
+}
+
+Pipeline::~Pipeline()
+{
+	for (auto worker: this->workers)
+	{
+		delete worker->proxy;
+		if (worker->wakeupfd >= 0)
+			close(worker->wakeupfd);
+		delete worker;
+	}
+	delete this->buffers;
+
+	if (this->sigfd >= 0)
+		close(this->sigfd);
+	if (this->txfd >= 0)
+		close(this->txfd);
+	if (this->serverfd >= 0)
+		close(this->serverfd);
+	if (this->pollfd >= 0)
+		close(this->pollfd);
+}
+
+bool Pipeline::Init(const char *local_addr, unsigned local_port,
+		    const char *upstream_addr, unsigned upstream_port,
+		    const std::vector<const char *> &secondaries,
+		    const std::vector<const char *> &routes,
+		    const std::vector<const char *> &rules)
+{
+	struct sockaddr_in listen_addr = { };
+
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_port = htons(local_port);
+	if (!inet_aton(local_addr, &listen_addr.sin_addr))
+	{
+		common::Log_error("%s: invalid IPv4 address", local_addr);
+		return false;
+	}
+
+	// Block the signals before the threads are started, so they
+	// inherit the mask and only @sigfd receives them.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &sigs, NULL) < 0)
+	{
+		common::Log_error("sigprocmask(): %m");
+		return false;
+	} else if ((this->sigfd = signalfd(-1, &sigs, 0)) < 0)
+	{
+		common::Log_error("signalfd(): %m");
+		return false;
+	}
+
+	if ((this->pollfd = epoll_create(1)) < 0)
+	{
+		common::Log_error("epoll_create(): %m");
+		return false;
+	} else if ((this->txfd = eventfd(0, 0)) < 0)
+	{
+		common::Log_error("eventfd(): %m");
+		return false;
+	}
+
+	if ((this->serverfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+	{
+		common::Log_error("socket(serverfd): %m");
+		return false;
+	} else if (bind(this->serverfd,
+			reinterpret_cast<const sockaddr *>(&listen_addr),
+			sizeof(listen_addr)) < 0)
+	{
+		common::Log_error("bind(%s:%u): %m", local_addr, local_port);
+		return false;
+	} else
+		common::Log_info("Listening on %s:%u with %u workers",
+				 local_addr, local_port, NWORKERS);
+
+	// The RX thread doesn't use kernel timestamps.
+	const common::sockopts_st sockopts = { this->config.busy_poll, false };
+	common::Set_sockopts(this->serverfd, sockopts);
+	this->buffers = new SocketBuffers(this->config.max_socket_buffer);
+
+	struct epoll_event event = { EPOLLIN };
+	event.data.fd = this->serverfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, this->serverfd,
+		      &event) < 0)
+	{
+		common::Log_error("epoll_ctl(add): %m");
+		return false;
+	}
+
+	event.data.fd = this->sigfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, this->sigfd, &event) < 0)
+	{
+		common::Log_error("epoll_ctl(add): %m");
+		return false;
+	}
+
+	// Divide the outstanding requests and the memory budget between
+	// the workers.
+	struct DNSProxy::config_st worker_config = this->config;
+	worker_config.max_requests = (this->config.max_requests
+				      + NWORKERS - 1) / NWORKERS;
+	worker_config.max_memory = this->config.max_memory / NWORKERS;
+
+	for (unsigned i = 0; i < NWORKERS; i++)
+	{
+		auto worker = new worker_st(RING_SIZE);
+		this->workers.push_back(worker);
+
+		if ((worker->wakeupfd = eventfd(0, EFD_NONBLOCK)) < 0)
+		{
+			common::Log_error("eventfd(): %m");
+			return false;
+		}
+
+		worker->proxy = new DNSProxy(worker_config, this, i);
+		if (!worker->proxy->Init(local_addr, local_port,
+					 upstream_addr, upstream_port,
+					 secondaries, routes, rules))
+			return false;
+	}
+
+	return true;
+}
+
+void Pipeline::Run()
+{
+	// Make sure we've been Init()ialized.
+	assert(this->workers.size() == NWORKERS);
+
+	// Seed the workers' random engines from ours, so a --seed
+	// reproduces them too.
+	for (auto worker: this->workers)
+	{
+		unsigned seed = common::Rnd();
+		this->threads.emplace_back([worker, seed]()
+			{
+				common::Rnd.seed(seed);
+				worker->proxy->Run();
+			});
+	}
+	this->threads.emplace_back(&Pipeline::transmit, this);
+
+	// Queries are received here, 64 KiB for each one in a batch.
+	std::vector<char> buf(BATCH * NS_MAXMSG);
+
+	// Run the RX thread.
+	common::Log_info("Ready to accept requests.");
+	for (;;)
+	{
+		int nevents;
+		struct epoll_event event;
+
+		if ((nevents = epoll_wait(this->pollfd, &event, 1, -1)) < 0)
+		{
+			if (errno != EINTR)
+			{
+				common::Log_error("epoll_wait(): %m");
+				goto snooze;
+			} else
+				continue;
+		}
+
+		if (event.data.fd == this->serverfd)
+		{
+			if (!receive_queries(buf))
+				goto snooze;
+		} else
+		{
+			assert(event.data.fd == this->sigfd);
+			struct signalfd_siginfo info;
+
+			if (read(this->sigfd, &info, sizeof(info)) < 0)
+			{
+				common::Log_error("read(sigfd): %m");
+				goto snooze;
+			}
+
+			if (info.ssi_signo == SIGUSR1)
+				dump_stats();
+			for (auto worker: this->workers)
+			{
+				worker->signals |= 1u << info.ssi_signo;
+				wake_up(worker->wakeupfd);
+			}
+		}
+
+		continue;
+
+snooze:		// We have experienced an unaccountable error.
+		// Let's sleep a bit to prevent busy-looping.
+		sleep(1);
+	}
+}
+
+void Pipeline::Flush_responses()
+{
+	wake_up(this->txfd);
+}
+
+// Signal the eventfd @efd.
+void Pipeline::wake_up(int efd) const
+{
+	const uint64_t one = 1;
+	if (write(efd, &one, sizeof(one)) < 0)
+		common::Log_error("write(eventfd): %m");
+}
+
+// Receive a batch of queries from @serverfd into @buf and hand them
+// to the workers.  Returns false if recvmmsg() failed.
+bool Pipeline::receive_queries(std::vector<char> &buf)
+{
+	struct sockaddr_in senders[BATCH];
+	struct iovec iovs[BATCH];
+	struct mmsghdr msgs[BATCH];
+	union
+	{	// Make sure the buffers are properly aligned.
+		char buf[CMSG_SPACE(sizeof(uint32_t))];
+		struct cmsghdr align;
+	} controls[BATCH];
+	bool woken[MAX_WORKERS] = { };
+
+	memset(msgs, 0, sizeof(msgs));
+	for (unsigned i = 0; i < BATCH; i++)
+	{
+		iovs[i].iov_base = &buf[i * NS_MAXMSG];
+		iovs[i].iov_len = NS_MAXMSG;
+		msgs[i].msg_hdr.msg_name = &senders[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = controls[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+	}
+
+	int nmsgs = recvmmsg(this->serverfd, msgs, BATCH, MSG_DONTWAIT, NULL);
+	if (nmsgs < 0)
+	{
+		if (errno == EAGAIN || errno == EINTR)
+			return true;
+		common::Log_error("recvmmsg(): %m");
+		return false;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	this->nrecvs++;
+	this->nreceived += nmsgs;
+	for (int i = 0; i < nmsgs; i++)
+	{
+		// The drop counter is only included if it's not zero.
+		uint32_t drops = 0;
+		struct msghdr &mhdr = msgs[i].msg_hdr;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mhdr); cmsg;
+		     cmsg = CMSG_NXTHDR(&mhdr, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET
+			    && cmsg->cmsg_type == SO_RXQ_OVFL)
+				memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+		this->client_drops += this->buffers->Received(this->serverfd,
+							      drops);
+
+		struct packet_st packet;
+		packet.peer = senders[i];
+		packet.received = now;
+		packet.msg.assign(&buf[i * NS_MAXMSG],
+				  &buf[i * NS_MAXMSG] + msgs[i].msg_len);
+
+		// Try the next worker with room for @packet.
+		unsigned worker = this->next_worker, tried = 0;
+		while (!this->workers[worker]->queries.Push(packet)
+		       && ++tried < NWORKERS)
+			worker = (worker + 1) % NWORKERS;
+		this->next_worker = (worker + 1) % NWORKERS;
+
+		if (tried < NWORKERS)
+		{
+			this->workers[worker]->nqueries++;
+			woken[worker] = true;
+		} else
+		{
+			common::Log_debug("All workers are busy, "
+					  "dropping query");
+			this->ndropped++;
+		}
+	}
+
+	for (unsigned i = 0; i < NWORKERS; i++)
+		if (woken[i])
+			wake_up(this->workers[i]->wakeupfd);
+	return true;
+}
+
+// The main loop of the TX thread.
+void Pipeline::transmit()
+{
+	struct packet_st packets[BATCH];
+
+	for (;;)
+	{
+		uint64_t n;
+		if (read(this->txfd, &n, sizeof(n)) < 0)
+		{
+			common::Log_error("read(txfd): %m");
+			sleep(1);
+			continue;
+		}
+
+		// Take turns with the workers until all of them are empty.
+		bool more;
+		do
+		{
+			more = false;
+			for (auto worker: this->workers)
+			{
+				unsigned npackets = 0;
+				while (npackets < BATCH
+				       && worker->responses.Pop(
+						&packets[npackets]))
+					npackets++;
+				if (npackets == BATCH)
+					more = true;
+				send_responses(packets, npackets);
+			}
+		} while (more);
+	}
+}
+
+// Send @npackets @packets from @serverfd.
+void Pipeline::send_responses(struct packet_st *packets, unsigned npackets)
+{
+	struct iovec iovs[BATCH];
+	struct mmsghdr msgs[BATCH];
+
+	assert(npackets <= BATCH);
+	memset(msgs, 0, sizeof(msgs[0]) * npackets);
+	for (unsigned i = 0; i < npackets; i++)
+	{
+		iovs[i].iov_base = packets[i].msg.data();
+		iovs[i].iov_len = packets[i].msg.size();
+		msgs[i].msg_hdr.msg_name = &packets[i].peer;
+		msgs[i].msg_hdr.msg_namelen = sizeof(packets[i].peer);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (unsigned sent = 0; sent < npackets; )
+	{
+		int nsent = sendmmsg(this->serverfd, &msgs[sent],
+				     npackets - sent, 0);
+		this->nsends++;
+		if (nsent < 0)
+		{	// Skip the message which couldn't be sent.
+			const struct sockaddr_in &client = packets[sent].peer;
+			auto serrno = errno;
+			const char *addr = inet_ntoa(client.sin_addr);
+			errno = serrno;
+			common::Log_error("sendmmsg(%s:%u): %m",
+					  addr, ntohs(client.sin_port));
+			sent++;
+		} else
+		{
+			this->nsent += nsent;
+			sent += nsent;
+		}
+	}
+}
+
+// Log the ring occupancies.  A stage whose input rings are full or
+// whose output rings are empty is the bottleneck.
+void Pipeline::dump_stats()
+{
+	auto nrecvs = std::max(this->nrecvs, 1ull);
+	auto nsends = std::max(this->nsends.load(), 1ull);
+
+	common::Log_info("Pipeline: %llu queries received "
+			 "(%.1f per recvmmsg()), %llu dropped, "
+			 "%llu responses sent (%.1f per sendmmsg()), "
+			 "kernel drops: %llu",
+			 this->nreceived,
+			 static_cast<double>(this->nreceived) / nrecvs,
+			 this->ndropped,
+			 this->nsent.load(),
+			 static_cast<double>(this->nsent.load()) / nsends,
+			 this->client_drops);
+
+	// The peaks are since the previous dump.
+	for (unsigned i = 0; i < NWORKERS; i++)
+	{
+		auto worker = this->workers[i];
+		common::Log_info("Worker %u: %llu queries, "
+				 "query ring: %zu/%zu (peak %zu), "
+				 "response ring: %zu/%zu (peak %zu)",
+				 i, worker->nqueries,
+				 worker->queries.Size(),
+				 worker->queries.Capacity(),
+				 worker->queries.Peak(),
+				 worker->responses.Size(),
+				 worker->responses.Capacity(),
+				 worker->responses.Peak());
+	}
+}
+
+// End of Pipeline.cc
@@ -0,0 +1,163 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <netinet/in.h>
+
+#include "Ring.h"
+#include "DNSProxy.h"
+
+// Forward declarations
+class SocketBuffers;
+
+// Alternative to running a single DNSProxy, spreading the work of one
+// listening UDP socket over threads connected by lock-free Rings:
+//
+//   - the receive (RX) thread reads batches of queries from @serverfd
+//     with recvmmsg() and hands them to the workers round-robin,
+//   - the workers are DNSProxies, each with its own upstream sockets
+//     and Requests, so they share nothing,
+//   - the transmit (TX) thread sends the responses of all workers
+//     to the clients in batches with sendmmsg().
+//
+// The occupancy of the Rings tells which stage is the bottleneck.
+class Pipeline
+{
+public:
+	// A UDP message passed between the stages.
+	struct packet_st
+	{
+		struct sockaddr_in peer;
+
+		// When the RX thread received it.
+		std::chrono::steady_clock::time_point received;
+
+		std::vector<char> msg;
+	};
+
+	// The maximum number of workers.
+	static const unsigned MAX_WORKERS = 64;
+
+protected:
+	struct worker_st
+	{
+		DNSProxy *proxy;
+
+		// Queries from the RX thread and responses to the TX one.
+		Ring<struct packet_st> queries, responses;
+
+		// An eventfd the RX thread wakes the worker up with when
+		// there are new @queries or @signals.
+		int wakeupfd;
+
+		// Bitmap of (1 << signal number)s received by the RX thread
+		// and not yet handled by the worker.
+		std::atomic<unsigned> signals;
+
+		// Statistics: the number of queries handed to the worker.
+		unsigned long long nqueries;
+
+		worker_st(size_t ring_size):
+			proxy(NULL), queries(ring_size), responses(ring_size),
+			wakeupfd(-1), signals(0), nqueries(0)
+		{ }
+	};
+
+	// The size of each Ring.
+	static const unsigned RING_SIZE = 4096;
+
+	// The maximum number of messages received or sent with a syscall.
+	static const unsigned BATCH = 32;
+
+	// Initialized from command line options.
+	const struct DNSProxy::config_st config;
+	const unsigned NWORKERS;
+
+	std::vector<struct worker_st *> workers;
+	std::vector<std::thread> threads;
+
+	// @serverfd receives the queries from the clients and @pollfd is
+	// the RX thread's epoll fd.  @txfd is an eventfd the workers wake
+	// the TX thread up with when they have queued responses.  @sigfd
+	// receives SIGUSR1 and SIGHUP, which are passed on to the workers.
+	int serverfd = -1, pollfd = -1, txfd = -1, sigfd = -1;
+
+	// Accounts for the drops on @serverfd.
+	SocketBuffers *buffers = NULL;
+
+	// The next worker to hand a query to.
+	unsigned next_worker = 0;
+
+	// Serializes the statistics logged by the workers.
+	std::mutex stats_lock;
+
+	// Statistics of the RX and TX threads: the number of recvmmsg()
+	// and sendmmsg() calls and the messages passed through them,
+	// and the queries dropped because all workers were busy.
+	unsigned long long client_drops = 0, nrecvs = 0, nreceived = 0;
+	unsigned long long ndropped = 0;
+	std::atomic<unsigned long long> nsends, nsent;
+
+public:
+	// The workers are created with @config, except that
+	// @config.max_requests is divided between them.
+	Pipeline(const struct DNSProxy::config_st &config, unsigned nworkers);
+	~Pipeline();
+
+	// Creates @serverfd bound to @local_addr:@local_port, and Init()s
+	// the workers with the rest of the arguments.  Only the first one
+	// accepts stream connections.  On error false is returned and the
+	// object must be destroyed.
+	bool Init(const char *local_addr, unsigned local_port,
+		  const char *upstream_addr, unsigned upstream_port,
+		  const std::vector<const char *> &secondaries,
+		  const std::vector<const char *> &routes,
+		  const std::vector<const char *> &rules);
+
+	// Starts the worker and TX threads and runs the RX thread.
+	// It never returns.
+	void Run();
+
+	// The rest of the methods are called by the workers.
+	unsigned Workers() const { return this->NWORKERS; }
+	int Wakeup_fd(unsigned worker) const
+	{
+		return this->workers[worker]->wakeupfd;
+	}
+
+	// Return and clear the signals pending for @worker.
+	unsigned Signals(unsigned worker)
+	{
+		return this->workers[worker]->signals.exchange(0);
+	}
+
+	bool Pop_query(unsigned worker, struct packet_st *packet)
+	{
+		return this->workers[worker]->queries.Pop(packet);
+	}
+
+	// Queue @packet for the TX thread.  Returns false if
+	// the @worker's ring is full.  The TX thread is only woken up
+	// by Flush_responses().
+	bool Push_response(unsigned worker, struct packet_st &packet)
+	{
+		return this->workers[worker]->responses.Push(packet);
+	}
+	void Flush_responses();
+
+	std::mutex &Stats_lock() { return this->stats_lock; }
+
+protected:
+	void wake_up(int efd) const;
+	bool receive_queries(std::vector<char> &buf);
+	void transmit();
+	void send_responses(struct packet_st *packets, unsigned npackets);
+	void dump_stats();
+};
+
+#endif // ! PIPELINE_H
@@ -0,0 +1,129 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include <utility>
+
+// Free lists of the objects allocated by the containers of one event loop.
+// Freed objects are kept for reuse and only returned to the heap when the
+// Pool is destroyed or trimmed, so once the loop has warmed up the nodes of
+// the containers aren't malloc()ed for a steady stream of requests.  What the
+// contained objects allocate themselves, like the question and the query
+// of a request, still comes from the heap.  Not thread-safe.
+class Pool
+{
+protected:
+	struct free_st
+	{
+		struct free_st *next;
+	};
+
+	// <object size, free list> of each size allocated so far.
+	// Containers only allocate a few different sizes.
+	std::vector<std::pair<size_t, struct free_st *>> lists;
+
+	struct free_st *&list(size_t size)
+	{
+		for (auto &i: this->lists)
+			if (i.first == size)
+				return i.second;
+		this->lists.push_back(std::make_pair(
+				size, static_cast<struct free_st *>(NULL)));
+		return this->lists.back().second;
+	}
+
+public:
+	// Statistics: the number of objects allocated from the heap,
+	// the bytes they hold, whether in use or free, and the bytes
+	// of the free ones.
+	unsigned long long nallocated = 0;
+	size_t nbytes = 0, nfree_bytes = 0;
+
+	~Pool() { Trim(); }
+
+	// Return the free objects to the heap.
+	void Trim()
+	{
+		for (auto &i: this->lists)
+			while (struct free_st *obj = i.second)
+			{
+				i.second = obj->next;
+				::operator delete(obj);
+				this->nbytes -= std::max(i.first,
+							 sizeof(struct free_st));
+			}
+		this->nfree_bytes = 0;
+	}
+
+	void *Get(size_t size)
+	{
+		struct free_st *&head = list(size);
+		if (!head)
+		{
+			this->nallocated++;
+			this->nbytes += std::max(size, sizeof(struct free_st));
+			return ::operator new(std::max(size,
+						       sizeof(struct free_st)));
+		}
+
+		struct free_st *obj = head;
+		head = obj->next;
+		this->nfree_bytes -= std::max(size, sizeof(struct free_st));
+		return obj;
+	}
+
+	void Put(void *ptr, size_t size)
+	{
+		struct free_st *&head = list(size);
+		struct free_st *obj = static_cast<struct free_st *>(ptr);
+		obj->next = head;
+		head = obj;
+		this->nfree_bytes += std::max(size, sizeof(struct free_st));
+	}
+};
+
+// Standard allocator taking single objects from a Pool, for node-based
+// containers.  Arrays are allocated from the heap as usual.
+template <typename T>
+class Pool_allocator
+{
+public:
+	typedef T value_type;
+
+	Pool *pool;
+
+	Pool_allocator(Pool *pool): pool(pool) { }
+	template <typename U>
+	Pool_allocator(const Pool_allocator<U> &other): pool(other.pool) { }
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(n == 1
+			? this->pool->Get(sizeof(T))
+			: ::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T *ptr, size_t n)
+	{
+		if (n == 1)
+			this->pool->Put(ptr, sizeof(T));
+		else
+			::operator delete(ptr);
+	}
+
+	template <typename U>
+	bool operator==(const Pool_allocator<U> &other) const
+	{
+		return this->pool == other.pool;
+	}
+	template <typename U>
+	bool operator!=(const Pool_allocator<U> &other) const
+	{
+		return this->pool != other.pool;
+	}
+};
+
+#endif // ! POOL_H
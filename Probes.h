@@ -0,0 +1,99 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <cstdint>
+#include <chrono>
+
+// Static tracepoints (USDT probes) for bpftrace, SystemTap, perf and gdb,
+// in the format of <sys/sdt.h>, which may not be installed.  Each probe
+// is a nop in the code and a note in the .note.stapsdt section telling
+// the tracer where the nop is and where to find the arguments, so the
+// probes cost nothing until a tracer replaces the nop with a breakpoint.
+// The notes survive stripping.  All probes are in the "dnsproxy" provider
+// and every argument is passed as a signed 64-bit number.
+//
+// DNSPROXY_PROBEn(name, arg1, ..., argn) defines a probe with n arguments.
+// Build with -DNO_PROBES (make PROBES=0) to leave them out.
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) \
+	&& !defined(NO_PROBES)
+
+// The note of a probe.  _.stapsdt.base lets the tracer adjust the address
+// of the nop if the binary is prelinked.
+#define DNSPROXY_PROBE_(name, args, ...)				\
+	__asm__ __volatile__(						\
+		"990:	nop\n"						\
+		"	.pushsection .note.stapsdt,\"?\",\"note\"\n"	\
+		"	.balign 4\n"					\
+		"	.4byte 992f-991f, 994f-993f, 3\n"		\
+		"991:	.asciz \"stapsdt\"\n"				\
+		"992:	.balign 4\n"					\
+		"993:	.8byte 990b\n"					\
+		"	.8byte _.stapsdt.base\n"			\
+		"	.8byte 0\n"					\
+		"	.asciz \"dnsproxy\"\n"				\
+		"	.asciz \"" #name "\"\n"				\
+		"	.asciz \"" args "\"\n"				\
+		"994:	.balign 4\n"					\
+		"	.popsection\n"					\
+		"	.ifndef _.stapsdt.base\n"			\
+		"	.pushsection .stapsdt.base,\"aG\",\"progbits\","	\
+			".stapsdt.base,comdat\n"			\
+		"	.weak _.stapsdt.base\n"				\
+		"	.hidden _.stapsdt.base\n"			\
+		"_.stapsdt.base:	.space 1\n"			\
+		"	.size _.stapsdt.base, 1\n"			\
+		"	.popsection\n"					\
+		"	.endif\n"					\
+		:: __VA_ARGS__)
+
+// The arguments are in registers, in memory or constants, wherever
+// the compiler has them already.  Pointers, like the reason strings,
+// can be passed too.
+#define DNSPROXY_PROBE_ARG_(arg)	"nor" ((int64_t)(arg))
+
+#define DNSPROXY_PROBE1(name, a1)					\
+	DNSPROXY_PROBE_(name, "-8@%0",					\
+			DNSPROXY_PROBE_ARG_(a1))
+#define DNSPROXY_PROBE2(name, a1, a2)					\
+	DNSPROXY_PROBE_(name, "-8@%0 -8@%1",				\
+			DNSPROXY_PROBE_ARG_(a1),			\
+			DNSPROXY_PROBE_ARG_(a2))
+#define DNSPROXY_PROBE3(name, a1, a2, a3)				\
+	DNSPROXY_PROBE_(name, "-8@%0 -8@%1 -8@%2",			\
+			DNSPROXY_PROBE_ARG_(a1),			\
+			DNSPROXY_PROBE_ARG_(a2),			\
+			DNSPROXY_PROBE_ARG_(a3))
+#define DNSPROXY_PROBE4(name, a1, a2, a3, a4)				\
+	DNSPROXY_PROBE_(name, "-8@%0 -8@%1 -8@%2 -8@%3",		\
+			DNSPROXY_PROBE_ARG_(a1),			\
+			DNSPROXY_PROBE_ARG_(a2),			\
+			DNSPROXY_PROBE_ARG_(a3),			\
+			DNSPROXY_PROBE_ARG_(a4))
+#define DNSPROXY_PROBE5(name, a1, a2, a3, a4, a5)			\
+	DNSPROXY_PROBE_(name, "-8@%0 -8@%1 -8@%2 -8@%3 -8@%4",		\
+			DNSPROXY_PROBE_ARG_(a1),			\
+			DNSPROXY_PROBE_ARG_(a2),			\
+			DNSPROXY_PROBE_ARG_(a3),			\
+			DNSPROXY_PROBE_ARG_(a4),			\
+			DNSPROXY_PROBE_ARG_(a5))
+
+#else // NO_PROBES or not supported
+
+#define DNSPROXY_PROBE1(name, a1)			do { } while (0)
+#define DNSPROXY_PROBE2(name, a1, a2)			do { } while (0)
+#define DNSPROXY_PROBE3(name, a1, a2, a3)		do { } while (0)
+#define DNSPROXY_PROBE4(name, a1, a2, a3, a4)		do { } while (0)
+#define DNSPROXY_PROBE5(name, a1, a2, a3, a4, a5)	do { } while (0)
+
+#endif // NO_PROBES
+
+// Nanoseconds of @time_point on its clock, for passing timestamps
+// to probes.  The steady_clock is CLOCK_MONOTONIC like bpftrace's nsecs.
+template <typename TimePoint>
+inline int64_t Probe_ns(const TimePoint &time_point)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			time_point.time_since_epoch()).count();
+}
+
+#endif // ! PROBES_H
@@ -0,0 +1,114 @@
+// Include files
+#include <cstring>
+#include <algorithm>
+
+#include "common.h"
+#include "DNSMessage.h"
+#include "Records.h"
+
+// Static member definitions
+const char Records::MAGIC[8] = { 'D', 'N', 'S', 'P', 'R', 'D', 'B', '1' };
+const uint32_t Records::BYTE_ORDER_MARK;
+
+// Program code
+Records::Records():
+	map(NULL),
+	size(0),
+	header(NULL),
+	entries(NULL)
+{
+	// NOP
+}
+
+Records::~Records()
+{
+	if (this->map)
+		common::Unmap_file(this->map, this->size);
+}
+
+bool Records::Load(const char *fname)
+{
+	if (!(this->map = common::Map_file(fname, &this->size)))
+		return false;
+
+	// Only the header is checked, the entries are validated lazily
+	// when they're looked up.
+	this->header = reinterpret_cast<const header_st *>(this->map);
+	if (this->size < sizeof(*this->header)
+	    || memcmp(this->header->magic, MAGIC, sizeof(MAGIC)))
+	{
+		common::Log_error("%s: not a records database", fname);
+		return false;
+	} else if (this->header->byte_order != BYTE_ORDER_MARK)
+	{
+		common::Log_error("%s: wrong byte order", fname);
+		return false;
+	} else if (this->header->size != this->size
+		   || (this->size - sizeof(*this->header))
+			/ sizeof(*this->entries) < this->header->nentries)
+	{
+		common::Log_error("%s: truncated database", fname);
+		return false;
+	}
+
+	this->entries = reinterpret_cast<const entry_st *>
+		(&this->map[sizeof(*this->header)]);
+	return true;
+}
+
+bool Records::Lookup(const char *key, size_t skey,
+		     const char **rrsetp, size_t *srrsetp,
+		     unsigned *nrrsp) const
+{
+	const uint64_t hash = Hash(key, skey);
+	const entry_st *end = &this->entries[this->header->nentries];
+
+	// Find the first entry with @hash, then compare the keys
+	// in case of collisions.
+	const entry_st *entry = std::lower_bound(this->entries, end, hash,
+		[](const entry_st &lhs, uint64_t rhs)
+		{ return lhs.hash < rhs; });
+	for (; entry < end && entry->hash == hash; entry++)
+	{
+		if (entry->key_size != skey
+		    || entry->key_offset > this->size - skey
+		    || memcmp(&this->map[entry->key_offset], key, skey))
+			continue;
+
+		if (entry->rrset_offset > this->size
+		    || entry->rrset_size > this->size - entry->rrset_offset)
+		{
+			common::Log_error("Corrupt records database entry");
+			return false;
+		}
+
+		*rrsetp = &this->map[entry->rrset_offset];
+		*srrsetp = entry->rrset_size;
+		*nrrsp = entry->nrrs;
+		return true;
+	}
+
+	return false;
+}
+
+size_t Records::Make_key(char *key, const char *qname, size_t sqname,
+			 uint16_t qtype)
+{
+	DNSMessage::Fold_case(key, qname, sqname);
+	key[sqname]   = qtype >> 8;
+	key[sqname+1] = qtype & 0xFF;
+	return sqname + NS_INT16SZ;
+}
+
+uint64_t Records::Hash(const char *key, size_t skey)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < skey; i++)
+	{
+		hash ^= static_cast<uint8_t>(key[i]);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// End of Records.cc
@@ -0,0 +1,82 @@
+#ifndef RECORDS_H
+#define RECORDS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <arpa/nameser.h>
+
+// Class giving access to a precompiled, immutable database of local
+// resource records, memory-mapped from a file created by mkdnsdb.
+// Nothing is parsed when the file is loaded; lookups binary search
+// the sorted index in place.
+class Records
+{
+public:
+	// The file starts with a header, followed by the index of
+	// @nentries sorted by <hash, key>, then the keys and the RRsets.
+	// All numbers are in host byte order, which is checked through
+	// @byte_order.
+	struct header_st
+	{
+		char magic[8];
+		uint32_t byte_order;
+		uint32_t nentries;
+		uint64_t size;
+	};
+
+	// An entry of the index.  A key is the lowercase wire-format QNAME
+	// followed by the QTYPE in network byte order.  The RRset is the
+	// answer section of the response in wire format, whose owner names
+	// are compression pointers to the QNAME of the question.
+	struct entry_st
+	{
+		uint64_t hash;
+		uint32_t key_offset;
+		uint16_t key_size;
+		uint16_t nrrs;
+		uint32_t rrset_offset;
+		uint32_t rrset_size;
+	};
+
+	static const char MAGIC[8];
+	static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+	// Longest possible key (a QNAME in the question section may end
+	// in a compression pointer).
+	static const size_t MAX_KEY = NS_MAXCDNAME + 2 + NS_INT16SZ;
+
+protected:
+	// The mapped file.
+	const char *map;
+	size_t size;
+
+	const struct header_st *header;
+	const struct entry_st *entries;
+
+public:
+	// The file must be Load()ed before the object can be used.
+	Records();
+	~Records();
+
+	// Map @fname and check its header.  Returns false on error.
+	bool Load(const char *fname);
+
+	// Number of keys in the database.
+	unsigned Count() const { return this->header->nentries; }
+
+	// Find the RRset of @key.  Returns false if it's not found.
+	bool Lookup(const char *key, size_t skey,
+		    const char **rrsetp, size_t *srrsetp,
+		    unsigned *nrrsp) const;
+
+	// Build the key of @qname and @qtype into @key, which must be at
+	// least @MAX_KEY long.  Returns the size of the key.
+	static size_t Make_key(char *key, const char *qname, size_t sqname,
+			       uint16_t qtype);
+
+	// The hash function of the keys (64-bit FNV-1a).
+	static uint64_t Hash(const char *key, size_t skey);
+};
+
+#endif // ! RECORDS_H
@@ -9,6 +9,9 @@
 #include "common.h"
 #include "Requests.h"
 
+// Static member definitions
+const unsigned Requests::MAX_PROBES;
+
 // Program code
 Requests::Requests(unsigned max_requests,
 		   unsigned request_timeout,
@@ -18,9 +21,12 @@ Requests::Requests(unsigned max_requests,
 	REQUEST_TIMEOUT(request_timeout),
 	MIN_GC_TIME(min_gc_time),
 	gc_timer(timerfd),
-	timer_state(DISARMED)
+	timer_state(DISARMED),
+	requests(std::less<request_id_t>(),
+		 Pool_allocator<request_pair_t>(&this->pool)),
+	expirations(std::less<expiration_t>(),
+		    Pool_allocator<expiration_t>(&this->pool))
 {
-	// NOP
 }
 
 Requests::~Requests()
@@ -30,54 +36,76 @@ Requests::~Requests()
 	update_gc_timer();
 }
 
-bool Requests::Get_query_id(query_id_t *query_idp) const
+bool Requests::Full() const
 {
-	if (MAX_OUTSTANDING_REQUESTS
-	    && this->requests.size() >= MAX_OUTSTANDING_REQUESTS)
-	{
-		common::Log_error("Maximum number of outstanding requests "
-				  "reached.");
-		return NULL;
-	}
+	return MAX_OUTSTANDING_REQUESTS
+		&& this->requests.size() >= MAX_OUTSTANDING_REQUESTS;
+}
 
-	assert(this->requests.size() <= MAX_POSSIBLE_QUERIES);
-	if (this->requests.size() >= MAX_POSSIBLE_QUERIES)
+bool Requests::Get_query_id(int upstream_fd, query_id_t *query_idp) const
+{
+	const auto used = this->used_query_ids.find(upstream_fd);
+	const size_t nused = used != this->used_query_ids.end()
+		? used->second : 0;
+
+	assert(nused <= MAX_POSSIBLE_QUERIES);
+	if (nused >= MAX_POSSIBLE_QUERIES)
 	{
 		common::Log_error("Out of free query IDs.");
 		return false;
 	}
 
-	// Find the @nth free query ID from the ongoing @requests.
-	const size_t max_query_id = std::numeric_limits<query_id_t>::max();
-	auto nth = std::uniform_int_distribution<query_id_t>
-			(0, max_query_id-this->requests.size())
-			(common::Rnd);
-	*query_idp = nth;
+	// Try random query IDs first, which is quick unless @upstream_fd
+	// is nearly out of them.  Rejecting the used ones leaves the
+	// choice uniform among the free ones.
+	for (unsigned i = 0; i < MAX_PROBES; i++)
+	{
+		*query_idp = std::uniform_int_distribution<size_t>
+				(0, MAX_POSSIBLE_QUERIES-1)
+				(common::Rnd);
+		if (!this->requests.count(Request_id(upstream_fd,
+						     *query_idp)))
+			return true;
+	}
 
-	// @next_free is the next possibly free query ID.
-	query_id_t next_free = 0;
-	for (const auto &i: this->requests)
+	// Find the @nth free query ID of @upstream_fd from the ongoing
+	// @requests.
+	auto nth = std::uniform_int_distribution<size_t>
+			(0, MAX_POSSIBLE_QUERIES-1 - nused)
+			(common::Rnd);
+	auto n = nth;
+
+	// @next_free is the next possibly free request ID.  The requests
+	// of @upstream_fd are between @first and @last.
+	const request_id_t first = Request_id(upstream_fd, 0);
+	const request_id_t last = Request_id(upstream_fd,
+					     MAX_POSSIBLE_QUERIES - 1);
+	request_id_t next_free = first;
+	for (auto i = this->requests.lower_bound(first);
+	     i != this->requests.end() && i->first <= last; ++i)
 	{	// It is useful to remember that @requests is ordered by
-		// the used query IDs.  This algorithm is best followed on
+		// the used request IDs.  This algorithm is best followed on
 		// paper with pencil.
-		assert(next_free <= i.first);
-		query_id_t nfree = i.first - next_free;
-		if (*query_idp < nfree)
+		assert(next_free <= i->first);
+		size_t nfree = i->first - next_free;
+		if (n < nfree)
 			break;
-		*query_idp -= nfree;
-		next_free = i.first + 1;
+		n -= nfree;
+		next_free = i->first + 1;
 	}
-	*query_idp += next_free;
+	*query_idp = Query_id(next_free + n);
 
 	if (common::Debug)
 	{
 		// The new query ID must not be in @requests yet.
-		assert(this->requests.find(*query_idp)
+		assert(this->requests.find(Request_id(upstream_fd,
+						      *query_idp))
 		       == this->requests.end());
 
 		// Verify that the selected query ID is indeed the @nth free.
-		for (const auto i: this->requests)
-			if (i.first < *query_idp)
+		for (auto i = this->requests.lower_bound(first);
+		     i != this->requests.end() && i->first <= last; ++i)
+			if (Query_id(i->first) < *query_idp)
 				nth++;
 			else
 				break;
@@ -87,20 +115,32 @@ bool Requests::Get_query_id(query_id_t *query_idp) const
 	return true;
 }
 
-void Requests::Put(query_id_t query_id, int upstream_fd,
-		   const struct sockaddr_in &client,
+void Requests::Put(request_id_t request_id, unsigned server,
+		   const struct sockaddr_in &client, uint64_t stream,
 		   std::vector<char> &question,
-		   query_id_t orig_query_id)
+		   query_id_t orig_query_id, bool recursion_desired,
+		   std::vector<char> &query, uint64_t case_mask,
+		   uint16_t udp_size, bool over_tcp)
 {
-	auto expiration = std::chrono::steady_clock::now()
-			+ std::chrono::seconds(REQUEST_TIMEOUT);
-	auto ret = this->requests.emplace(query_id,
-					  request_st{ upstream_fd,
+	auto now = std::chrono::steady_clock::now();
+	auto expiration = now + std::chrono::seconds(REQUEST_TIMEOUT);
+	auto ret = this->requests.emplace(request_id,
+					  request_st{ Upstream_fd(request_id),
+						      server,
+						      now,
 						      std::move(expiration),
 					  	      client,
+						      stream,
 						      std::move(question),
-						      orig_query_id });
+						      orig_query_id,
+						      recursion_desired,
+						      std::move(query),
+						      case_mask,
+						      udp_size,
+						      false, 0, over_tcp });
 	assert(ret.second == true);
+	this->data_size += data_size_of(ret.first->second);
+	this->used_query_ids[Upstream_fd(request_id)]++;
 
 	if (!REQUEST_TIMEOUT)
 		return;
@@ -110,7 +150,7 @@ void Requests::Put(query_id_t query_id, int upstream_fd,
 	auto nprev = this->expirations.size();
 	auto i = this->expirations.emplace_hint(this->expirations.end(),
 						std::make_pair(expiration,
-							       query_id));
+							       request_id));
 	assert(this->expirations.size() > nprev);
 	assert(++i == this->expirations.end());
 
@@ -119,27 +159,68 @@ void Requests::Put(query_id_t query_id, int upstream_fd,
 		update_gc_timer();
 }
 
-const struct Requests::request_st *Requests::Find(query_id_t query_id) const
+void Requests::Adopt(request_id_t request_id,
+		     const struct request_st &request)
 {
-	const auto i = this->requests.find(query_id);
+	auto ret = this->requests.emplace(request_id, request);
+	assert(ret.second == true);
+	this->data_size += data_size_of(ret.first->second);
+	this->used_query_ids[Upstream_fd(request_id)]++;
+
+	if (!REQUEST_TIMEOUT)
+		return;
+
+	// Unlike Put(), @request may be older than others.
+	auto i = this->expirations.emplace(std::make_pair(request.expiration,
+							  request_id));
+	assert(i.second == true);
+	if (i.first == this->expirations.begin())
+		update_gc_timer();
+}
+
+const struct Requests::request_st *Requests::Find(
+						request_id_t request_id) const
+{
+	const auto i = this->requests.find(request_id);
 	return i != this->requests.cend() ? &i->second : NULL;
 }
 
-void Requests::Done(query_id_t query_id, const struct request_st *request)
+void Requests::Link(request_id_t request_id, request_id_t sibling)
+{
+	auto i = this->requests.find(request_id);
+	auto o = this->requests.find(sibling);
+	assert(i != this->requests.end() && o != this->requests.end());
+	assert(!i->second.hedged && !o->second.hedged);
+
+	i->second.hedged = o->second.hedged = true;
+	i->second.sibling = sibling;
+	o->second.sibling = request_id;
+}
+
+void Requests::Unlink(request_id_t request_id)
+{
+	auto i = this->requests.find(request_id);
+	assert(i != this->requests.end());
+	i->second.hedged = false;
+}
+
+void Requests::Done(request_id_t request_id, const struct request_st *request)
 {
 	bool is_oldest = false;
 
 	if (REQUEST_TIMEOUT)
-	{	// Remove @query_id from @expirations.
+	{	// Remove @request_id from @expirations.
 		auto i = this->expirations.find(std::make_pair(
-					request->expiration, query_id));
+					request->expiration, request_id));
 		assert(i != this->expirations.end());
 		if (i == this->expirations.begin())
 			is_oldest = true;
 		this->expirations.erase(i);
 	}
 
-	auto nremoved = this->requests.erase(query_id);
+	release_query_id(request_id);
+	this->data_size -= data_size_of(*request);
+	auto nremoved = this->requests.erase(request_id);
 	assert(nremoved == 1);
 
 	if (is_oldest)
@@ -148,29 +229,13 @@ void Requests::Done(query_id_t query_id, const struct request_st *request)
 		update_gc_timer();
 }
 
-void Requests::Gc(std::function<void(const struct request_st *)> callback)
+// Account for the query ID of @request_id being free again.
+void Requests::release_query_id(request_id_t request_id)
 {
-	bool update_timer = false;
-	assert(REQUEST_TIMEOUT > 0);
-
-	auto i = this->expirations.begin();
-	auto now = std::chrono::steady_clock::now();
-	while (i != this->expirations.end() && i->first <= now)
-	{	// The request pointed to by @i is too old, remove it.
-		auto o = this->requests.find(i->second);
-		assert(o != this->requests.end());
-
-		common::Log_debug("Request %u timed out", o->first);
-		callback(&o->second);
-		this->requests.erase(o);
-
-		// rease() returns an iterator pointing at the next element.
-		i = this->expirations.erase(i);
-		update_timer = true;
-	}
-
-	if (update_timer)
-		update_gc_timer();
+	auto i = this->used_query_ids.find(Upstream_fd(request_id));
+	assert(i != this->used_query_ids.end() && i->second > 0);
+	if (!--i->second)
+		this->used_query_ids.erase(i);
 }
 
 void Requests::update_gc_timer()
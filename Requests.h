@@ -1,6 +1,7 @@
 #ifndef REQUESTS_H
 #define REQUESTS_H
 
+#include <cassert>
 #include <netinet/in.h>
 
 #include <limits>
@@ -8,7 +9,10 @@
 #include <vector>
 #include <set>
 #include <map>
-#include <functional>
+#include <unordered_map>
+
+#include "common.h"
+#include "Pool.h"
 
 // Class holding the ongoing forwarded DNS queries.
 class Requests
@@ -18,23 +22,54 @@ public:
 	typedef uint16_t query_id_t;
 
 	// ... whose size determines how many @requests can be forwarded
-	// in parallel.
+	// in parallel through one upstream socket.
 	static const size_t MAX_POSSIBLE_QUERIES =
 		std::numeric_limits<query_id_t>::max() + 1;
 
+	// Responses are validated by the socket they arrive on, so each
+	// upstream socket has its own space of query IDs, and a request
+	// is identified by the socket fd and the query ID together.
+	typedef uint64_t request_id_t;
+
+	static request_id_t Request_id(int upstream_fd, query_id_t query_id)
+	{
+		return static_cast<request_id_t>(upstream_fd)
+				<< std::numeric_limits<query_id_t>::digits
+			| query_id;
+	}
+	static query_id_t Query_id(request_id_t request_id)
+	{
+		return static_cast<query_id_t>(request_id);
+	}
+	static int Upstream_fd(request_id_t request_id)
+	{
+		return request_id >> std::numeric_limits<query_id_t>::digits;
+	}
+
 	// Information on a forwarded request needed to validate and return
 	// the response to the client.
 	struct request_st
 	{
-		// The socket fd through which we expect the response.
+		// The socket fd through which we expect the response,
+		// also encoded in the request ID.
 		int upstream_fd;
 
+		// Index of the upstream server the query was forwarded to.
+		unsigned server;
+
+		// When the query was forwarded.  Used to measure the
+		// server's round-trip time.
+		std::chrono::steady_clock::time_point sent;
+
 		// The time when the query will expire.  Used for garbage
 		// collection.
 		std::chrono::steady_clock::time_point expiration;
 
-		// Where to return the response.
+		// Where to return the response: the client's address, and
+		// the StreamListener connection the query arrived on, or 0
+		// if it arrived over UDP.
 		struct sockaddr_in client;
+		uint64_t stream;
 
 		// The client's original question, which must be included
 		// as it was in the response.  Used for validation.
@@ -43,6 +78,33 @@ public:
 		// The ID with which the client originally sent the query.
 		// When forwarding we replace it with a random one.
 		query_id_t original_query_id;
+
+		// The RD bit of the client's query, echoed in the responses
+		// made up for it.
+		bool recursion_desired;
+
+		// The entire query as it was forwarded, kept only if it may
+		// need to be hedged.
+		const std::vector<char> query;
+
+		// The letters of the QNAME whose case was flipped when
+		// forwarding (0x20 encoding), to be flipped back in the
+		// response.  See DNSMessage::Flip_case().
+		uint64_t case_mask;
+
+		// The largest response the client can take over UDP,
+		// or 0 if the query arrived on a @stream.
+		uint16_t udp_size;
+
+		// If the query has been hedged, the ID of the other request
+		// sent to a different server.
+		bool hedged;
+		request_id_t sibling;
+
+		// Whether the query has been sent again over TCP, because
+		// the UDP response was truncated.  This is the last step
+		// of the request's lifecycle.
+		bool over_tcp;
 	};
 
 protected:
@@ -51,6 +113,10 @@ protected:
 	const unsigned REQUEST_TIMEOUT;
 	const unsigned MIN_GC_TIME;
 
+	// How many random query IDs Get_query_id() tries before counting
+	// the free ones.
+	static const unsigned MAX_PROBES = 8;
+
 	// A timerfd used to tick when a garbage collection is due.
 	int gc_timer;
 
@@ -71,14 +137,31 @@ protected:
 		EXACT,
 	} timer_state;
 
-	// Map of proxied query ID -> forwarded request.  Used to identify
-	// incoming responses.  Needs to be ordered for Get_query_id().
-	std::map<query_id_t, struct request_st> requests;
+	// The nodes of @requests and @expirations are allocated from here.
+	// Must be declared before them to outlive them.
+	Pool pool;
 
-	// Set of <expiration time, proxied query ID>s.  Used for garbage
+	// Map of request ID -> forwarded request.  Used to identify
+	// incoming responses.  Needs to be ordered for Get_query_id(),
+	// which relies on the requests of a socket being adjacent.
+	typedef std::pair<const request_id_t, struct request_st>
+		request_pair_t;
+	std::map<request_id_t, struct request_st, std::less<request_id_t>,
+		 Pool_allocator<request_pair_t>> requests;
+
+	// Upstream socket fd -> the number of its query IDs used by
+	// @requests.  Sockets without outstanding requests are not in it.
+	std::unordered_map<int, size_t> used_query_ids;
+
+	// Set of <expiration time, request ID>s.  Used for garbage
 	// collection.
-	std::set<std::pair<std::chrono::steady_clock::time_point, query_id_t>>
-		expirations;
+	typedef std::pair<std::chrono::steady_clock::time_point, request_id_t>
+		expiration_t;
+	std::set<expiration_t, std::less<expiration_t>,
+		 Pool_allocator<expiration_t>> expirations;
+
+	// The bytes held by the questions and queries of @requests.
+	size_t data_size = 0;
 
 public:
 	Requests(unsigned max_requests,
@@ -87,30 +170,135 @@ public:
 		 int timerfd);
 	~Requests();
 
-	// Find a random query ID not used by any ongoing @requests.
-	// Returns false if none could be found.
-	bool Get_query_id(query_id_t *query_idp) const;
+	// Whether @MAX_OUTSTANDING_REQUESTS has been reached.
+	bool Full() const;
+
+	// The bytes held by the outstanding requests, and the free nodes
+	// kept for reuse unless they have been Trim()med.
+	size_t Memory() const { return this->pool.nbytes + this->data_size; }
+	void Trim() { this->pool.Trim(); }
+
+	// The bytes held by an outstanding request on average, or 0
+	// if there are none.
+	size_t Memory_per_request() const
+	{
+		return !this->requests.empty()
+			? (this->pool.nbytes - this->pool.nfree_bytes
+			   + this->data_size) / this->requests.size()
+			: 0;
+	}
+
+	// Find a random query ID not used by any ongoing @requests sent
+	// through @upstream_fd.  Returns false if none could be found.
+	bool Get_query_id(int upstream_fd, query_id_t *query_idp) const;
+
+	// Take over @request, which was forwarded by another process
+	// and keeps its times, as @request_id.
+	void Adopt(request_id_t request_id, const struct request_st &request);
 
 	// Called when a request is actually forwarded with the allocated
-	// @query_id.  The parameters are used to construct a request_st.
-	void Put(query_id_t query_id, int upstream_fd,
-		 const struct sockaddr_in &client,
+	// @request_id.  The parameters are used to construct a request_st.
+	void Put(request_id_t request_id, unsigned server,
+		 const struct sockaddr_in &client, uint64_t stream,
 		 std::vector<char> &question,
-		 query_id_t orig_query_id);
+		 query_id_t orig_query_id, bool recursion_desired,
+		 std::vector<char> &query, uint64_t case_mask,
+		 uint16_t udp_size, bool over_tcp = false);
+
+	// Return the outstanding request identified by @request_id or NULL.
+	const struct request_st *Find(request_id_t request_id) const;
+
+	// Mark two outstanding requests as hedges of each other ...
+	void Link(request_id_t request_id, request_id_t sibling);
 
-	// Return the outstanding request identified by @query_id or NULL.
-	const struct request_st *Find(query_id_t query_id) const;
+	// ... or break the link when one of them is gone.
+	void Unlink(request_id_t request_id);
 
 	// Called when a @request is done and can be removed from the
 	// internal data structures.
-	void Done(query_id_t query_id, const struct request_st *request);
+	void Done(request_id_t request_id, const struct request_st *request);
 
 	// Called when @gc_timer ticks to remove expired requests from the
-	// internal data structures.  @callback is called for each one.
-	void Gc(std::function<void(const struct request_st *)> callback);
+	// internal data structures.  @callback is called for each one as
+	// @callback(request_id_t, const struct request_st *).  It's a template
+	// so the call can be inlined.
+	template <typename Callback>
+	void Gc(Callback callback);
+
+	// Called when @upstream_fd is about to be closed to remove its
+	// outstanding requests, so they aren't mistaken for the ones of
+	// a socket reusing the fd.  @callback is called for each like
+	// with Gc().
+	template <typename Callback>
+	void Purge(int upstream_fd, Callback callback);
+
+	// Call @callback(request_id_t, const struct request_st *) for each
+	// outstanding request.
+	template <typename Callback>
+	void For_each(Callback callback) const
+	{
+		for (const auto &i: this->requests)
+			callback(i.first, &i.second);
+	}
 
 protected:
+	static size_t data_size_of(const struct request_st &request)
+	{
+		return request.question.capacity() + request.query.capacity();
+	}
+
+	void release_query_id(request_id_t request_id);
 	void update_gc_timer();
 };
 
+// Template definitions
+template <typename Callback>
+void Requests::Gc(Callback callback)
+{
+	bool update_timer = false;
+	assert(REQUEST_TIMEOUT > 0);
+
+	auto i = this->expirations.begin();
+	auto now = std::chrono::steady_clock::now();
+	while (i != this->expirations.end() && i->first <= now)
+	{	// The request pointed to by @i is too old, remove it.
+		auto o = this->requests.find(i->second);
+		assert(o != this->requests.end());
+
+		common::Log_debug("Request %u timed out", Query_id(o->first));
+		callback(o->first, &o->second);
+		release_query_id(o->first);
+		this->data_size -= data_size_of(o->second);
+		this->requests.erase(o);
+
+		// rease() returns an iterator pointing at the next element.
+		i = this->expirations.erase(i);
+		update_timer = true;
+	}
+
+	if (update_timer)
+		update_gc_timer();
+}
+
+template <typename Callback>
+void Requests::Purge(int upstream_fd, Callback callback)
+{
+	// The requests of @upstream_fd are adjacent in @requests.
+	// @callback may change others, so their IDs are collected first.
+	std::vector<request_id_t> request_ids;
+	for (auto i = this->requests.lower_bound(Request_id(upstream_fd, 0));
+	     i != this->requests.end() && Upstream_fd(i->first) == upstream_fd;
+	     i++)
+		request_ids.push_back(i->first);
+
+	for (auto request_id: request_ids)
+	{
+		const struct request_st *request = Find(request_id);
+		if (!request)
+			continue;
+		callback(request_id, request);
+		Done(request_id, request);
+	}
+}
+
 #endif // ! REQUESTS_H
@@ -0,0 +1,81 @@
+#ifndef RING_H
+#define RING_H
+
+#include <cassert>
+#include <atomic>
+#include <vector>
+
+// Bounded lock-free FIFO between exactly one producer and one consumer
+// thread.  @head is only written by the consumer and @tail only by the
+// producer, so neither needs more than an acquire load of the other's.
+template <typename T>
+class Ring
+{
+protected:
+	std::vector<T> slots;
+	const size_t MASK;
+
+	// Keep the indexes in separate cache lines, so the producer and
+	// the consumer don't keep stealing them from each other.
+	char pad0[64];
+	std::atomic<size_t> head;
+	char pad1[64];
+	std::atomic<size_t> tail;
+	char pad2[64];
+
+	// The highest occupancy seen by the producer.
+	std::atomic<size_t> peak;
+
+public:
+	// @capacity must be a power of 2.
+	Ring(size_t capacity):
+		slots(capacity), MASK(capacity - 1),
+		head(0), tail(0), peak(0)
+	{
+		assert(capacity > 0 && !(capacity & MASK));
+	}
+
+	// Called by the producer.  Returns false if the ring is full,
+	// in which case @item is left intact.
+	bool Push(T &item)
+	{
+		const size_t tail = this->tail.load(std::memory_order_relaxed);
+		const size_t used = tail
+			- this->head.load(std::memory_order_acquire);
+
+		if (used > MASK)
+			return false;
+		this->slots[tail & MASK] = std::move(item);
+		this->tail.store(tail + 1, std::memory_order_release);
+
+		if (used + 1 > this->peak.load(std::memory_order_relaxed))
+			this->peak.store(used + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Called by the consumer.  Returns false if the ring is empty.
+	bool Pop(T *itemp)
+	{
+		const size_t head = this->head.load(std::memory_order_relaxed);
+
+		if (head == this->tail.load(std::memory_order_acquire))
+			return false;
+		*itemp = std::move(this->slots[head & MASK]);
+		this->head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// The occupancy statistics can be read from any thread,
+	// but they are only approximate.
+	size_t Size() const
+	{	// Load @head first so it can't be past @tail.
+		const size_t head = this->head.load(std::memory_order_acquire);
+		return this->tail.load(std::memory_order_acquire) - head;
+	}
+	size_t Capacity() const { return this->MASK + 1; }
+
+	// Return the peak occupancy and start measuring it again.
+	size_t Peak() { return this->peak.exchange(0); }
+};
+
+#endif // ! RING_H
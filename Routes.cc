@@ -0,0 +1,142 @@
+// Include files
+#include <cstring>
+
+#include <arpa/nameser.h>
+
+#include "common.h"
+#include "DNSMessage.h"
+#include "Records.h"
+#include "Routes.h"
+
+// Static member definitions
+const unsigned Routes::NO_ROUTE;
+
+// Program code
+Routes::Routes()
+{
+	struct node_st root = { std::string(), NO_ROUTE };
+	this->nodes.push_back(root);
+}
+
+bool Routes::Add(const char *domain, unsigned route)
+{
+	std::string name(domain);
+
+	// Split @name into lowercase labels.
+	std::vector<std::string> labels;
+	if (!name.empty() && name.back() == '.')
+		name.pop_back();
+	if (name.size() > NS_MAXDNAME - 2)
+	{
+		common::Log_error("%s: domain name too long", domain);
+		return false;
+	}
+	for (size_t start = 0; !name.empty(); )
+	{
+		size_t dot = name.find('.', start);
+		if (dot == std::string::npos)
+			dot = name.size();
+		if (dot == start || dot - start > NS_MAXLABEL)
+		{
+			common::Log_error("%s: invalid domain name", domain);
+			return false;
+		}
+
+		labels.push_back(name.substr(start, dot - start));
+		DNSMessage::Fold_case(&labels.back()[0], labels.back().data(),
+				      labels.back().size());
+		if (dot == name.size())
+			break;
+		start = dot + 1;
+	}
+
+	// Walk down from the root, creating the missing nodes.
+	unsigned node = 0;
+	for (auto label = labels.rbegin(); label != labels.rend(); label++)
+	{
+		const uint64_t key = edge_key(node, label->data(),
+					      label->size());
+		auto edge = this->edges.find(key);
+		if (edge == this->edges.end())
+		{
+			struct node_st child = { *label, NO_ROUTE };
+			this->nodes.push_back(child);
+			this->edges[key] = this->nodes.size() - 1;
+			node = this->nodes.size() - 1;
+		} else if (this->nodes[edge->second].label == *label)
+			node = edge->second;
+		else
+		{	// Hash collision, very unlikely.
+			common::Log_error("%s: can't add route", domain);
+			return false;
+		}
+	}
+
+	if (this->nodes[node].route != NO_ROUTE)
+	{
+		common::Log_error("%s: duplicate route", domain);
+		return false;
+	}
+
+	this->nodes[node].route = route;
+	return true;
+}
+
+unsigned Routes::Lookup(const char *qname, size_t sqname) const
+{
+	char folded[NS_MAXCDNAME];
+	unsigned labels[NS_MAXCDNAME / 2], nlabels = 0;
+
+	// Find the labels of @qname, which has been validated by DNSMessage.
+	if (sqname > sizeof(folded))
+		return NO_ROUTE;
+	DNSMessage::Fold_case(folded, qname, sqname);
+	for (size_t off = 0; off < sqname && folded[off]; )
+	{
+		unsigned llabel = static_cast<uint8_t>(folded[off]);
+
+		// DNSMessage accepts a compression pointer at the end
+		// of a QNAME.  Then its suffix is unknown, so only the root
+		// can match.
+		if ((llabel & NS_CMPRSFLGS) || off + 1 + llabel > sqname)
+		{
+			nlabels = 0;
+			break;
+		}
+		labels[nlabels++] = off;
+		off += 1 + llabel;
+	}
+
+	// Walk down the trie from the last label as far as possible,
+	// remembering the last route passed.
+	unsigned node = 0, route = this->nodes[0].route;
+	while (nlabels > 0)
+	{
+		const char *label = &folded[labels[--nlabels]];
+		const size_t slabel = static_cast<uint8_t>(*label++);
+
+		auto edge = this->edges.find(edge_key(node, label, slabel));
+		if (edge == this->edges.end())
+			break;
+
+		node = edge->second;
+		const struct node_st &child = this->nodes[node];
+		if (child.label.size() != slabel
+		    || memcmp(child.label.data(), label, slabel))
+			break;
+		if (child.route != NO_ROUTE)
+			route = child.route;
+	}
+
+	return route;
+}
+
+// Return the key of the edge from @parent labelled with @label
+// in the @edges table.
+uint64_t Routes::edge_key(unsigned parent, const char *label, size_t slabel)
+{
+	return Records::Hash(label, slabel)
+		^ (parent * 0x9e3779b97f4a7c15ull);
+}
+
+// End of Routes.cc
@@ -0,0 +1,54 @@
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Class mapping domain suffixes to route numbers, finding the longest
+// matching suffix of a query name.  The domains are stored in a trie
+// of reversed labels (com -> example -> www), whose edges are kept in
+// a single hash table keyed by the parent node and the label, so a lookup
+// costs one hash table probe per label without allocating memory.
+class Routes
+{
+public:
+	// Returned by Lookup() if no suffix matches.
+	static const unsigned NO_ROUTE = ~0u;
+
+protected:
+	struct node_st
+	{
+		// The lowercase label leading to this node from its parent.
+		std::string label;
+
+		// The route of the domain ending at this node, or NO_ROUTE
+		// if it's only an intermediate node.
+		unsigned route;
+	};
+
+	// @nodes[0] is the root.
+	std::vector<struct node_st> nodes;
+
+	// Maps edge_key(parent, label) to the index of the child node.
+	std::unordered_map<uint64_t, unsigned> edges;
+
+public:
+	Routes();
+
+	// Add @domain (in presentation format) and its subdomains
+	// to @route.  Returns false if @domain is invalid or already added.
+	bool Add(const char *domain, unsigned route);
+
+	// Return the route of the longest suffix of @qname (in wire format)
+	// which has been Add()ed, or NO_ROUTE.
+	unsigned Lookup(const char *qname, size_t sqname) const;
+
+protected:
+	static uint64_t edge_key(unsigned parent,
+				 const char *label, size_t slabel);
+};
+
+#endif // ! ROUTES_H
@@ -0,0 +1,122 @@
+// Include files
+#include <sys/socket.h>
+#include <algorithm>
+
+#include "common.h"
+#include "SocketBuffers.h"
+
+// Static member definitions
+const unsigned SocketBuffers::GROW_INTERVAL_MS;
+const unsigned SocketBuffers::IDLE_TIME;
+
+// Program code
+SocketBuffers::SocketBuffers(unsigned max_size):
+	MAX_SIZE(max_size),
+	total_size(0), initial_size(0), frozen(false)
+{
+	// NOP
+}
+
+// Return the state of @sfd, creating it if we haven't seen it yet.
+struct SocketBuffers::socket_st &SocketBuffers::lookup(int sfd, time_point now)
+{
+	auto i = this->sockets.find(sfd);
+	if (i != this->sockets.end())
+		return i->second;
+
+	// The kernel reports the doubled value it actually uses.
+	int size = 0;
+	socklen_t ssize = sizeof(size);
+	if (getsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &size, &ssize) < 0)
+		common::Log_error("getsockopt(SO_RCVBUF): %m");
+
+	auto ret = this->sockets.emplace(sfd, socket_st { 0,
+		static_cast<unsigned>(size), static_cast<unsigned>(size),
+		now, now });
+	this->total_size += size;
+	this->initial_size += size;
+	return ret.first->second;
+}
+
+void SocketBuffers::resize(int sfd, struct socket_st &socket,
+			   unsigned size, time_point now)
+{
+	// The kernel doubles the requested value.  Try to override
+	// net.core.[rw]mem_max first, which needs CAP_NET_ADMIN.
+	int val = size / 2;
+	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) < 0
+	    && setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) < 0)
+	{
+		common::Log_error("setsockopt(SO_RCVBUF): %m");
+		return;
+	}
+	if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUFFORCE, &val, sizeof(val)) < 0
+	    && setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)) < 0)
+		common::Log_error("setsockopt(SO_SNDBUF): %m");
+
+	// See what we've got.
+	socklen_t ssize = sizeof(val);
+	if (getsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &val, &ssize) < 0)
+	{
+		common::Log_error("getsockopt(SO_RCVBUF): %m");
+		return;
+	}
+
+	common::Log_debug("Socket %d: buffer size %u -> %d",
+			  sfd, socket.size, val);
+	this->total_size -= socket.size;
+	this->total_size += socket.size = val;
+	socket.resized = now;
+}
+
+unsigned SocketBuffers::Received(int sfd, uint32_t drops)
+{
+	auto now = std::chrono::steady_clock::now();
+	auto &socket = lookup(sfd, now);
+
+	// The counter is cumulative and may wrap around.
+	uint32_t ndropped = drops - socket.drops;
+	socket.drops = drops;
+
+	if (!MAX_SIZE)
+		return ndropped;
+
+	if (ndropped)
+	{	// Grow the buffer if it has had some time to fill up since
+		// the last time.
+		socket.dropped = now;
+		if (!this->frozen && socket.size < MAX_SIZE
+		    && now >= socket.resized
+				+ std::chrono::milliseconds(GROW_INTERVAL_MS))
+			resize(sfd, socket,
+			       std::min(2*socket.size, MAX_SIZE), now);
+	} else if (socket.size > socket.initial_size
+		   && now >= socket.dropped + std::chrono::seconds(IDLE_TIME)
+		   && now >= socket.resized + std::chrono::seconds(IDLE_TIME))
+		// It's been quiet for a while, give back some memory.
+		resize(sfd, socket,
+		       std::max(socket.size/2, socket.initial_size), now);
+
+	return ndropped;
+}
+
+void SocketBuffers::Forget(int sfd)
+{
+	auto i = this->sockets.find(sfd);
+	if (i != this->sockets.end())
+	{
+		this->total_size -= i->second.size;
+		this->initial_size -= i->second.initial_size;
+		this->sockets.erase(i);
+	}
+}
+
+void SocketBuffers::Shrink()
+{
+	auto now = std::chrono::steady_clock::now();
+	for (auto &i: this->sockets)
+		if (i.second.size > i.second.initial_size)
+			resize(i.first, i.second, i.second.initial_size, now);
+}
+
+// End of SocketBuffers.cc
@@ -0,0 +1,84 @@
+#ifndef SOCKET_BUFFERS_H
+#define SOCKET_BUFFERS_H
+
+#include <cstdint>
+#include <chrono>
+#include <unordered_map>
+
+// Class accounting the messages the kernel dropped because a socket's
+// receive buffer was full, and optionally resizing the socket buffers
+// to prevent further drops.
+class SocketBuffers
+{
+protected:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	// Initialized from command line options.  If 0 the buffers are
+	// not resized.
+	const unsigned MAX_SIZE;
+
+	// Don't grow a buffer more often than this ...
+	static const unsigned GROW_INTERVAL_MS = 100;
+
+	// ... and shrink it after this many seconds without drops.
+	static const unsigned IDLE_TIME = 60;
+
+	struct socket_st
+	{
+		// The cumulative drop counter last reported by the kernel.
+		uint32_t drops;
+
+		// The buffer size we started with and the current one,
+		// as reported by getsockopt().
+		unsigned initial_size, size;
+
+		// When was the buffer last resized and when did the kernel
+		// last drop a message.
+		time_point resized, dropped;
+	};
+
+	// Socket fd -> buffer state.
+	std::unordered_map<int, struct socket_st> sockets;
+
+	// Sum of socket_st::size and socket_st::initial_size
+	// of all @sockets.
+	unsigned long long total_size, initial_size;
+
+	// Whether the buffers are kept from growing.
+	bool frozen;
+
+public:
+	SocketBuffers(unsigned max_size);
+
+	// Called when a message is received on @sfd with the drop counter
+	// of the socket.  Returns the number of messages dropped since the
+	// previous call.
+	unsigned Received(int sfd, uint32_t drops);
+
+	// Called when @sfd is closed.
+	void Forget(int sfd);
+
+	// Total size of the receive and send buffers of the known sockets,
+	// which are kept the same size.
+	unsigned long long Total_size() const { return 2*this->total_size; }
+
+	// The part of Total_size() the buffers have been grown by,
+	// which is memory the proxy chose to use over the system's
+	// default.
+	unsigned long long Grown_size() const
+	{
+		return 2*(this->total_size - this->initial_size);
+	}
+
+	// Shrink the grown buffers back to their initial size,
+	// and keep them from growing again while @frozen.
+	void Shrink();
+	void Freeze(bool frozen) { this->frozen = frozen; }
+
+protected:
+	struct socket_st &lookup(int sfd, time_point now);
+	void resize(int sfd, struct socket_st &socket,
+		    unsigned size, time_point now);
+};
+
+#endif // ! SOCKET_BUFFERS_H
@@ -0,0 +1,491 @@
+// Include files
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/err.h>
+
+#include "common.h"
+#include "TLSUpstream.h"
+#include "StreamListener.h"
+
+// Static member definitions
+uint64_t StreamListener::last_stream = 0;
+const size_t StreamListener::MAX_OUTPUT;
+
+// Program code
+StreamListener::StreamListener(SSL_CTX *ctx, unsigned max_connections,
+			       int pollfd):
+	ctx(ctx),
+	MAX_CONNECTIONS(max_connections),
+	pollfd(pollfd),
+	listenfd(-1)
+{
+	// NOP
+}
+
+StreamListener::~StreamListener()
+{
+	for (const auto &i: this->connections)
+	{
+		if (i.second.ssl)
+			SSL_free(i.second.ssl);
+		close(i.first);
+	}
+
+	if (this->listenfd >= 0)
+		close(this->listenfd);
+}
+
+SSL_CTX *StreamListener::New_context(const char *cert_file,
+				     const char *key_file)
+{
+	SSL_CTX *ctx;
+
+	if (!(ctx = SSL_CTX_new(TLS_server_method())))
+	{
+		common::Log_error("SSL_CTX_new(): %s",
+				  ERR_reason_error_string(ERR_get_error()));
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1)
+	{
+		common::Log_error("%s: %s", cert_file,
+				  ERR_reason_error_string(ERR_get_error()));
+		SSL_CTX_free(ctx);
+		return NULL;
+	} else if (SSL_CTX_use_PrivateKey_file(ctx, key_file,
+					       SSL_FILETYPE_PEM) != 1
+		   || SSL_CTX_check_private_key(ctx) != 1)
+	{
+		common::Log_error("%s: %s", key_file,
+				  ERR_reason_error_string(ERR_get_error()));
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	// Responses are appended to the buffer being written.
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+			 | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	// Let OpenSSL set up kTLS after the handshake if the kernel's tls
+	// module supports the negotiated cipher.  Otherwise it silently
+	// stays in userspace.
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+	return ctx;
+}
+
+bool StreamListener::Listen(const struct sockaddr_in &addr, int sfd)
+{
+	const int on = 1;
+
+	if ((this->listenfd = sfd) >= 0)
+		// Taken over from another process.
+		goto add;
+	if ((this->listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK,
+				     0)) < 0)
+	{
+		common::Log_error("socket(listenfd): %m");
+		return false;
+	}
+
+	setsockopt(this->listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(this->listenfd,
+		 reinterpret_cast<const struct sockaddr *>(&addr),
+		 sizeof(addr)) < 0)
+	{
+		common::Log_error("bind(%s:%u): %m",
+				  inet_ntoa(addr.sin_addr),
+				  ntohs(addr.sin_port));
+		return false;
+	} else if (listen(this->listenfd, SOMAXCONN) < 0)
+	{
+		common::Log_error("listen(): %m");
+		return false;
+	}
+
+add:
+	struct epoll_event event = { EPOLLIN };
+	event.data.fd = this->listenfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, this->listenfd,
+		      &event) < 0)
+	{
+		common::Log_error("epoll_ctl(add): %m");
+		return false;
+	}
+
+	common::Log_info("Listening on %s:%u (%s)",
+			 inet_ntoa(addr.sin_addr), ntohs(addr.sin_port),
+			 this->ctx ? "TLS" : "TCP");
+	return true;
+}
+
+void StreamListener::Accept()
+{
+	const int on = 1;
+
+	for (;;)
+	{
+		int sfd;
+		SSL *ssl = NULL;
+		struct sockaddr_in client;
+		socklen_t sclient = sizeof(client);
+
+		if ((sfd = accept4(this->listenfd,
+				   reinterpret_cast<struct sockaddr *>(&client),
+				   &sclient, SOCK_NONBLOCK)) < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				common::Log_error("accept(): %m");
+			return;
+		}
+
+		if (MAX_CONNECTIONS
+		    && this->connections.size() >= MAX_CONNECTIONS)
+			evict();
+
+		// Responses are written as soon as they are ready.
+		setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		if (this->ctx)
+		{
+			if (!(ssl = SSL_new(this->ctx)))
+			{
+				common::Log_error("SSL_new(): %s",
+					ERR_reason_error_string(
+						ERR_get_error()));
+				close(sfd);
+				continue;
+			}
+			SSL_set_fd(ssl, sfd);
+			SSL_set_accept_state(ssl);
+		}
+
+		struct epoll_event event = { EPOLLIN };
+		event.data.fd = sfd;
+		if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, sfd, &event) < 0)
+		{
+			common::Log_error("epoll_ctl(add): %m");
+			if (ssl)
+				SSL_free(ssl);
+			close(sfd);
+			continue;
+		}
+
+		struct connection_st &conn = this->connections[sfd];
+		conn.stream = ++last_stream;
+		conn.client = client;
+		conn.ssl = ssl;
+		conn.established = !ssl;
+		conn.ktls_send = conn.ktls_recv = false;
+		conn.want_write = false;
+		conn.events = EPOLLIN;
+		conn.last_active = std::chrono::steady_clock::now();
+		conn.read_closed = false;
+		conn.outstanding = 0;
+		this->streams[conn.stream] = sfd;
+
+		this->naccepted++;
+		if (common::Debug)
+			common::Log_debug("%s:%u: connection accepted",
+					  inet_ntoa(client.sin_addr),
+					  ntohs(client.sin_port));
+	}
+}
+
+// Close @sfd.  Responses to its outstanding queries will be dropped.
+void StreamListener::disconnect(int sfd, const char *reason)
+{
+	auto conn = this->connections.find(sfd);
+
+	if (common::Debug)
+		common::Log_debug("%s:%u: %s",
+				  inet_ntoa(conn->second.client.sin_addr),
+				  ntohs(conn->second.client.sin_port),
+				  reason);
+
+	this->streams.erase(conn->second.stream);
+	if (conn->second.ssl)
+		SSL_free(conn->second.ssl);
+	close(sfd);
+	this->connections.erase(conn);
+}
+
+// Close the least recently active connection to make room for a new one.
+void StreamListener::evict()
+{
+	auto oldest = this->connections.begin();
+	for (auto i = this->connections.begin();
+	     i != this->connections.end(); i++)
+		if (i->second.last_active < oldest->second.last_active)
+			oldest = i;
+	disconnect(oldest->first, "too many connections");
+}
+
+// Read at most @sbuf bytes from @sfd into @buf, decrypting them with
+// OpenSSL unless the kernel does it.  Returns the number of bytes read,
+// 0 if there's nothing to read, or -1 and *@errorp on error or when
+// the client has finished sending, which sets @conn.read_closed.
+ssize_t StreamListener::read_some(struct connection_st &conn, int sfd,
+				  char *buf, size_t sbuf,
+				  const char **errorp)
+{
+	if (conn.ssl && !conn.ktls_recv)
+	{
+		int ret = SSL_read(conn.ssl, buf, sbuf);
+		if (ret > 0)
+			return ret;
+
+		int error = SSL_get_error(conn.ssl, ret);
+		if (error == SSL_ERROR_WANT_WRITE)
+			conn.want_write = true;
+		else if (error != SSL_ERROR_WANT_READ)
+		{
+			conn.read_closed = error == SSL_ERROR_ZERO_RETURN;
+			*errorp = TLSUpstream::Ssl_error(error);
+			return -1;
+		}
+		return 0;
+	}
+
+	// With kTLS, records other than application data (eg. alerts)
+	// fail read() with EIO.  They would only be needed to close the
+	// connection anyway.
+	ssize_t ret = read(sfd, buf, sbuf);
+	if (ret > 0)
+		return ret;
+	else if (ret == 0)
+	{
+		conn.read_closed = true;
+		*errorp = "connection closed";
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return 0;
+	else
+		*errorp = strerror(errno);
+	return -1;
+}
+
+// Like read_some(), but write @buf.
+ssize_t StreamListener::write_some(struct connection_st &conn, int sfd,
+				   const char *buf, size_t sbuf,
+				   const char **errorp)
+{
+	if (conn.ssl && !conn.ktls_send)
+	{
+		int ret = SSL_write(conn.ssl, buf, sbuf);
+		if (ret > 0)
+			return ret;
+
+		int error = SSL_get_error(conn.ssl, ret);
+		if (error == SSL_ERROR_WANT_WRITE)
+			conn.want_write = true;
+		else if (error != SSL_ERROR_WANT_READ)
+		{
+			*errorp = TLSUpstream::Ssl_error(error);
+			return -1;
+		}
+		return 0;
+	}
+
+	ssize_t ret = write(sfd, buf, sbuf);
+	if (ret >= 0)
+		return ret;
+	else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	{
+		conn.want_write = true;
+		return 0;
+	}
+
+	*errorp = strerror(errno);
+	return -1;
+}
+
+// Continue the TLS handshake of @conn.  When it's completed, find out
+// whether the kernel has taken over the record layer.  Returns an error
+// message or NULL.
+const char *StreamListener::handshake(struct connection_st &conn, int sfd)
+{
+	int ret = SSL_do_handshake(conn.ssl);
+	if (ret != 1)
+	{
+		int error = SSL_get_error(conn.ssl, ret);
+		if (error == SSL_ERROR_WANT_WRITE)
+			conn.want_write = true;
+		else if (error != SSL_ERROR_WANT_READ)
+			return TLSUpstream::Ssl_error(error);
+		return NULL;
+	}
+
+	conn.established = true;
+	conn.ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn.ssl));
+	conn.ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(conn.ssl));
+	if (conn.ktls_send || conn.ktls_recv)
+		this->nktls++;
+
+	if (common::Debug)
+		common::Log_debug("%s:%u: %s handshake completed%s%s",
+				  inet_ntoa(conn.client.sin_addr),
+				  ntohs(conn.client.sin_port),
+				  SSL_get_version(conn.ssl),
+				  conn.ktls_send ? ", kTLS TX" : "",
+				  conn.ktls_recv ? ", kTLS RX" : "");
+	return NULL;
+}
+
+// Read everything available on @conn and append the complete queries
+// to @queries, even if the connection has failed after them.  Returns
+// an error message or NULL, also if the client has finished sending.
+const char *StreamListener::receive(struct connection_st &conn, int sfd,
+				   std::vector<struct query_st> *queries)
+{
+	char buf[16384];
+	const char *error = NULL;
+	ssize_t sread;
+
+	while ((sread = read_some(conn, sfd, buf, sizeof(buf), &error)) > 0)
+		conn.input.insert(conn.input.end(), buf, buf + sread);
+	if (sread == 0 || conn.read_closed)
+		error = NULL;
+
+	// Every message is prefixed by its length.
+	size_t off = 0;
+	while (conn.input.size() - off >= 2)
+	{
+		size_t smsg = (static_cast<uint8_t>(conn.input[off]) << 8)
+			| static_cast<uint8_t>(conn.input[off+1]);
+		if (conn.input.size() - off - 2 < smsg)
+			break;
+
+		struct query_st query = { conn.stream, conn.client };
+		query.msg.assign(&conn.input[off+2], &conn.input[off+2+smsg]);
+		queries->push_back(std::move(query));
+		off += 2 + smsg;
+
+		conn.last_active = std::chrono::steady_clock::now();
+		conn.outstanding++;
+		this->nqueries++;
+	}
+	conn.input.erase(conn.input.begin(), conn.input.begin() + off);
+
+	return error;
+}
+
+// Write as much of @conn.output as possible.  Returns an error message
+// or NULL.
+const char *StreamListener::flush(struct connection_st &conn, int sfd)
+{
+	const char *error;
+
+	while (!conn.output.empty())
+	{
+		ssize_t swritten = write_some(conn, sfd, conn.output.data(),
+					      conn.output.size(), &error);
+		if (swritten < 0)
+			return error;
+		else if (!swritten)
+			break;
+		conn.output.erase(conn.output.begin(),
+				  conn.output.begin() + swritten);
+	}
+
+	return update_events(conn, sfd);
+}
+
+// Make the epoll events of @sfd match what @conn is waiting for.
+// Returns an error message or NULL.
+const char *StreamListener::update_events(struct connection_st &conn,
+					  int sfd)
+{
+	uint32_t events = (conn.read_closed ? 0 : EPOLLIN)
+		| (conn.want_write ? EPOLLOUT : 0);
+	if (events == conn.events)
+		return NULL;
+
+	struct epoll_event event = { events };
+	event.data.fd = sfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_MOD, sfd, &event) < 0)
+		return strerror(errno);
+
+	conn.events = events;
+	return NULL;
+}
+
+void StreamListener::Process(int sfd, uint32_t events,
+			     std::vector<struct query_st> *queries)
+{
+	auto conn = this->connections.find(sfd);
+	if (conn == this->connections.end())
+		return;
+
+	// Whatever the @events are, reading and writing tells what
+	// happened.
+	auto start = std::chrono::steady_clock::now();
+	const char *error = NULL;
+	ERR_clear_error();
+	conn->second.want_write = false;
+	if (!conn->second.established)
+		error = handshake(conn->second, sfd);
+	if (conn->second.read_closed)
+	{	// Nothing more to read, but the client may have gone
+		// altogether.
+		if (events & (EPOLLERR | EPOLLHUP))
+			error = "connection closed";
+	} else if (!error && conn->second.established)
+		error = receive(conn->second, sfd, queries);
+	if (!error)
+		error = flush(conn->second, sfd);
+	if (!error && finished(conn->second))
+		error = "connection closed";
+	if (error)
+		disconnect(sfd, error);
+	this->io_time += std::chrono::steady_clock::now() - start;
+}
+
+bool StreamListener::Reply(uint64_t stream, const char *msg, size_t smsg)
+{
+	auto sfd = this->streams.find(stream);
+	if (sfd == this->streams.end())
+		return false;
+
+	struct connection_st &conn = this->connections[sfd->second];
+	if (conn.outstanding > 0)
+		conn.outstanding--;
+	if (conn.output.size() + 2 + smsg > MAX_OUTPUT)
+	{
+		disconnect(sfd->second, "client not reading responses");
+		return false;
+	}
+
+	conn.output.push_back(smsg >> 8);
+	conn.output.push_back(smsg & 0xFF);
+	conn.output.insert(conn.output.end(), msg, msg + smsg);
+
+	auto start = std::chrono::steady_clock::now();
+	ERR_clear_error();
+	const char *error = flush(conn, sfd->second);
+	this->io_time += std::chrono::steady_clock::now() - start;
+	if (error)
+	{
+		disconnect(sfd->second, error);
+		return false;
+	}
+
+	if (finished(conn))
+		disconnect(sfd->second, "connection closed");
+	return true;
+}
+
+bool StreamListener::Has(int sfd) const
+{
+	return this->connections.count(sfd) > 0;
+}
+
+// End of StreamListener.cc
@@ -0,0 +1,149 @@
+#ifndef STREAM_LISTENER_H
+#define STREAM_LISTENER_H
+
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+// Class accepting DNS queries from clients over TCP (RFC 7766) or
+// DNS-over-TLS (RFC 7858).  Each connection may carry any number of
+// pipelined queries, whose responses are written back in whatever order
+// they are Reply()ed.  TLS is terminated with OpenSSL, but once the
+// handshake is done the record layer is handed over to the kernel (kTLS)
+// if it supports the negotiated cipher, after which the connection is
+// served with plain read() and write() like a TCP one.
+class StreamListener
+{
+public:
+	// A query received by Process().
+	struct query_st
+	{
+		// Identifies the connection to Reply() to.
+		uint64_t stream;
+		struct sockaddr_in client;
+		std::vector<char> msg;
+	};
+
+protected:
+	struct connection_st
+	{
+		uint64_t stream;
+		struct sockaddr_in client;
+
+		// NULL for plain TCP connections.
+		SSL *ssl;
+
+		// Whether the TLS handshake has been completed, and whether
+		// the kernel has taken over encryption and decryption.
+		bool established;
+		bool ktls_send, ktls_recv;
+
+		// Whether we're waiting for the socket to become writable,
+		// and the events the socket is registered for.
+		bool want_write;
+		uint32_t events;
+
+		// The last time a query was received.  When there are too
+		// many connections the least recently active one is closed.
+		std::chrono::steady_clock::time_point last_active;
+
+		// Whether the client has finished sending (FIN or TLS
+		// close_notify), and the number of its queries not Reply()ed
+		// yet.  A half-closed connection is kept until the responses
+		// are written.  The ones of queries never answered keep it
+		// until it's the least recently active one to be closed.
+		bool read_closed;
+		unsigned outstanding;
+
+		// The partial query read so far and the responses not
+		// written yet, with their length prefixes.
+		std::vector<char> input, output;
+	};
+
+	// Socket fd -> connection and connection ID -> socket fd maps.
+	// Connection IDs are never reused, so a late response can't be
+	// sent to a new connection which happens to have the same fd.
+	std::unordered_map<int, struct connection_st> connections;
+	std::unordered_map<uint64_t, int> streams;
+	static uint64_t last_stream;
+
+	// NULL for plain TCP.
+	SSL_CTX *const ctx;
+
+	// Initialized from command line options.
+	const unsigned MAX_CONNECTIONS;
+
+	// A connection is closed if a client doesn't read its responses
+	// and this much is waiting to be written to it.
+	static const size_t MAX_OUTPUT = 256 * 1024;
+
+	// The epoll file descriptor used in the main loop,
+	// and the listening socket.
+	int pollfd, listenfd;
+
+public:
+	// Statistics: the number of connections and the ones offloaded
+	// to kTLS, the number of queries, and the time spent reading and
+	// writing them (including encryption and decryption).
+	unsigned long long naccepted = 0, nktls = 0, nqueries = 0;
+	std::chrono::nanoseconds io_time = std::chrono::nanoseconds::zero();
+
+	// @ctx must outlive the object.  If it's NULL, the connections
+	// are plain TCP.
+	StreamListener(SSL_CTX *ctx, unsigned max_connections, int pollfd);
+	~StreamListener();
+
+	// Create a context for accepting DNS-over-TLS connections with
+	// the certificate chain in @cert_file and the private key in
+	// @key_file.  Returns NULL on error.
+	static SSL_CTX *New_context(const char *cert_file,
+				    const char *key_file);
+
+	// Create the listening socket bound to @addr and add it to @pollfd,
+	// or use @sfd if it's a listening socket bound to it already.
+	// Returns false on error.
+	bool Listen(const struct sockaddr_in &addr, int sfd = -1);
+
+	// The listening socket.
+	int Fd() const { return this->listenfd; }
+
+	// Accept all pending connections.
+	void Accept();
+
+	// Handle @events on @sfd, appending the complete queries received
+	// to @queries.
+	void Process(int sfd, uint32_t events,
+		     std::vector<struct query_st> *queries);
+
+	// Send @msg on the connection identified by @stream, if it's still
+	// open, and close it if the client has finished sending and this
+	// was the last response.  Returns false if it isn't or writing
+	// failed.
+	bool Reply(uint64_t stream, const char *msg, size_t smsg);
+
+	// Whether @sfd is one of our connections.
+	bool Has(int sfd) const;
+
+protected:
+	void disconnect(int sfd, const char *reason);
+	void evict();
+	ssize_t read_some(struct connection_st &conn, int sfd,
+			  char *buf, size_t sbuf, const char **errorp);
+	ssize_t write_some(struct connection_st &conn, int sfd,
+			   const char *buf, size_t sbuf, const char **errorp);
+	const char *handshake(struct connection_st &conn, int sfd);
+	const char *receive(struct connection_st &conn, int sfd,
+			    std::vector<struct query_st> *queries);
+	const char *flush(struct connection_st &conn, int sfd);
+	static bool finished(const struct connection_st &conn)
+	{
+		return conn.read_closed && !conn.outstanding
+			&& conn.output.empty();
+	}
+	const char *update_events(struct connection_st &conn, int sfd);
+};
+
+#endif // ! STREAM_LISTENER_H
@@ -0,0 +1,288 @@
+// Include files
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include <algorithm>
+
+#include <arpa/nameser.h>
+
+#include "common.h"
+#include "Synthesizer.h"
+
+// The rules "special-use" stands for: the names of RFC 6761, 6762 and 7686
+// which shouldn't be forwarded, and the reverse zones of the private and
+// link-local address space, which RFC 6303 recommends answering locally.
+// In the loopback zone 127.0.0.1 maps back to localhost.
+static const char *const special_use[] =
+{
+	"localhost=loopback",
+	"invalid=nxdomain",
+	"local=nxdomain",
+	"onion=nxdomain",
+	"10.in-addr.arpa=nxdomain",
+	"16.172.in-addr.arpa=nxdomain",
+	"17.172.in-addr.arpa=nxdomain",
+	"18.172.in-addr.arpa=nxdomain",
+	"19.172.in-addr.arpa=nxdomain",
+	"20.172.in-addr.arpa=nxdomain",
+	"21.172.in-addr.arpa=nxdomain",
+	"22.172.in-addr.arpa=nxdomain",
+	"23.172.in-addr.arpa=nxdomain",
+	"24.172.in-addr.arpa=nxdomain",
+	"25.172.in-addr.arpa=nxdomain",
+	"26.172.in-addr.arpa=nxdomain",
+	"27.172.in-addr.arpa=nxdomain",
+	"28.172.in-addr.arpa=nxdomain",
+	"29.172.in-addr.arpa=nxdomain",
+	"30.172.in-addr.arpa=nxdomain",
+	"31.172.in-addr.arpa=nxdomain",
+	"168.192.in-addr.arpa=nxdomain",
+	"254.169.in-addr.arpa=nxdomain",
+	"127.in-addr.arpa=nxdomain",
+	"1.0.0.127.in-addr.arpa=localhost",
+	"d.f.ip6.arpa=nxdomain",
+	"8.e.f.ip6.arpa=nxdomain",
+	"9.e.f.ip6.arpa=nxdomain",
+	"a.e.f.ip6.arpa=nxdomain",
+	"b.e.f.ip6.arpa=nxdomain",
+};
+
+// The answers of ANSWER_LOOPBACK rules.  The owner names point to
+// the QNAME.
+static const unsigned char loopback_a[] =
+{
+	0xC0, NS_HFIXEDSZ, 0, ns_t_a, 0, ns_c_in,
+	0, 0, 0, 60, 0, 4,
+	127, 0, 0, 1,
+};
+static const unsigned char loopback_aaaa[] =
+{
+	0xC0, NS_HFIXEDSZ, 0, ns_t_aaaa, 0, ns_c_in,
+	0, 0, 0, 60, 0, 16,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+};
+
+// The answer of ANSWER_LOCALHOST rules.
+static const unsigned char localhost_ptr[] =
+{
+	0xC0, NS_HFIXEDSZ, 0, ns_t_ptr, 0, ns_c_in,
+	0, 0, 0, 60, 0, 11,
+	9, 'l', 'o', 'c', 'a', 'l', 'h', 'o', 's', 't', 0,
+};
+
+// Program code
+bool Synthesizer::Add(const char *rule)
+{
+	if (strcmp(rule, "special-use"))
+		return add_rule(rule);
+
+	for (const auto special: special_use)
+		if (!add_rule(special))
+			return false;
+	return true;
+}
+
+bool Synthesizer::add_rule(const char *text)
+{
+	struct rule_st rule = { text, std::string(), 0, ANSWER_NXDOMAIN,
+				0 };
+	std::string domain, type, action;
+
+	// Split @text into <domain>[:<type>]=<action>.
+	domain = text;
+	size_t eq = domain.rfind('=');
+	if (eq == std::string::npos)
+	{
+		common::Log_error("%s: expected <domain>[:<type>]=<action>",
+				  text);
+		return false;
+	}
+	action = domain.substr(eq + 1);
+	domain.erase(eq);
+
+	size_t colon = domain.find(':');
+	if (colon != std::string::npos)
+	{
+		type = domain.substr(colon + 1);
+		domain.erase(colon);
+		if (!parse_type(type, &rule.qtype))
+		{
+			common::Log_error("%s: unknown type %s",
+					  text, type.c_str());
+			return false;
+		}
+	}
+
+	if (!strcasecmp(action.c_str(), "nxdomain"))
+		rule.action = ANSWER_NXDOMAIN;
+	else if (!strcasecmp(action.c_str(), "nodata"))
+		rule.action = ANSWER_NODATA;
+	else if (!strcasecmp(action.c_str(), "loopback"))
+		rule.action = ANSWER_LOOPBACK;
+	else if (!strcasecmp(action.c_str(), "localhost"))
+		rule.action = ANSWER_LOCALHOST;
+	else
+	{
+		common::Log_error("%s: unknown action %s",
+				  text, action.c_str());
+		return false;
+	}
+
+	if (domain.empty())
+	{
+		common::Log_error("%s: missing domain", text);
+		return false;
+	}
+	if (domain.back() == '.')
+		domain.pop_back();
+	DNSMessage::Fold_case(&domain[0], domain.data(), domain.size());
+	rule.domain = domain;
+
+	for (const auto &other: this->rules)
+		if (other.domain == rule.domain && other.qtype == rule.qtype)
+		{
+			common::Log_error("%s: conflicts with %s",
+					  text, other.text.c_str());
+			return false;
+		}
+
+	// The first rule of a domain adds it to the @trie.
+	if (std::find(this->domains.begin(), this->domains.end(), domain)
+	    == this->domains.end())
+	{
+		if (!this->trie.Add(domain.empty() ? "." : domain.c_str(),
+				    this->domains.size()))
+			return false;
+		this->domains.push_back(domain);
+	}
+
+	this->rules.push_back(rule);
+	update_candidates();
+	return true;
+}
+
+// Rebuild the @candidates of every domain: the rules of the domain and
+// its parents, the longest domain first, and of the same domain the rule
+// with a type first.  There are few rules, so it's done from scratch.
+void Synthesizer::update_candidates()
+{
+	const auto &rules = this->rules;
+
+	this->candidates.assign(this->domains.size(),
+				std::vector<unsigned>());
+	for (unsigned i = 0; i < this->domains.size(); i++)
+	{
+		auto &candidates = this->candidates[i];
+
+		for (unsigned rule = 0; rule < rules.size(); rule++)
+			if (is_subdomain(this->domains[i],
+					 rules[rule].domain))
+				candidates.push_back(rule);
+
+		std::stable_sort(candidates.begin(), candidates.end(),
+				 [&rules](unsigned lhs, unsigned rhs)
+		{
+			if (rules[lhs].domain.size()
+			    != rules[rhs].domain.size())
+				return rules[lhs].domain.size()
+					> rules[rhs].domain.size();
+			return rules[lhs].qtype && !rules[rhs].qtype;
+		});
+	}
+}
+
+bool Synthesizer::Answer(const DNSMessage &query, std::vector<char> &response)
+{
+	unsigned domain = this->trie.Lookup(query.Qname(),
+					    query.Qname_size());
+	if (domain == Routes::NO_ROUTE)
+		return false;
+
+	for (unsigned i: this->candidates[domain])
+	{
+		struct rule_st &rule = this->rules[i];
+		if (rule.qtype && rule.qtype != query.qtype)
+			continue;
+
+		rule.hits++;
+		bool loopback = rule.action == ANSWER_LOOPBACK;
+		if (rule.action == ANSWER_NXDOMAIN)
+			query.Answer(response, ns_r_nxdomain);
+		else if (loopback && query.qtype == ns_t_a)
+			query.Answer(response, ns_r_noerror,
+				     reinterpret_cast<const char *>(
+								loopback_a),
+				     sizeof(loopback_a), 1);
+		else if (loopback && query.qtype == ns_t_aaaa)
+			query.Answer(response, ns_r_noerror,
+				     reinterpret_cast<const char *>(
+							loopback_aaaa),
+				     sizeof(loopback_aaaa), 1);
+		else if (rule.action == ANSWER_LOCALHOST
+			 && query.qtype == ns_t_ptr)
+			query.Answer(response, ns_r_noerror,
+				     reinterpret_cast<const char *>(
+							localhost_ptr),
+				     sizeof(localhost_ptr), 1);
+		else	// NODATA
+			query.Answer(response, ns_r_noerror);
+		return true;
+	}
+
+	return false;
+}
+
+// Parse the mnemonic of a common query type or TYPE<number> (RFC 3597).
+bool Synthesizer::parse_type(const std::string &type, uint16_t *qtypep)
+{
+	static const struct
+	{
+		const char *name;
+		uint16_t qtype;
+	} types[] =
+	{
+		{ "A",		ns_t_a		},
+		{ "NS",		ns_t_ns		},
+		{ "CNAME",	ns_t_cname	},
+		{ "SOA",	ns_t_soa	},
+		{ "PTR",	ns_t_ptr	},
+		{ "MX",		ns_t_mx		},
+		{ "TXT",	ns_t_txt	},
+		{ "AAAA",	ns_t_aaaa	},
+		{ "SRV",	ns_t_srv	},
+		{ "SVCB",	64		},
+		{ "HTTPS",	65		},
+		{ "ANY",	ns_t_any	},
+	};
+
+	for (const auto &i: types)
+		if (!strcasecmp(type.c_str(), i.name))
+		{
+			*qtypep = i.qtype;
+			return true;
+		}
+
+	char *end;
+	if (strncasecmp(type.c_str(), "TYPE", 4))
+		return false;
+	unsigned long qtype = strtoul(type.c_str() + 4, &end, 10);
+	if (*end || end == type.c_str() + 4 || !qtype || qtype > 0xFFFF)
+		return false;
+	*qtypep = qtype;
+	return true;
+}
+
+// Whether @domain is @parent or its subdomain.
+bool Synthesizer::is_subdomain(const std::string &domain,
+			       const std::string &parent)
+{
+	if (parent.empty() || domain == parent)
+		return true;
+	return domain.size() > parent.size()
+		&& domain[domain.size() - parent.size() - 1] == '.'
+		&& !domain.compare(domain.size() - parent.size(),
+				   parent.size(), parent);
+}
+
+// End of Synthesizer.cc
@@ -0,0 +1,85 @@
+#ifndef SYNTHESIZER_H
+#define SYNTHESIZER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "DNSMessage.h"
+#include "Routes.h"
+
+// Class answering queries the upstream servers can't usefully answer
+// locally, like the ones for special-use names (RFC 6761) or AAAA queries
+// on IPv4-only networks, by rules of the form <domain>[:<type>]=<action>.
+// A rule matches <domain> and its subdomains, and only queries of <type>
+// if it's given.  The rule of the longest matching domain wins, and of
+// the same domain a rule with a <type> over one without.  The domains are
+// looked up in a Routes trie, whose route numbers index the precomputed
+// list of candidate rules of each domain, including the ones inherited
+// from its parents, so matching is a single walk down the trie.
+class Synthesizer
+{
+public:
+	enum action_t
+	{
+		ANSWER_NXDOMAIN,
+
+		// NOERROR with an empty answer section.
+		ANSWER_NODATA,
+
+		// 127.0.0.1 and ::1 for A and AAAA queries, NODATA for
+		// other types.
+		ANSWER_LOOPBACK,
+
+		// localhost. for PTR queries, NODATA for other types.
+		ANSWER_LOCALHOST,
+	};
+
+	struct rule_st
+	{
+		// As it was given, for logging.
+		std::string text;
+
+		// Lowercase, without the trailing dot, empty for the root.
+		std::string domain;
+
+		// 0 if the rule matches any type.
+		uint16_t qtype;
+		enum action_t action;
+
+		// Statistics: the number of queries answered by the rule.
+		unsigned long long hits;
+	};
+
+protected:
+	std::vector<struct rule_st> rules;
+
+	// Indexes of the @rules which may match a domain in the @trie,
+	// in order of precedence, and the domains of the lists.
+	std::vector<std::vector<unsigned>> candidates;
+	std::vector<std::string> domains;
+	Routes trie;
+
+public:
+	// Parse and add @rule, or the rules for the special-use names
+	// if it's "special-use".  Returns false if @rule is invalid.
+	bool Add(const char *rule);
+
+	// If a rule matches @query, build the response into @response and
+	// return true.  @query must have a single question of class IN.
+	bool Answer(const DNSMessage &query, std::vector<char> &response);
+
+	const std::vector<struct rule_st> &Rules() const
+	{
+		return this->rules;
+	}
+
+protected:
+	bool add_rule(const char *text);
+	void update_candidates();
+	static bool parse_type(const std::string &type, uint16_t *qtypep);
+	static bool is_subdomain(const std::string &domain,
+				 const std::string &parent);
+};
+
+#endif // ! SYNTHESIZER_H
@@ -0,0 +1,432 @@
+// Include files
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "common.h"
+#include "TLSUpstream.h"
+
+// TCP_FASTOPEN_CONNECT is new in Linux 4.11.
+#ifndef TCP_FASTOPEN_CONNECT
+# define TCP_FASTOPEN_CONNECT		30
+#endif
+
+// Static member definitions
+const unsigned TLSUpstream::PORT;
+
+// Program code
+TLSUpstream::TLSUpstream(SSL_CTX *ctx, unsigned max_connections,
+			 int pollfd, const struct sockaddr_in &upstream,
+			 const std::string &auth_name):
+	ctx(ctx),
+	MAX_CONNECTIONS(max_connections),
+	pollfd(pollfd),
+	upstream(upstream),
+	auth_name(auth_name)
+{
+	// NOP
+}
+
+TLSUpstream::~TLSUpstream()
+{
+	for (const auto &i: this->connections)
+	{
+		SSL_free(i.second.ssl);
+		close(i.first);
+	}
+
+	if (this->session)
+		SSL_SESSION_free(this->session);
+}
+
+SSL_CTX *TLSUpstream::New_context(const char *ca_file)
+{
+	SSL_CTX *ctx;
+
+	if (!(ctx = SSL_CTX_new(TLS_client_method())))
+	{
+		common::Log_error("SSL_CTX_new(): %s",
+				  ERR_reason_error_string(ERR_get_error()));
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if (!(ca_file
+	      ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL)
+	      : SSL_CTX_set_default_verify_paths(ctx)))
+	{
+		common::Log_error("%s: can't load CA certificates: %s",
+				  ca_file ? ca_file : "default",
+				  ERR_reason_error_string(ERR_get_error()));
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	// Queries are appended to the buffer being written.
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+			 | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	// Sessions are kept by new_session() for each server.
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+				       | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session);
+
+	return ctx;
+}
+
+// Called by OpenSSL when a session ticket is received on any connection.
+// Returns 1 to take ownership of @session.
+int TLSUpstream::new_session(SSL *ssl, SSL_SESSION *session)
+{
+	TLSUpstream *self = static_cast<TLSUpstream *>(SSL_get_app_data(ssl));
+
+	if (self->session)
+		SSL_SESSION_free(self->session);
+	self->session = session;
+	return 1;
+}
+
+const char *TLSUpstream::Ssl_error(int error)
+{
+	unsigned long code;
+
+	switch (error)
+	{
+	case SSL_ERROR_ZERO_RETURN:
+		return "connection closed";
+	case SSL_ERROR_SYSCALL:
+		if ((code = ERR_get_error()) != 0)
+			return ERR_reason_error_string(code);
+		return errno ? strerror(errno) : "connection closed";
+	default:
+		if ((code = ERR_get_error()) != 0)
+			return ERR_reason_error_string(code);
+		return "TLS error";
+	}
+}
+
+// Create a new non-blocking connection to the @upstream and add it to
+// @pollfd.  The handshake is started when the first query is flush()ed.
+// On failure logs the error and returns -1.
+int TLSUpstream::connect_upstream()
+{
+	int sfd;
+	SSL *ssl;
+	const int on = 1;
+
+	if ((sfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+	{
+		common::Log_error("socket(tls_fd): %m");
+		return -1;
+	}
+
+	// With TCP_FASTOPEN_CONNECT connect() returns at once and the
+	// ClientHello is sent in the SYN, if we have a cookie from the
+	// server.  Otherwise it's a regular connect().
+	setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (setsockopt(sfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+		       &on, sizeof(on)) < 0)
+		common::Log_debug("setsockopt(TCP_FASTOPEN_CONNECT): %m");
+	if (connect(sfd, reinterpret_cast<const sockaddr *>(&this->upstream),
+		    sizeof(this->upstream)) < 0 && errno != EINPROGRESS)
+	{
+		common::Log_error("connect(%s:%u): %m",
+				  inet_ntoa(this->upstream.sin_addr),
+				  ntohs(this->upstream.sin_port));
+		close(sfd);
+		return -1;
+	}
+
+	if (!this->ctx)
+		ssl = NULL;
+	else if (!(ssl = SSL_new(this->ctx)))
+	{
+		common::Log_error("SSL_new(): %s",
+				  ERR_reason_error_string(ERR_get_error()));
+		close(sfd);
+		return -1;
+	} else
+	{
+		SSL_set_fd(ssl, sfd);
+		SSL_set_connect_state(ssl);
+		SSL_set_app_data(ssl, this);
+		if (this->auth_name.empty())
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+				inet_ntoa(this->upstream.sin_addr));
+		else
+		{
+			SSL_set_tlsext_host_name(ssl,
+						 this->auth_name.c_str());
+			SSL_set1_host(ssl, this->auth_name.c_str());
+		}
+		if (this->session)
+			SSL_set_session(ssl, this->session);
+	}
+
+	struct epoll_event event = { EPOLLIN };
+	event.data.fd = sfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, sfd, &event) < 0)
+	{
+		common::Log_error("epoll_ctl(add): %m");
+		SSL_free(ssl);
+		close(sfd);
+		return -1;
+	}
+
+	// Plain TCP connections have no handshake to wait for,
+	// writing fails with EAGAIN until they're connected.
+	struct connection_st &conn = this->connections[sfd];
+	conn.ssl = ssl;
+	conn.established = !ssl;
+	conn.want_write = false;
+	conn.events = EPOLLIN;
+	conn.outstanding = 0;
+
+	this->nconnects++;
+	common::Log_debug("%s:%u: connecting via %s",
+			  inet_ntoa(this->upstream.sin_addr),
+			  ntohs(this->upstream.sin_port),
+			  ssl ? "TLS" : "TCP");
+	return sfd;
+}
+
+void TLSUpstream::Disconnect(int sfd, const char *reason)
+{
+	auto conn = this->connections.find(sfd);
+	if (conn == this->connections.end())
+		return;
+
+	if (conn->second.outstanding)
+		common::Log_error("%s:%u: %s, %u requests lost",
+				  inet_ntoa(this->upstream.sin_addr),
+				  ntohs(this->upstream.sin_port), reason,
+				  conn->second.outstanding);
+	else
+		common::Log_debug("%s:%u: %s",
+				  inet_ntoa(this->upstream.sin_addr),
+				  ntohs(this->upstream.sin_port), reason);
+	if (this->disconnect_callback)
+		this->disconnect_callback(this->disconnect_arg, sfd);
+
+	// Otherwise SSL_free() would make the last @session unresumable
+	// if the server closed the connection without a close_notify.
+	if (conn->second.ssl && conn->second.established)
+		SSL_set_shutdown(conn->second.ssl,
+				 SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_free(conn->second.ssl);
+	close(sfd);
+	this->connections.erase(conn);
+}
+
+// Make the epoll events of @sfd match what @conn is waiting for.
+// Returns an error message or NULL.
+const char *TLSUpstream::update_events(int sfd, struct connection_st &conn)
+{
+	if (!conn.established && SSL_is_init_finished(conn.ssl))
+	{
+		conn.established = true;
+		if (SSL_session_reused(conn.ssl))
+			this->nresumed++;
+		common::Log_debug("%s:%u: TLS connection established%s",
+				  inet_ntoa(this->upstream.sin_addr),
+				  ntohs(this->upstream.sin_port),
+				  SSL_session_reused(conn.ssl)
+					? " (resumed)" : "");
+	}
+
+	uint32_t events = EPOLLIN | (conn.want_write ? EPOLLOUT : 0);
+	if (events == conn.events)
+		return NULL;
+
+	struct epoll_event event = { events };
+	event.data.fd = sfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_MOD, sfd, &event) < 0)
+		return strerror(errno);
+
+	conn.events = events;
+	return NULL;
+}
+
+// Write as much of @conn.output as possible.  Returns an error message
+// or NULL.
+const char *TLSUpstream::flush(int sfd, struct connection_st &conn)
+{
+	conn.want_write = false;
+	while (!conn.output.empty())
+	{
+		int ret = conn.ssl
+			? SSL_write(conn.ssl, conn.output.data(),
+				    conn.output.size())
+			: write(sfd, conn.output.data(), conn.output.size());
+		if (ret > 0)
+		{
+			conn.output.erase(conn.output.begin(),
+					  conn.output.begin() + ret);
+			continue;
+		}
+
+		if (!conn.ssl)
+		{	// EINPROGRESS: a Fast Open without a cookie.
+			if (errno == EAGAIN || errno == EINPROGRESS)
+				conn.want_write = true;
+			else
+				return strerror(errno);
+			break;
+		}
+
+		int error = SSL_get_error(conn.ssl, ret);
+		if (error == SSL_ERROR_WANT_WRITE)
+			conn.want_write = true;
+		else if (error != SSL_ERROR_WANT_READ)
+			return Ssl_error(error);
+		break;
+	}
+
+	return update_events(sfd, conn);
+}
+
+// Read everything available on @conn and append the complete responses
+// to @responses, even if the connection has failed after them.  Returns
+// an error message or NULL.
+const char *TLSUpstream::receive(int sfd, struct connection_st &conn,
+				 std::vector<std::vector<char>> *responses)
+{
+	char buf[16384];
+	const char *error = NULL;
+
+	for (;;)
+	{
+		int ret = conn.ssl
+			? SSL_read(conn.ssl, buf, sizeof(buf))
+			: read(sfd, buf, sizeof(buf));
+		if (ret > 0)
+		{
+			conn.input.insert(conn.input.end(), buf, buf + ret);
+			continue;
+		}
+
+		if (!conn.ssl)
+		{
+			if (ret == 0)
+				error = "connection closed";
+			else if (errno != EAGAIN)
+				error = strerror(errno);
+			break;
+		}
+
+		int ssl_error = SSL_get_error(conn.ssl, ret);
+		if (ssl_error == SSL_ERROR_WANT_WRITE)
+			conn.want_write = true;
+		else if (ssl_error != SSL_ERROR_WANT_READ)
+			error = Ssl_error(ssl_error);
+		break;
+	}
+
+	// Every message is prefixed by its length.
+	size_t off = 0;
+	while (conn.input.size() - off >= 2)
+	{
+		size_t smsg = (static_cast<uint8_t>(conn.input[off]) << 8)
+			| static_cast<uint8_t>(conn.input[off+1]);
+		if (conn.input.size() - off - 2 < smsg)
+			break;
+
+		responses->emplace_back(&conn.input[off+2],
+					&conn.input[off+2+smsg]);
+		off += 2 + smsg;
+	}
+	conn.input.erase(conn.input.begin(), conn.input.begin() + off);
+
+	return error ? error : update_events(sfd, conn);
+}
+
+int TLSUpstream::Get()
+{	// Choose the connection with the least outstanding requests.
+	int sfd = -1;
+	unsigned least = 0;
+	for (const auto &i: this->connections)
+		if (sfd < 0 || i.second.outstanding < least)
+		{
+			sfd = i.first;
+			least = i.second.outstanding;
+		}
+
+	// Open a new connection if the others are busy.
+	if (sfd < 0 || (least > 0
+			&& (!MAX_CONNECTIONS
+			    || this->connections.size() < MAX_CONNECTIONS)))
+	{
+		int new_sfd = connect_upstream();
+		if (new_sfd >= 0)
+			sfd = new_sfd;
+		else if (sfd < 0)
+			return -1;
+	}
+
+	return sfd;
+}
+
+bool TLSUpstream::Send(int sfd, const char *msg, size_t smsg)
+{
+	if (smsg > 0xFFFF)
+		return false;
+
+	struct connection_st &conn = this->connections[sfd];
+	conn.output.push_back(smsg >> 8);
+	conn.output.push_back(smsg & 0xFF);
+	conn.output.insert(conn.output.end(), msg, msg + smsg);
+	conn.outstanding++;
+
+	ERR_clear_error();
+	if (const char *error = flush(sfd, conn))
+	{
+		Disconnect(sfd, error);
+		return false;
+	}
+
+	return true;
+}
+
+const char *TLSUpstream::Process(int sfd, uint32_t events,
+				 std::vector<std::vector<char>> *responses)
+{
+	auto conn = this->connections.find(sfd);
+	if (conn == this->connections.end())
+		return NULL;
+
+	// Whatever the @events are, reading and writing tells what
+	// happened.  Reading may complete the handshake, so it's done
+	// first to let the pending queries be written.
+	ERR_clear_error();
+	const char *error = receive(sfd, conn->second, responses);
+	if (!error)
+		error = flush(sfd, conn->second);
+	return error;
+}
+
+void TLSUpstream::Done(int sfd)
+{
+	// The requests of a connection are purged through the disconnect
+	// callback before it's closed, so @sfd can't have been reused.
+	auto conn = this->connections.find(sfd);
+	assert(conn != this->connections.end());
+	assert(conn->second.outstanding > 0);
+	conn->second.outstanding--;
+}
+
+bool TLSUpstream::Has(int sfd) const
+{
+	return this->connections.count(sfd) > 0;
+}
+
+// End of TLSUpstream.cc
@@ -0,0 +1,137 @@
+#ifndef TLS_UPSTREAM_H
+#define TLS_UPSTREAM_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+// Class forwarding queries to a DNS-over-TLS (RFC 7858) upstream server
+// through a small pool of persistent connections.  Queries are pipelined
+// on the connections and the responses are returned in whatever order
+// they arrive, to be matched to the requests by their query ID.
+// Reconnecting is made cheap by resuming the last TLS session and by
+// sending the ClientHello in the SYN with TCP Fast Open if the kernel
+// has a cookie for the server.  Without a TLS context the connections
+// are plain TCP, which is used to retry truncated UDP responses.
+class TLSUpstream
+{
+public:
+	// The default port of DNS-over-TLS.
+	static const unsigned PORT = 853;
+
+	// Called with a connection about to be closed.
+	typedef void disconnect_callback_t(void *arg, int sfd);
+
+protected:
+	struct connection_st
+	{
+		// NULL for plain TCP connections.
+		SSL *ssl;
+
+		// Whether the handshake has been completed.
+		bool established;
+
+		// Whether OpenSSL is waiting for the socket to become
+		// writable, and the events the socket is registered for.
+		bool want_write;
+		uint32_t events;
+
+		// Number of requests awaiting response via this connection.
+		unsigned outstanding;
+
+		// Queries not accepted by SSL_write() yet, and the partial
+		// response read so far, with their length prefixes.
+		std::vector<char> output, input;
+	};
+
+	// Socket fd -> connection map.
+	std::unordered_map<int, struct connection_st> connections;
+
+	// Initialized from command line options.
+	SSL_CTX *const ctx;
+	const unsigned MAX_CONNECTIONS;
+
+	// The epoll file descriptor used in the main loop.
+	int pollfd;
+
+	// Address of the upstream DNS server and the name its certificate
+	// is verified against (or its address if empty).
+	struct sockaddr_in upstream;
+	const std::string auth_name;
+
+	// The last session ticket received from the server, which is
+	// used to resume the session on the next connection.
+	SSL_SESSION *session = NULL;
+
+	// Set by On_disconnect().
+	disconnect_callback_t *disconnect_callback = NULL;
+	void *disconnect_arg = NULL;
+
+public:
+	// Statistics
+	unsigned long long nconnects = 0, nresumed = 0;
+
+	// @ctx must outlive the object.  If it's NULL, the connections
+	// are plain TCP.
+	TLSUpstream(SSL_CTX *ctx, unsigned max_connections,
+		    int pollfd, const struct sockaddr_in &upstream,
+		    const std::string &auth_name);
+	~TLSUpstream();
+
+	// Create a context for connecting to DNS-over-TLS servers,
+	// verifying their certificates with the certificates in @ca_file,
+	// or the system's default ones if it's NULL.  Returns NULL on error.
+	static SSL_CTX *New_context(const char *ca_file);
+
+	// Return the least loaded connection, creating a new one if all
+	// of them are busy and @MAX_CONNECTIONS allows it, or -1 on error.
+	int Get();
+
+	// Queue @msg on the connection @sfd returned by Get().
+	// Returns false if the connection failed.
+	bool Send(int sfd, const char *msg, size_t smsg);
+
+	// Handle @events on @sfd, appending the complete responses
+	// received to @responses.  If the connection has failed returns
+	// the reason, and the connection has to be Disconnect()ed once
+	// the @responses have been handled.
+	const char *Process(int sfd, uint32_t events,
+			    std::vector<std::vector<char>> *responses);
+
+	// Close the connection @sfd, after the disconnect callback has
+	// been called with it.
+	void Disconnect(int sfd, const char *reason);
+
+	// Call @callback(@arg, sfd) when a connection is about to be
+	// closed, so the requests outstanding on it can be given up on
+	// before its fd is reused.
+	void On_disconnect(disconnect_callback_t *callback, void *arg)
+	{
+		this->disconnect_callback = callback;
+		this->disconnect_arg = arg;
+	}
+
+	// Called when a response is received through @sfd or if a query
+	// forwarded through it has timed out.
+	void Done(int sfd);
+
+	// Whether @sfd is one of our sockets.
+	bool Has(int sfd) const;
+
+	// Return a human-readable reason of an SSL_ERROR_* @error.
+	static const char *Ssl_error(int error);
+
+protected:
+	int connect_upstream();
+	const char *flush(int sfd, struct connection_st &conn);
+	const char *receive(int sfd, struct connection_st &conn,
+			    std::vector<std::vector<char>> *responses);
+	const char *update_events(int sfd, struct connection_st &conn);
+
+	static int new_session(SSL *ssl, SSL_SESSION *session);
+};
+
+#endif // ! TLS_UPSTREAM_H
@@ -9,13 +9,16 @@
 #include <iterator>
 
 #include "common.h"
+#include "Probes.h"
 #include "Upstream.h"
 
 // Program code
 Upstream::Upstream(unsigned max_ports, unsigned max_port_lifetime,
+		   const common::sockopts_st &sockopts,
 		   int pollfd, const struct sockaddr_in &upstream):
 	MAX_PORTS(max_ports),
 	MAX_PORT_LIFETIME(max_port_lifetime),
+	SOCKOPTS(sockopts),
 	pollfd(pollfd),
 	upstream(upstream)
 {
@@ -54,6 +57,8 @@ int Upstream::new_upstream_socket() const
 		return -1;
 	}
 
+	common::Set_sockopts(sfd, SOCKOPTS);
+
 	struct epoll_event event = { EPOLLIN };
 	event.data.fd = sfd;
 	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, sfd, &event) < 0)
@@ -106,6 +111,7 @@ void Upstream::Put(int sfd, struct socket_usage_st *socket)
 	socket->outstanding++;
 	if (MAX_PORT_LIFETIME && ++socket->lifetime >= MAX_PORT_LIFETIME)
 	{	// @MAX_PORT_LIFETIME reached, move @sfd to @end_of_life.
+		DNSPROXY_PROBE2(socket__rotated, sfd, socket->outstanding);
 		auto i = this->available.find(sfd);
 		assert(i != this->available.end());
 
@@ -157,4 +163,37 @@ void Upstream::Done(int sfd)
 	}
 }
 
+bool Upstream::Has(int sfd) const
+{
+	return this->available.count(sfd) || this->end_of_life.count(sfd);
+}
+
+bool Upstream::Adopt(int sfd, const struct socket_usage_st &usage,
+		     bool retired)
+{
+	if (MAX_PORT_LIFETIME && usage.lifetime >= MAX_PORT_LIFETIME)
+		retired = true;
+	if (retired && !usage.outstanding)
+	{	// Nothing is expected on it anymore.
+		close(sfd);
+		return true;
+	}
+
+	common::Set_sockopts(sfd, SOCKOPTS);
+
+	struct epoll_event event = { EPOLLIN };
+	event.data.fd = sfd;
+	if (epoll_ctl(this->pollfd, EPOLL_CTL_ADD, sfd, &event) < 0)
+	{
+		common::Log_error("epoll_ctl(add): %m");
+		return false;
+	}
+
+	if (retired)
+		this->end_of_life.emplace(sfd, usage.outstanding);
+	else
+		this->available.emplace(sfd, usage);
+	return true;
+}
+
 // End of Upstream.cc
@@ -4,6 +4,8 @@
 #include <netinet/in.h>
 #include <unordered_map>
 
+#include "common.h"
+
 // Class to create, select and dispose of socket file descriptors connected to
 // the upstream DNS server.
 class Upstream
@@ -36,6 +38,7 @@ protected:
 	// Initialized from command line options.
 	const unsigned MAX_PORTS;
 	const unsigned MAX_PORT_LIFETIME;
+	const common::sockopts_st SOCKOPTS;
 
 	// The epoll file descriptor used in the main loop.
 	int pollfd;
@@ -46,6 +49,7 @@ protected:
 
 public:
 	Upstream(unsigned max_ports, unsigned max_port_lifetime,
+		 const common::sockopts_st &sockopts,
 		 int pollfd, const struct sockaddr_in &upstream);
 	~Upstream();
 
@@ -62,8 +66,30 @@ public:
 	// forwarded through it has timed out.
 	void Done(int sfd);
 
+	// Whether @sfd is one of our sockets.
+	bool Has(int sfd) const;
+
+	// Call @callback(sfd, lifetime, retired) for each socket, where
+	// @retired tells whether it's @end_of_life.
+	template <typename Callback>
+	void For_each(Callback callback) const;
+
+	// Take over @sfd, a socket connected to the @upstream by another
+	// process, with the @usage it had there.  Returns false on error.
+	bool Adopt(int sfd, const struct socket_usage_st &usage, bool retired);
+
 protected:
 	int new_upstream_socket() const;
 };
 
+// Template definitions
+template <typename Callback>
+void Upstream::For_each(Callback callback) const
+{
+	for (const auto &i: this->available)
+		callback(i.first, i.second.lifetime, false);
+	for (const auto &i: this->end_of_life)
+		callback(i.first, MAX_PORT_LIFETIME, true);
+}
+
 #endif // ! UPSTREAM_H
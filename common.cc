@@ -3,11 +3,24 @@
 #include <cerrno>
 #include <cstdio>
 #include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <chrono>
 
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <linux/net_tstamp.h>
+
+// Older libc headers may not know about the newer options.
+#ifndef SO_BUSY_POLL
+# define SO_BUSY_POLL			46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+# define SO_PREFER_BUSY_POLL		69
+#endif
 
 #include "common.h"
 
@@ -16,7 +29,7 @@ namespace common {
 
 // Global variable definitions
 bool Debug = false;
-std::default_random_engine Rnd;
+thread_local std::default_random_engine Rnd;
 
 // Program code
 void Init(bool debugging, unsigned seed)
@@ -44,10 +57,13 @@ static void logit(FILE *out, const char *level,
 	auto now = std::chrono::system_clock::now();
 	auto t = std::chrono::system_clock::to_time_t(now);
 
-	// Print the timestamp and @level.
+	// Print the timestamp and @level.  Lock @out so the lines
+	// of different threads are not mixed up.
+	struct tm tm;
 	char timestamp[32];
 	strftime(timestamp, sizeof(timestamp),
-		 "%Y-%m-%d %H:%M:%S", std::localtime(&t));
+		 "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+	flockfile(out);
 	std::fprintf(out, "%s.%03ld %-5s ", timestamp,
 		     common::XsofT<std::chrono::milliseconds>(
 						now.time_since_epoch()),
@@ -57,6 +73,7 @@ static void logit(FILE *out, const char *level,
 	errno = serrno;
 	std::vfprintf(out, fmt, args);
 	std::fputc('\n', out);
+	funlockfile(out);
 }
 
 void Log_error(const char *fmt, ...)
@@ -102,6 +119,78 @@ bool GetSockName(int sfd, struct sockaddr_in *saddr)
 		return true;
 }
 
+void Set_sockopts(int sfd, const struct sockopts_st &opts)
+{
+	int one = 1;
+
+	// These are optimizations, don't fail if they're not available
+	// or we don't have CAP_NET_ADMIN.
+	if (opts.busy_poll)
+	{
+		int val = opts.busy_poll;
+		if (setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL,
+			       &val, sizeof(val)) < 0)
+			Log_debug("setsockopt(SO_BUSY_POLL): %m");
+		else if (setsockopt(sfd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+				    &one, sizeof(one)) < 0)
+			Log_debug("setsockopt(SO_PREFER_BUSY_POLL): %m");
+	}
+
+	// Have the kernel tell how many messages it dropped.
+	if (setsockopt(sfd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0)
+		Log_error("setsockopt(SO_RXQ_OVFL): %m");
+
+	if (opts.timestamping)
+	{	// Software receive timestamps are always supported.
+		int flags = SOF_TIMESTAMPING_RX_SOFTWARE
+			| SOF_TIMESTAMPING_SOFTWARE;
+		if (setsockopt(sfd, SOL_SOCKET, SO_TIMESTAMPING,
+			       &flags, sizeof(flags)) < 0)
+			Log_error("setsockopt(SO_TIMESTAMPING): %m");
+	}
+}
+
+const char *Map_file(const char *fname, size_t *sizep)
+{
+	int fd;
+	void *map;
+	struct stat sbuf;
+
+	if ((fd = open(fname, O_RDONLY)) < 0)
+	{
+		Log_error("%s: %m", fname);
+		return NULL;
+	} else if (fstat(fd, &sbuf) < 0)
+	{
+		Log_error("%s: fstat(): %m", fname);
+		close(fd);
+		return NULL;
+	} else if (sbuf.st_size == 0)
+	{	// mmap() would fail.
+		Log_error("%s: empty file", fname);
+		close(fd);
+		return NULL;
+	}
+
+	// The mapping outlives @fd.
+	map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		Log_error("%s: mmap(): %m", fname);
+		return NULL;
+	}
+
+	*sizep = sbuf.st_size;
+	return static_cast<const char *>(map);
+}
+
+void Unmap_file(const char *map, size_t size)
+{
+	if (munmap(const_cast<char *>(map), size) < 0)
+		Log_error("munmap(): %m");
+}
+
 } /* namespace */
 
 // End of common.cc
@@ -9,8 +9,9 @@ namespace common
 	// Whether Log_debug() will be effective.
 	extern bool Debug;
 
-	// Random number engine shared between classes.
-	extern std::default_random_engine Rnd;
+	// Random number engine shared between classes.  Each thread has
+	// its own, which needs to be seeded separately.
+	extern thread_local std::default_random_engine Rnd;
 
 	// @rnd_seed can be specified to reproduce a random sequence.
 	// Otherwise @Rnd will be seeded with the current time.
@@ -42,6 +43,25 @@ namespace common
 
 	// Return the local address of a socket.
 	extern bool GetSockName(int sfd, struct sockaddr_in *saddr);
+
+	// Options applied to every socket we receive messages on.
+	struct sockopts_st
+	{
+		// Make the kernel busy-poll the device queue for this
+		// many microseconds when there's no data to receive.
+		unsigned busy_poll;
+
+		// Have the kernel timestamp incoming messages.
+		bool timestamping;
+	};
+
+	// Apply @opts to @sfd as far as the kernel supports them.
+	extern void Set_sockopts(int sfd, const struct sockopts_st &opts);
+
+	// Map @fname read-only into memory.  On error logs it and returns
+	// NULL.  The mapping must be released with Unmap_file().
+	extern const char *Map_file(const char *fname, size_t *sizep);
+	extern void Unmap_file(const char *map, size_t size);
 };
 
 #endif // ! COMMON_H
@@ -0,0 +1,186 @@
+// Tests of the scheduling of the queue of pending queries: clients taking
+// turns, dropping from the longest flow, putting queries back and expiring
+// them.
+//
+// Usage: fairqueuetest
+
+// Include files
+#include <cstdio>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "FairQueue.h"
+
+// The size of the queries, so QUANTUM pays for a few of them per turn.
+#define QUERY_SIZE			100
+
+static unsigned nfailed = 0;
+
+// Program code
+static void check(bool ok, const char *what, const char *how)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "FAIL: %s: %s\n", what, how);
+	nfailed++;
+}
+
+// Return the address of client number @n, which all hash to different
+// flows.
+static struct sockaddr_in client(unsigned n)
+{
+	struct sockaddr_in addr = { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(0x0A000000 + n);
+	return addr;
+}
+
+// Queue query number @seq of client number @n, received at @received.
+static void push(FairQueue &queue, unsigned n, unsigned seq,
+		 std::chrono::steady_clock::time_point received
+			= std::chrono::steady_clock::now())
+{
+	struct FairQueue::query_st query;
+
+	query.client = client(n);
+	query.stream = 0;
+	query.received = received;
+	query.msg.assign(QUERY_SIZE, 0);
+	query.msg[0] = n;
+	query.msg[1] = seq;
+	queue.Push(query);
+}
+
+// Take all queries from @queue as "<client>.<seq>" strings in the order
+// they are taken.
+static std::vector<std::string> pop_all(FairQueue &queue)
+{
+	std::vector<std::string> order;
+	struct FairQueue::query_st query;
+
+	while (queue.Pop(&query))
+		order.push_back(std::to_string(query.msg[0]) + '.'
+				+ std::to_string(query.msg[1]));
+	return order;
+}
+
+// A client queueing a burst mustn't keep a client with a few queries
+// waiting until the burst is over.
+static void test_fairness()
+{
+	FairQueue queue(100);
+
+	for (unsigned seq = 0; seq < 20; seq++)
+		push(queue, 1, seq);
+	for (unsigned seq = 0; seq < 5; seq++)
+		push(queue, 2, seq);
+
+	auto order = pop_all(queue);
+	unsigned nsecond = 0;
+	for (unsigned i = 0; i < 10 && i < order.size(); i++)
+		nsecond += order[i][0] == '2';
+	check(order.size() == 25, "fairness", "lost queries");
+	check(nsecond == 5, "fairness",
+	      "the second client waited for the burst");
+	check(order.front() == "1.0" && order.back() == "1.19",
+	      "fairness", "a flow's queries taken out of order");
+}
+
+// When the queue is full, the newest query of the longest flow goes.
+static void test_drop_longest()
+{
+	FairQueue queue(10);
+
+	for (unsigned seq = 0; seq < 8; seq++)
+		push(queue, 1, seq);
+	for (unsigned seq = 0; seq < 3; seq++)
+		push(queue, 2, seq);
+	check(queue.ndropped == 1 && queue.nqueued == 11,
+	      "drop from the longest", "wrong statistics");
+
+	auto order = pop_all(queue);
+	unsigned nfirst = 0, nsecond = 0;
+	bool newest = false;
+	for (const auto &query: order)
+	{
+		nfirst += query[0] == '1';
+		nsecond += query[0] == '2';
+		newest |= query == "1.7";
+	}
+	check(nfirst == 7 && nsecond == 3 && !newest,
+	      "drop from the longest", "dropped the wrong query");
+}
+
+// A query put back is taken next again, even if its flow has lost its
+// turn in the meantime.
+static void test_unpop()
+{
+	FairQueue queue(10);
+	struct FairQueue::query_st query, other;
+
+	push(queue, 1, 0);
+	push(queue, 2, 0);
+	size_t memory = queue.Memory();
+
+	check(queue.Pop(&query) && query.msg[0] == 1, "unpop",
+	      "wrong first query");
+	queue.Unpop(query);
+	check(queue.Memory() == memory, "unpop", "memory not accounted");
+	check(queue.Pop(&query) && query.msg[0] == 1, "unpop",
+	      "not taken next again");
+
+	// Client 1's flow is empty now, and loses its turn.
+	check(queue.Pop(&other) && other.msg[0] == 2, "unpop",
+	      "wrong second query");
+	queue.Unpop(query);
+	check(!queue.Empty(), "unpop after losing the turn", "not queued");
+	check(queue.Pop(&query) && query.msg[0] == 1 && queue.Empty(),
+	      "unpop after losing the turn", "not taken again");
+	check(queue.Memory() == 0, "unpop", "memory left over");
+}
+
+// Only the queries received before the deadline are expired.
+static void test_expire()
+{
+	FairQueue queue(10);
+	auto now = std::chrono::steady_clock::now();
+	auto old = now - std::chrono::seconds(1);
+
+	push(queue, 1, 0, old);
+	push(queue, 1, 1, now);
+	push(queue, 2, 0, old);
+	push(queue, 2, 1, old);
+
+	std::vector<std::string> expired;
+	queue.Expire(now - std::chrono::milliseconds(500),
+		     [&expired](struct FairQueue::query_st &query)
+		     {
+			     expired.push_back(std::to_string(query.msg[0])
+					       + '.'
+					       + std::to_string(query.msg[1]));
+		     });
+	check(expired.size() == 3, "expire", "wrong queries expired");
+
+	auto order = pop_all(queue);
+	check(order.size() == 1 && order[0] == "1.1", "expire",
+	      "wrong queries left");
+	check(queue.Empty() && queue.Memory() == 0, "expire",
+	      "memory left over");
+}
+
+int main()
+{
+	test_fairness();
+	test_drop_longest();
+	test_unpop();
+	test_expire();
+
+	printf("fair queue: %u failures\n", nfailed);
+	return nfailed ? 1 : 0;
+}
+
+// End of fairqueuetest.cc
@@ -0,0 +1,199 @@
+// Tests of the hot restart protocol: a forked child plays the new process
+// taking over from this one, which plays the running process.
+//
+// Usage: handofftest [<socket-path>]
+
+// Include files
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "Handoff.h"
+
+// Defaults for command line options.
+#define DFLT_PATH			"/tmp/handofftest.sock"
+
+// What the new process does after receiving the sockets and the state.
+enum successor_t
+{
+	// Confirm that it's ready, expecting to be acknowledged.
+	TAKE_OVER,
+
+	// Confirm, expecting the running process to have given up on it.
+	TOO_LATE,
+};
+
+static unsigned nfailed = 0;
+
+// Program code
+static void check(bool ok, const char *what, const char *how)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "FAIL: %s: %s\n", what, how);
+	nfailed++;
+}
+
+// Wait until @fd becomes readable.
+static bool wait_for(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	return poll(&pfd, 1, Handoff::TIMEOUT * 1000) == 1;
+}
+
+// Take over from the running process at @path and check what has been
+// received, then confirm @how.  Returns the exit code of the child.
+static int successor(const char *path, const struct sockaddr_in &addr,
+		     enum successor_t how)
+{
+	int sfd;
+	Handoff handoff;
+	uint32_t value;
+	std::vector<char> bytes;
+
+	if (!Handoff::Connect(path, &sfd) || sfd < 0
+	    || !handoff.Receive(sfd))
+		return 1;
+
+	int udp = handoff.Take_socket(Handoff::CLIENT_SOCKET, addr);
+	if (udp < 0 || handoff.Sockets().size() != 1
+	    || !handoff.Get(&value) || value != 0xDEADBEEF
+	    || !handoff.Get(&bytes) || bytes != std::vector<char>(3, 'x')
+	    || handoff.Get(&value))
+		return 2;
+	close(udp);
+
+	// Confirm() returns true only if the running process has
+	// acknowledged that the sockets are ours.
+	bool acknowledged = Handoff::Confirm(sfd);
+	close(sfd);
+	return acknowledged == (how == TAKE_OVER) ? 0 : 3;
+}
+
+// Hand over @udp, bound to @addr, and some state to a forked successor
+// doing @how, and check that both processes agree on who owns the sockets.
+static void hand_over(const char *what, const char *path, int listenfd,
+		      int udp, const struct sockaddr_in &addr,
+		      enum successor_t how)
+{
+	pid_t pid;
+	int sfd, status;
+
+	if ((pid = fork()) == 0)
+	{
+		close(listenfd);
+		_exit(successor(path, addr, how));
+	} else if (pid < 0)
+	{
+		check(false, what, strerror(errno));
+		return;
+	}
+
+	// The listening socket is non-blocking.
+	Handoff handoff;
+	if (!wait_for(listenfd)
+	    || (sfd = Handoff::Accept(listenfd)) < 0)
+	{
+		check(false, what, "couldn't accept the new process");
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	handoff.Add_socket(Handoff::CLIENT_SOCKET, udp);
+	handoff.Put(uint32_t(0xDEADBEEF));
+	handoff.Put(std::vector<char>(3, 'x'));
+	check(handoff.Send(sfd), what, "couldn't send");
+
+	// Meanwhile the running process would carry on serving.
+	check(wait_for(sfd), what, "no confirmation");
+	if (how == TAKE_OVER)
+		check(Handoff::Confirmed(sfd), what, "not confirmed");
+	// Otherwise the confirmation has arrived just as we've given up
+	// on it, and close the connection without reading it.
+	close(sfd);
+
+	waitpid(pid, &status, 0);
+	check(WIFEXITED(status), what, "the new process crashed");
+	if (WIFEXITED(status))
+		switch (WEXITSTATUS(status))
+		{
+		case 0:
+			break;
+		case 1:
+			check(false, what, "the new process couldn't receive");
+			break;
+		case 2:
+			check(false, what, "the new process received garbage");
+			break;
+		default:
+			check(false, what, "the processes disagree on who "
+			      "owns the sockets");
+			break;
+		}
+}
+
+int main(int argc, char *const *argv)
+{
+	const char *path = argc > 1 ? argv[1] : DFLT_PATH;
+	struct sockaddr_in addr = { };
+	socklen_t saddr = sizeof(addr);
+	struct stat st;
+	int sfd;
+
+	// Nobody is running yet.
+	unlink(path);
+	check(Handoff::Connect(path, &sfd) && sfd < 0,
+	      "first process", "found another one");
+
+	// A stale socket is replaced, and the new one is for our user only.
+	int listenfd = Handoff::Listen(path);
+	close(listenfd);
+	listenfd = Handoff::Listen(path);
+	check(listenfd >= 0, "stale socket", "not replaced");
+	if (listenfd < 0)
+		return 1;
+	check(!stat(path, &st) && !(st.st_mode & (S_IRWXG | S_IRWXO)),
+	      "socket mode", "accessible to others");
+
+	// The socket to hand over.
+	int udp = socket(AF_INET, SOCK_DGRAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (udp < 0
+	    || bind(udp, reinterpret_cast<struct sockaddr *>(&addr),
+		    sizeof(addr)) < 0
+	    || getsockname(udp, reinterpret_cast<struct sockaddr *>(&addr),
+			   &saddr) < 0)
+	{
+		perror("udp");
+		return 1;
+	}
+
+	hand_over("hand over", path, listenfd, udp, addr, TAKE_OVER);
+	hand_over("confirmation too late", path, listenfd, udp, addr,
+		  TOO_LATE);
+
+	close(udp);
+	close(listenfd);
+	unlink(path);
+
+	printf("hot restart: %u failures\n", nfailed);
+	return nfailed ? 1 : 0;
+}
+
+// End of handofftest.cc
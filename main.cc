@@ -1,14 +1,19 @@
 // Include files
+#include <cstdlib>
 #include <cstring>
 #include <getopt.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include <resolv.h>
 #include <arpa/nameser.h>
 
 #include <iostream>
+#include <vector>
 
 #include "common.h"
 #include "DNSProxy.h"
+#include "Pipeline.h"
 
 // Defaults for command line options.
 #define DFLT_LISTEN_ADDR		"127.0.0.1"
@@ -20,6 +25,17 @@
 #define DFLT_MAX_PORTS			50
 #define DFLT_MAX_PORT_LIFETIME		10
 #define DFLT_MIN_GC_TIME		5
+#define DFLT_HEDGE_PERCENTILE		0
+#define DFLT_HEDGE_BUDGET		5
+#define DFLT_BUSY_POLL			0
+#define DFLT_MAX_SOCKET_BUFFER		0
+#define DFLT_TLS_CONNECTIONS		2
+#define DFLT_MAX_CONNECTIONS		64
+#define DFLT_WORKERS			0
+#define DFLT_HEAVY_HITTERS		0
+#define DFLT_MAX_PENDING		0
+#define DFLT_PENDING_TIMEOUT		200
+#define DFLT_EDNS_SIZE			1232
 
 // Expand @x and return it stringified (eg. 5 -> "5")..
 #define QQ(x)				#x
@@ -34,16 +50,74 @@ static struct option const options[] =
 
 	{ "listen",		required_argument,	NULL, 'l' },
 	{ "port",		required_argument,	NULL, 'p' },
+	{ "tcp-port",		required_argument,	NULL, 'P' },
+	{ "tls-port",		required_argument,	NULL, 'L' },
+	{ "tls-cert",		required_argument,	NULL, 'E' },
+	{ "tls-key",		required_argument,	NULL, 'K' },
+	{ "max-connections",	required_argument,	NULL, 'O' },
 
 	{ "timeout",		required_argument,	NULL, 't' },
 	{ "max-requests",	required_argument,	NULL, 'r' },
 	{ "min-gc-time",	required_argument,	NULL, 'T' },
+	{ "max-pending",	required_argument,	NULL, 'q' },
+	{ "pending-timeout",	required_argument,	NULL, 'Q' },
+	{ "congestion-control",	no_argument,		NULL, 'a' },
+	{ "max-memory",		required_argument,	NULL, 'G' },
 
 	{ "max-ports",		required_argument,	NULL, 'n' },
 	{ "max-port-lifetime",	required_argument,	NULL, 'N' },
+	{ "randomize-case",	no_argument,		NULL, 'z' },
+
+	{ "upstream",		required_argument,	NULL, 'u' },
+	{ "route",		required_argument,	NULL, 'F' },
+	{ "tls-ca",		required_argument,	NULL, 'C' },
+	{ "tls-connections",	required_argument,	NULL, 'c' },
+	{ "hedge",		required_argument,	NULL, 'H' },
+	{ "hedge-budget",	required_argument,	NULL, 'B' },
+	{ "name-affinity",	required_argument,	NULL, 'y' },
+	{ "edns-size",		required_argument,	NULL, 'e' },
+
+	{ "busy-poll",		required_argument,	NULL, 'b' },
+	{ "mlock",		no_argument,		NULL, 'm' },
+	{ "realtime",		required_argument,	NULL, 'R' },
+	{ "timestamping",	no_argument,		NULL, 'k' },
+	{ "max-socket-buffer",	required_argument,	NULL, 'M' },
+	{ "workers",		required_argument,	NULL, 'w' },
+	{ "heavy-hitters",	required_argument,	NULL, 'A' },
+	{ "hot-restart",	required_argument,	NULL, 'g' },
+
+	{ "records",		required_argument,	NULL, 'd' },
+	{ "blocklist",		required_argument,	NULL, 'x' },
+	{ "block-with-null",	no_argument,		NULL, 'X' },
+	{ "synthesize",		required_argument,	NULL, 'Y' },
 };
 
 // Program code
+// Apply the process-wide latency options.  Returns false on failure.
+static bool tune_process(bool mlock, unsigned rt_priority)
+{
+	if (mlock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+	{
+		common::Log_error("mlockall(): %m");
+		return false;
+	}
+
+	if (rt_priority)
+	{
+		struct sched_param param = { };
+
+		param.sched_priority = rt_priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+		{
+			common::Log_error("sched_setscheduler(%u): %m",
+					  rt_priority);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 // Print the help to @out.
 static void help(std::ostream &out)
 {
@@ -74,6 +148,26 @@ static void help(std::ostream &out)
 "  --port, -p <port>			Listen for DNS queries on this UDP\n"
 "					port.  The default is "
 					Q(DFLT_LISTEN_PORT) ".\n"
+"  --tcp-port, -P <port>			Also accept DNS queries over TCP\n"
+"					on this port.  If the response to a\n"
+"					query from a TCP or TLS client comes\n"
+"					back truncated over UDP, the query is\n"
+"					sent to the server again over TCP.\n"
+"  --tls-port, -L <port>			Also accept DNS queries over TLS\n"
+"					(RFC 7858) on this port, usually 853.\n"
+"					If the kernel supports it, encryption\n"
+"					is offloaded to it (kTLS) after the\n"
+"					handshake.\n"
+"  --tls-cert, -E <file>			The certificate chain of the TLS\n"
+"					listener in PEM format.\n"
+"  --tls-key, -K <file>			The private key of the TLS listener\n"
+"					in PEM format.\n"
+"  --max-connections, -O <number>	Maximum number of TCP and TLS\n"
+"					connections each.  When it's reached,\n"
+"					the least recently active connection\n"
+"					is closed.  The default is "
+					Q(DFLT_MAX_CONNECTIONS) ".\n"
+"					Specifying 0 disables the limit.\n"
 "\n"
 "  --timeout, -t <seconds>		Maximum time to wait for a response\n"
 "					from the upstream DNS server.\n"
@@ -88,10 +182,40 @@ static void help(std::ostream &out)
 "					usage of the program.  The default is\n"
 "					" Q(DFLT_MAX_REQUESTS) ".  "
 					"Specifying 0 disables the limit.\n"
-"					In practice the maximum is "
-					<< Requests::MAX_POSSIBLE_QUERIES << ",\n"
-"					because of the limited size of query ID\n"
-"					in DNS messages.\n"
+"					Because of the limited size of query ID\n"
+"					in DNS messages, at most "
+					<< Requests::MAX_POSSIBLE_QUERIES << "\n"
+"					of them can be forwarded through each\n"
+"					upstream port or connection, so a high\n"
+"					limit needs a high --max-ports as well.\n"
+"  --max-pending, -q <number>		When --max-requests is reached, queue\n"
+"					up to this many queries until requests\n"
+"					are freed up, instead of discarding\n"
+"					them.  The clients take turns, so one\n"
+"					sending a burst mostly delays its own\n"
+"					queries.  0 (the default) disables\n"
+"					queueing.\n"
+"  --pending-timeout, -Q <ms>		Queued queries which can't be\n"
+"					forwarded within this time are\n"
+"					answered with SERVFAIL.  The default\n"
+"					is " Q(DFLT_PENDING_TIMEOUT) "ms.\n"
+"  --congestion-control, -a		Limit the queries in flight to each\n"
+"					upstream server to what it can answer\n"
+"					without its round-trip times growing,\n"
+"					within --max-requests.  Queries over\n"
+"					the limit are queued if --max-pending\n"
+"					allows it, otherwise discarded.\n"
+"  --max-memory, -G <MiB>		When the outstanding requests, the\n"
+"					queued queries and the socket buffers\n"
+"					grown by --max-socket-buffer take up\n"
+"					this much memory, discard the queries\n"
+"					which can't be answered locally, and\n"
+"					give back the memory only kept for\n"
+"					speed, until the usage falls below\n"
+"					90% of the budget.  The workers share\n"
+"					the budget.  0 (the default) disables\n"
+"					the limit.  The usage is logged with\n"
+"					the statistics.\n"
 "  --min-gc-time, -T <seconds>		Usually queries are expired as soon as\n"
 "					they time out.  However, if there are\n"
 "					many of them in quick succession, it is\n"
@@ -119,19 +243,176 @@ static void help(std::ostream &out)
 "					source ports over time.  Specifying 0\n"
 "					allows a port to be reused any number\n"
 "					of times.\n"
+"  --randomize-case, -z			Randomize the case of the letters of\n"
+"					forwarded QNAMEs and only accept\n"
+"					responses with the same case (0x20\n"
+"					encoding), which makes spoofing harder\n"
+"					by a bit per letter, so fewer ports\n"
+"					give the same security.  The client\n"
+"					gets back the case it sent.  If a server\n"
+"					doesn't preserve the case, it's turned\n"
+"					off for that server.\n"
+"\n"
+"  --upstream, -u <address>[:<port>]	Add a secondary upstream server.\n"
+"					Can be specified multiple times.\n"
+"					Queries are forwarded to the primary\n"
+"					server, secondary servers are only\n"
+"					used for hedging and --name-affinity.\n"
+"  --route, -F <domain>=<address>[:<port>][,...]\n"
+"					Forward queries for <domain> and its\n"
+"					subdomains to the listed servers\n"
+"					instead.  Can be specified multiple\n"
+"					times, the longest matching domain\n"
+"					wins.  The first server is primary,\n"
+"					the rest are only used for hedging\n"
+"					and --name-affinity.\n"
+"					Each server has its own source ports.\n"
+"  --tls-ca, -C <file>			Verify the certificates of\n"
+"					DNS-over-TLS servers with the CA\n"
+"					certificates in this file instead of\n"
+"					the system's default ones.\n"
+"  --tls-connections, -c <number>	Maximum number of connections to\n"
+"					each DNS-over-TLS server, and of TCP\n"
+"					connections to each UDP server for the\n"
+"					truncated responses.  Queries are\n"
+"					pipelined on the connections.\n"
+"					The default is " Q(DFLT_TLS_CONNECTIONS) ".  Specifying 0\n"
+"					means no limit.\n"
+"  --hedge, -H <percentile>		If no response arrives from the\n"
+"					upstream server within this percentile\n"
+"					of its observed round-trip times, send\n"
+"					the query to a secondary server too,\n"
+"					and return whichever response arrives\n"
+"					first.  Specifying 0 (the default)\n"
+"					disables hedging.\n"
+"  --hedge-budget, -B <percent>		Maximum number of hedged queries\n"
+"					relative to all forwarded queries.\n"
+"					The default is " Q(DFLT_HEDGE_BUDGET) "%.\n"
+"  --name-affinity, -y <labels>		Spread the queries over all servers\n"
+"					of their route by the last <labels>\n"
+"					labels of the QNAME, so each domain is\n"
+"					always sent to the same server, whose\n"
+"					cache is likely to have it.  2 groups\n"
+"					www.example.com with example.com, a\n"
+"					high number keeps whole names apart.\n"
+"					A server with over 125% of its share\n"
+"					of the queries in flight passes the\n"
+"					excess on to the next one in line.\n"
+"					Adding or removing a server only moves\n"
+"					the domains it gains or loses.\n"
+"					0 (the default) forwards the queries\n"
+"					to the primary server.\n"
+"  --edns-size, -e <bytes>		Lower the EDNS UDP payload size of the\n"
+"					queries forwarded to this, so large\n"
+"					responses come truncated rather than\n"
+"					fragmented, and the client retries\n"
+"					over TCP instead of losing fragments.\n"
+"					Responses larger than the client's own\n"
+"					payload size are always truncated.\n"
+"					The default is " Q(DFLT_EDNS_SIZE) ", 0 leaves\n"
+"					the queries alone.\n"
+"\n"
+"  --busy-poll, -b <microseconds>	Trade CPU for latency: don't sleep\n"
+"					until no message has arrived for this\n"
+"					long, but keep polling the sockets.\n"
+"					The kernel is asked to busy-poll the\n"
+"					network device as well, if supported.\n"
+"					0 (the default) disables busy polling.\n"
+"  --mlock, -m				Lock all memory of the program,\n"
+"					so it's never paged out.\n"
+"  --realtime, -R <priority>		Run with SCHED_FIFO real-time\n"
+"					scheduling at this priority (1-99).\n"
+"  --timestamping, -k			Have the kernel timestamp incoming\n"
+"					messages, so the time they spend in\n"
+"					the socket queues can be measured.\n"
+"  --max-socket-buffer, -M <bytes>	When the kernel drops messages\n"
+"					because a socket buffer is full,\n"
+"					double its size up to this limit,\n"
+"					and shrink it back when there are no\n"
+"					more drops.  0 (the default) leaves\n"
+"					the buffer sizes alone.\n"
+"					Dropped messages are always counted.\n"
+"  --workers, -w <number>		Spread the work over this many worker\n"
+"					threads, with separate threads\n"
+"					receiving the UDP queries and sending\n"
+"					the responses in batches.  The\n"
+"					workers have their own source ports\n"
+"					and share --max-requests.  Only the\n"
+"					first one serves TCP and TLS clients.\n"
+"					0 (the default) runs everything in one\n"
+"					thread.  At most "
+					<< Pipeline::MAX_WORKERS << " workers can be used.\n"
+"  --heavy-hitters, -A <number>		Track this many of the most frequent\n"
+"					clients and QNAMEs of the queries, and\n"
+"					QNAMEs of the NXDOMAIN responses and\n"
+"					of the timed out queries, and log them\n"
+"					with the statistics.  0 (the default)\n"
+"					disables tracking.\n"
+"  --hot-restart, -g <socket>		Take over the listening sockets,\n"
+"					the source ports and the outstanding\n"
+"					requests of the process listening at\n"
+"					this unix socket, if there is one,\n"
+"					and listen there for the process\n"
+"					replacing this one.  The old process\n"
+"					exits once the new one is ready, so\n"
+"					hardly any queries are lost in\n"
+"					a restart.\n"
+"					Only the queries of UDP clients sent\n"
+"					to UDP servers are carried over, TCP\n"
+"					and TLS connections are closed.\n"
+"					Can't be used with --workers.\n"
+"\n"
+"  --records, -d <file>			Answer queries from this records\n"
+"					database if possible, instead of\n"
+"					forwarding them.  The database is\n"
+"					created by mkdnsdb from a hosts or\n"
+"					simple zone file, and reloaded when\n"
+"					SIGHUP is received.\n"
+"  --blocklist, -x <file>		Refuse queries for the domains in\n"
+"					this blocklist and their subdomains\n"
+"					with NXDOMAIN.  The blocklist is\n"
+"					created by mkdnsdb -b, and reloaded\n"
+"					when SIGHUP is received.\n"
+"  --block-with-null, -X			Answer blocked A and AAAA queries\n"
+"					with 0.0.0.0 and :: respectively,\n"
+"					and other types with no data, instead\n"
+"					of NXDOMAIN.\n"
+"  --synthesize, -Y <domain>[:<type>]=<action>\n"
+"					Answer queries for <domain> and its\n"
+"					subdomains, only of <type> if given,\n"
+"					locally instead of forwarding them.\n"
+"					<action> is nxdomain, nodata,\n"
+"					loopback (127.0.0.1 or ::1 for A and\n"
+"					AAAA, no data for other types) or\n"
+"					localhost (localhost. for PTR, no data\n"
+"					for other types).  Can be specified\n"
+"					multiple times, the longest matching\n"
+"					domain wins.\n"
+"					\"special-use\" adds rules for the\n"
+"					special-use names, like localhost,\n"
+"					local and the reverse zones of private\n"
+"					addresses.  For example .:AAAA=nodata\n"
+"					suits IPv4-only networks.\n"
 "\n"
 "<upstream-address>:<upstream-port> (default " Q(DFLT_UPSTREAM_PORT) ") "
 "is the IPv4 address of the DNS\n"
 "server to forward queries to.  Queries are forwarded with randomized ID and\n"
 "source port, and responses are strictly validated against blind spoofing\n"
-"attacks.\n";
+"attacks.  Any upstream server can be given as tls:<address>[:<port>][#<name>]\n"
+"to forward queries to it via DNS-over-TLS (port 853 by default), verifying\n"
+"its certificate against <name>, or its address if <name> is not given.\n"
+"Connections are kept open and resumed with TLS session tickets and TCP Fast\n"
+"Open.\n"
+"\n"
+"Send SIGUSR1 to the program to log its statistics, including the latency\n"
+"of each stage of processing queries.\n";
 }
 
 int main(int argc, char *const *argv)
 {
 	// Set defaults for command line options.
-	bool debug = false;
-	unsigned rnd_seed = 0;
+	bool debug = false, mlock = false;
+	unsigned rnd_seed = 0, rt_priority = 0, workers = DFLT_WORKERS;
 
 	const char *local_addr	= DFLT_LISTEN_ADDR;
 	unsigned local_port	= DFLT_LISTEN_PORT;
@@ -147,13 +428,30 @@ int main(int argc, char *const *argv)
 		DFLT_MAX_PORTS,
 		DFLT_MAX_PORT_LIFETIME,
 		DFLT_MIN_GC_TIME,
+		DFLT_HEDGE_PERCENTILE,
+		DFLT_HEDGE_BUDGET,
+		DFLT_BUSY_POLL,
+		false,
+		DFLT_MAX_SOCKET_BUFFER,
+		NULL,
+		NULL, false,
+		NULL, DFLT_TLS_CONNECTIONS,
+		0, 0, NULL, NULL, DFLT_MAX_CONNECTIONS,
+		DFLT_HEAVY_HITTERS,
+		DFLT_MAX_PENDING, DFLT_PENDING_TIMEOUT,
+		false, false,
+		0,
+		0, DFLT_EDNS_SIZE,
+		NULL,
 	};
+	std::vector<const char *> secondaries, routes, rules;
 
 	// Parse the command line.
 	int optchar;
 	while ((optchar = getopt_long(argc, argv,
-				      "hDS:l:p:t:r:T:n:N:", options,
-				      NULL)) != -1)
+				      "hDS:l:p:P:L:E:K:O:t:r:T:q:Q:aG:n:N:z"
+				      "u:F:C:c:H:B:y:e:b:mR:kM:w:A:g:d:x:XY:",
+				      options, NULL)) != -1)
 		switch (optchar)
 		{
 		case '?': // Invalid option
@@ -175,6 +473,21 @@ int main(int argc, char *const *argv)
 		case 'p':
 			local_port = atoi(optarg);
 			break;
+		case 'P':
+			config.tcp_port = atoi(optarg);
+			break;
+		case 'L':
+			config.tls_port = atoi(optarg);
+			break;
+		case 'E':
+			config.tls_cert = optarg;
+			break;
+		case 'K':
+			config.tls_key = optarg;
+			break;
+		case 'O':
+			config.max_connections = atoi(optarg);
+			break;
 
 		case 't':
 			config.request_timeout = atoi(optarg);
@@ -185,6 +498,19 @@ int main(int argc, char *const *argv)
 		case 'T':
 			config.min_gc_time = atoi(optarg);
 			break;
+		case 'q':
+			config.max_pending = atoi(optarg);
+			break;
+		case 'Q':
+			config.pending_timeout = atoi(optarg);
+			break;
+		case 'a':
+			config.congestion_control = true;
+			break;
+		case 'G':
+			config.max_memory = static_cast<size_t>(atoi(optarg))
+				<< 20;
+			break;
 
 		case 'n':
 			config.max_ports = atoi(optarg);
@@ -192,6 +518,96 @@ int main(int argc, char *const *argv)
 		case 'N':
 			config.max_port_lifetime = atoi(optarg);
 			break;
+		case 'z':
+			config.randomize_case = true;
+			break;
+
+		case 'u':
+			secondaries.push_back(optarg);
+			break;
+		case 'F':
+			routes.push_back(optarg);
+			break;
+		case 'C':
+			config.tls_ca = optarg;
+			break;
+		case 'c':
+			config.tls_connections = atoi(optarg);
+			break;
+		case 'H':
+			config.hedge_percentile = atoi(optarg);
+			if (config.hedge_percentile > 100)
+			{
+				std::cerr << "Percentile must be at most 100."
+					  << std::endl;
+				return 1;
+			}
+			break;
+		case 'B':
+			config.hedge_budget = atoi(optarg);
+			break;
+		case 'y':
+			config.name_affinity = atoi(optarg);
+			break;
+		case 'e':
+			config.edns_size = atoi(optarg);
+			if (config.edns_size
+			    && (config.edns_size < NS_PACKETSZ
+				|| config.edns_size > NS_MAXMSG))
+			{
+				std::cerr << "The EDNS payload size must be "
+					     "between " << NS_PACKETSZ
+					  << " and " << NS_MAXMSG << "."
+					  << std::endl;
+				return 1;
+			}
+			break;
+
+		case 'b':
+			config.busy_poll = atoi(optarg);
+			break;
+		case 'm':
+			mlock = true;
+			break;
+		case 'R':
+			rt_priority = atoi(optarg);
+			break;
+		case 'k':
+			config.timestamping = true;
+			break;
+		case 'M':
+			config.max_socket_buffer = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			if (workers > Pipeline::MAX_WORKERS)
+			{
+				std::cerr << "At most "
+					  << Pipeline::MAX_WORKERS
+					  << " workers can be used."
+					  << std::endl;
+				return 1;
+			}
+			break;
+		case 'A':
+			config.heavy_hitters = atoi(optarg);
+			break;
+		case 'g':
+			config.hot_restart = optarg;
+			break;
+
+		case 'd':
+			config.records = optarg;
+			break;
+		case 'x':
+			config.blocklist = optarg;
+			break;
+		case 'X':
+			config.block_with_null = true;
+			break;
+		case 'Y':
+			rules.push_back(optarg);
+			break;
 		}
 
 	argv += optind;
@@ -201,9 +617,27 @@ int main(int argc, char *const *argv)
 		return 1;
 	}
 
+	if (workers && config.hot_restart)
+	{
+		std::cerr << "--hot-restart can't be used with --workers."
+			  << std::endl;
+		return 1;
+	}
+
 	upstream = *argv++;
 	if (*argv)
-		upstream_port = atoi(*argv++);
+	{
+		char *end;
+		unsigned long port = strtoul(*argv, &end, 10);
+		if (*end || end == *argv || !port || port > 65535)
+		{
+			std::cerr << *argv << ": invalid upstream port"
+				  << std::endl;
+			return 1;
+		}
+		upstream_port = port;
+		argv++;
+	}
 
 	// Log the configuration.
 	common::Init(debug, rnd_seed);
@@ -215,15 +649,67 @@ int main(int argc, char *const *argv)
 			  config.max_ports);
 	common::Log_debug("Max. port lifetime:           %u",
 			  config.max_port_lifetime);
+	common::Log_debug("Randomize case:               %s",
+			  config.randomize_case ? "yes" : "no");
 	common::Log_debug("Min. garbage collection time: %us",
 			  config.min_gc_time);
+	common::Log_debug("Max. pending queries:         %u",
+			  config.max_pending);
+	common::Log_debug("Pending query timeout:        %ums",
+			  config.pending_timeout);
+	common::Log_debug("Congestion control:           %s",
+			  config.congestion_control ? "yes" : "no");
+	common::Log_debug("Max. memory:                  %zu",
+			  config.max_memory);
+	common::Log_debug("Hedging percentile:           %u",
+			  config.hedge_percentile);
+	common::Log_debug("Hedging budget:               %u%%",
+			  config.hedge_budget);
+	common::Log_debug("Name affinity:                %u labels",
+			  config.name_affinity);
+	common::Log_debug("Max. EDNS payload size:       %u",
+			  config.edns_size);
+	common::Log_debug("Busy polling:                 %uus",
+			  config.busy_poll);
+	common::Log_debug("Max. socket buffer size:      %u",
+			  config.max_socket_buffer);
+	common::Log_debug("Max. TLS connections:         %u",
+			  config.tls_connections);
+	common::Log_debug("Max. client connections:      %u",
+			  config.max_connections);
+	common::Log_debug("Worker threads:               %u", workers);
+	common::Log_debug("Heavy hitters tracked:        %u",
+			  config.heavy_hitters);
+	common::Log_debug("Hot restart socket:           %s",
+			  config.hot_restart ? config.hot_restart : "none");
 	common::Log_info("Upstream server: %s:%u", upstream, upstream_port);
+	for (const auto secondary: secondaries)
+		common::Log_info("Secondary upstream server: %s", secondary);
+	for (const auto route: routes)
+		common::Log_info("Route: %s", route);
+	for (const auto rule: rules)
+		common::Log_info("Synthesis rule: %s", rule);
 
 	// Run the proxy.
-	DNSProxy app(config);
-	if (!app.Init(local_addr, local_port, upstream, upstream_port))
-		return 1;
-	app.Run();
+	if (workers)
+	{	// The threads inherit the scheduling policy from us.
+		Pipeline app(config, workers);
+		if (!app.Init(local_addr, local_port, upstream, upstream_port,
+			      secondaries, routes, rules))
+			return 1;
+		if (!tune_process(mlock, rt_priority))
+			return 1;
+		app.Run();
+	} else
+	{
+		DNSProxy app(config);
+		if (!app.Init(local_addr, local_port, upstream, upstream_port,
+			      secondaries, routes, rules))
+			return 1;
+		if (!tune_process(mlock, rt_priority))
+			return 1;
+		app.Run();
+	}
 
 	return 0;
 }
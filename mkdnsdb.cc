@@ -0,0 +1,465 @@
+// Compile a hosts(5)-like or a simplified zone file into a records
+// database for dnsproxy --records, or a list of domains into a blocklist
+// for dnsproxy --blocklist.
+//
+// Input lines are either
+//   <IPv4 or IPv6 address> <name> [<name>...]
+// which define A or AAAA records for each name and a PTR record for the
+// address pointing to the first name, or
+//   <name> [<TTL>] [IN] <type> <data>
+// where <type> is one of A, AAAA, PTR or TXT.  Everything following
+// a '#' or a ';' is a comment.
+//
+// With -b, every line is a domain name to block, optionally preceded by
+// an address (which is ignored), so hosts(5)-style blocklists can be used
+// as they are.
+
+// Include files
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <getopt.h>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "common.h"
+#include "Records.h"
+#include "Blocklist.h"
+
+// Defaults for command line options.
+#define DFLT_TTL			3600
+
+// Size of the Bloom filter of blocklists, and the number of bits set
+// for each name.  These give about 1% false positives.
+#define BLOOM_BITS_PER_NAME		10
+#define BLOOM_HASHES			7
+
+// The RRsets to be written, indexed by key.
+struct rrset_st
+{
+	std::set<std::string> rrs;
+};
+typedef std::map<std::string, struct rrset_st> db_t;
+
+// Program code
+// Convert @name from presentation to wire format.
+// Returns false if it's not a valid name.
+static bool name2wire(std::string *wire, const std::string &name)
+{
+	wire->clear();
+
+	size_t start = 0;
+	while (start < name.size())
+	{
+		size_t dot = name.find('.', start);
+		if (dot == std::string::npos)
+			dot = name.size();
+
+		size_t llabel = dot - start;
+		if (llabel == 0 || llabel > NS_MAXLABEL)
+			return false;
+		wire->append(1, static_cast<char>(llabel));
+		wire->append(name, start, llabel);
+		start = dot + 1;
+	}
+
+	wire->append(1, '\0');
+	return wire->size() <= NS_MAXCDNAME;
+}
+
+// Return the key of @name and @type.
+static std::string make_key(const std::string &wire, uint16_t type)
+{
+	char key[Records::MAX_KEY];
+	return std::string(key, Records::Make_key(key, wire.data(),
+						  wire.size(), type));
+}
+
+// Add a resource record of @type with @rdata to the RRset of @name.
+static void add_rr(db_t &db, const std::string &name, uint16_t type,
+		   uint32_t ttl, const std::string &rdata)
+{
+	std::string wire;
+	name2wire(&wire, name);
+
+	// The owner name is a pointer to the QNAME.
+	std::string rr("\xC0\x0C", 2);
+	rr.append(1, type >> 8).append(1, type & 0xFF);
+	rr.append(1, ns_c_in >> 8).append(1, ns_c_in & 0xFF);
+	rr.append(1, ttl >> 24).append(1, (ttl >> 16) & 0xFF);
+	rr.append(1, (ttl >> 8) & 0xFF).append(1, ttl & 0xFF);
+	rr.append(1, rdata.size() >> 8).append(1, rdata.size() & 0xFF);
+	rr.append(rdata);
+
+	db[make_key(wire, type)].rrs.insert(rr);
+}
+
+// Return the name of the PTR record of @addr of @family.
+static std::string reverse_name(int family, const unsigned char *addr)
+{
+	std::ostringstream name;
+
+	if (family == AF_INET)
+	{
+		for (int i = 3; i >= 0; i--)
+			name << unsigned(addr[i]) << '.';
+		name << "in-addr.arpa";
+	} else
+	{
+		static const char hex[] = "0123456789abcdef";
+		for (int i = 15; i >= 0; i--)
+			name << hex[addr[i] & 0xF] << '.'
+			     << hex[addr[i] >> 4] << '.';
+		name << "ip6.arpa";
+	}
+
+	return name.str();
+}
+
+// Parse one line of the input.  Returns an error message or NULL.
+static const char *parse_line(db_t &db, const std::string &line,
+			      uint32_t dflt_ttl)
+{
+	std::istringstream in(line.substr(0, line.find_first_of("#;")));
+	std::vector<std::string> tokens;
+	for (std::string token; in >> token; )
+		tokens.push_back(token);
+	if (tokens.empty())
+		return NULL;
+
+	// Names are case-insensitive, but let's keep the trailing dot
+	// optional.
+	for (auto &token: tokens)
+		if (token.size() > 1 && token.back() == '.')
+			token.pop_back();
+
+	std::string wire;
+	unsigned char addr[16];
+	if (inet_pton(AF_INET, tokens[0].c_str(), addr) == 1
+	    || inet_pton(AF_INET6, tokens[0].c_str(), addr) == 1)
+	{	// hosts(5) line
+		bool is_v4 = inet_pton(AF_INET, tokens[0].c_str(), addr) == 1;
+		std::string rdata(reinterpret_cast<char *>(addr),
+				  is_v4 ? 4 : 16);
+
+		if (tokens.size() < 2)
+			return "missing host name";
+		for (size_t i = 1; i < tokens.size(); i++)
+		{
+			if (!name2wire(&wire, tokens[i]))
+				return "invalid host name";
+			add_rr(db, tokens[i], is_v4 ? ns_t_a : ns_t_aaaa,
+			       dflt_ttl, rdata);
+		}
+
+		name2wire(&wire, tokens[1]);
+		add_rr(db, reverse_name(is_v4 ? AF_INET : AF_INET6, addr),
+		       ns_t_ptr, dflt_ttl, wire);
+		return NULL;
+	}
+
+	// <name> [<TTL>] [IN] <type> <data>
+	size_t i = 1;
+	uint32_t ttl = dflt_ttl;
+	if (!name2wire(&wire, tokens[0]))
+		return "invalid name";
+	if (i < tokens.size() && isdigit(tokens[i][0]))
+		ttl = strtoul(tokens[i++].c_str(), NULL, 10);
+	if (i < tokens.size() && !strcasecmp(tokens[i].c_str(), "IN"))
+		i++;
+	if (i + 1 >= tokens.size())
+		return "missing type or data";
+
+	const char *type = tokens[i++].c_str();
+	if (!strcasecmp(type, "A") || !strcasecmp(type, "AAAA"))
+	{
+		bool is_v4 = !strcasecmp(type, "A");
+		if (inet_pton(is_v4 ? AF_INET : AF_INET6,
+			      tokens[i].c_str(), addr) != 1)
+			return "invalid address";
+		add_rr(db, tokens[0], is_v4 ? ns_t_a : ns_t_aaaa, ttl,
+		       std::string(reinterpret_cast<char *>(addr),
+				   is_v4 ? 4 : 16));
+	} else if (!strcasecmp(type, "PTR"))
+	{
+		std::string target;
+		if (!name2wire(&target, tokens[i]))
+			return "invalid PTR target";
+		add_rr(db, tokens[0], ns_t_ptr, ttl, target);
+	} else if (!strcasecmp(type, "TXT"))
+	{	// The rest of the line is a single character-string.
+		std::string text;
+		for (; i < tokens.size(); i++)
+			text += (text.empty() ? "" : " ") + tokens[i];
+		if (text.size() >= 2 && text.front() == '"'
+		    && text.back() == '"')
+			text = text.substr(1, text.size() - 2);
+		if (text.size() > 255)
+			return "TXT too long";
+		add_rr(db, tokens[0], ns_t_txt, ttl,
+		       std::string(1, static_cast<char>(text.size())) + text);
+	} else
+		return "unsupported type";
+
+	return NULL;
+}
+
+// Write @db to @fname atomically.  Returns false on error.
+static bool write_db(const db_t &db, const char *fname)
+{
+	// Lay out the file: header, index, keys, RRsets.
+	struct Records::header_st header = { };
+	memcpy(header.magic, Records::MAGIC, sizeof(header.magic));
+	header.byte_order = Records::BYTE_ORDER_MARK;
+	header.nentries = db.size();
+
+	std::vector<Records::entry_st> entries;
+	std::string keys, rrsets;
+	size_t keys_offset = sizeof(header)
+		+ db.size() * sizeof(Records::entry_st);
+	for (const auto &i: db)
+	{
+		struct Records::entry_st entry = { };
+		entry.hash = Records::Hash(i.first.data(), i.first.size());
+		entry.key_offset = keys_offset + keys.size();
+		entry.key_size = i.first.size();
+		entry.nrrs = i.second.rrs.size();
+		keys += i.first;
+
+		// Fix up @rrset_offset when @keys are complete.
+		entry.rrset_offset = rrsets.size();
+		for (const auto &rr: i.second.rrs)
+			rrsets += rr;
+		entry.rrset_size = rrsets.size() - entry.rrset_offset;
+		entries.push_back(entry);
+	}
+
+	for (auto &entry: entries)
+		entry.rrset_offset += keys_offset + keys.size();
+	header.size = keys_offset + keys.size() + rrsets.size();
+	if (header.size > std::numeric_limits<uint32_t>::max())
+	{
+		common::Log_error("Database too large");
+		return false;
+	}
+
+	// Sort by <hash, key> for Records::Lookup().
+	std::sort(entries.begin(), entries.end(),
+		  [&keys, keys_offset](const Records::entry_st &lhs,
+				       const Records::entry_st &rhs)
+		  {
+			  if (lhs.hash != rhs.hash)
+				  return lhs.hash < rhs.hash;
+			  return keys.compare(lhs.key_offset - keys_offset,
+					      lhs.key_size,
+					      keys,
+					      rhs.key_offset - keys_offset,
+					      rhs.key_size) < 0;
+		  });
+
+	// Write to a temporary file, then rename() it over @fname,
+	// so a running proxy can reload it any time.
+	std::string tmp = std::string(fname) + ".tmp";
+	std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char *>(entries.data()),
+		  entries.size() * sizeof(entries[0]));
+	out << keys << rrsets;
+	out.close();
+	if (!out)
+	{
+		common::Log_error("%s: write error", tmp.c_str());
+		return false;
+	} else if (rename(tmp.c_str(), fname) < 0)
+	{
+		common::Log_error("rename(%s): %m", fname);
+		return false;
+	}
+
+	return true;
+}
+
+// Parse one line of a blocklist.  Returns an error message or NULL.
+static const char *parse_blocked(std::vector<uint64_t> &hashes,
+				 const std::string &line)
+{
+	std::istringstream in(line.substr(0, line.find_first_of("#;")));
+	std::vector<std::string> tokens;
+	for (std::string token; in >> token; )
+		tokens.push_back(token);
+	if (tokens.empty())
+		return NULL;
+
+	// Skip the address of hosts(5) lines.
+	unsigned char addr[16];
+	std::string name = tokens[0];
+	if (inet_pton(AF_INET, name.c_str(), addr) == 1
+	    || inet_pton(AF_INET6, name.c_str(), addr) == 1)
+	{
+		if (tokens.size() < 2)
+			return "missing domain name";
+		name = tokens[1];
+	}
+
+	// Subdomains are always blocked.
+	if (name.compare(0, 2, "*.") == 0)
+		name.erase(0, 2);
+	if (name.size() > 1 && name.back() == '.')
+		name.pop_back();
+
+	std::string wire;
+	if (!name2wire(&wire, name))
+		return "invalid domain name";
+
+	// The first suffix is the full name.
+	uint64_t suffixes[Blocklist::MAX_LABELS];
+	if (Blocklist::Suffix_hashes(wire.data(), wire.size(), suffixes))
+		hashes.push_back(suffixes[0]);
+	return NULL;
+}
+
+// Write a blocklist of @hashes to @fname atomically.
+// Returns false on error.
+static bool write_blocklist(std::vector<uint64_t> &hashes, const char *fname)
+{
+	std::sort(hashes.begin(), hashes.end());
+	hashes.erase(std::unique(hashes.begin(), hashes.end()),
+		     hashes.end());
+
+	// The number of 64-bit words in the Bloom filter must be
+	// a power of 2.
+	uint64_t nwords = 1;
+	while (nwords * 64 < hashes.size() * BLOOM_BITS_PER_NAME)
+		nwords *= 2;
+
+	std::vector<uint64_t> bloom(nwords);
+	for (auto hash: hashes)
+		for (unsigned i = 0; i < BLOOM_HASHES; i++)
+		{
+			uint64_t bit = Blocklist::Bloom_bit(hash, i,
+							    nwords * 64);
+			bloom[bit / 64] |= 1ull << (bit % 64);
+		}
+
+	struct Blocklist::header_st header = { };
+	memcpy(header.magic, Blocklist::MAGIC, sizeof(header.magic));
+	header.byte_order = Blocklist::BYTE_ORDER_MARK;
+	header.nhashes = BLOOM_HASHES;
+	header.bloom_words = nwords;
+	header.nnames = hashes.size();
+	header.size = sizeof(header)
+		+ (nwords + hashes.size()) * sizeof(uint64_t);
+
+	std::string tmp = std::string(fname) + ".tmp";
+	std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char *>(bloom.data()),
+		  bloom.size() * sizeof(bloom[0]));
+	out.write(reinterpret_cast<const char *>(hashes.data()),
+		  hashes.size() * sizeof(hashes[0]));
+	out.close();
+	if (!out)
+	{
+		common::Log_error("%s: write error", tmp.c_str());
+		return false;
+	} else if (rename(tmp.c_str(), fname) < 0)
+	{
+		common::Log_error("rename(%s): %m", fname);
+		return false;
+	}
+
+	return true;
+}
+
+// Print the usage to @out.
+static void usage(std::ostream &out)
+{
+	out << "Usage: " << program_invocation_short_name
+	    << " [-t <default-TTL>] <input> <output>\n"
+	    << "       " << program_invocation_short_name
+	    << " -b <input> <output>" << std::endl;
+}
+
+int main(int argc, char *const *argv)
+{
+	uint32_t ttl = DFLT_TTL;
+	bool blocklist = false;
+
+	int optchar;
+	while ((optchar = getopt(argc, argv, "ht:b")) != -1)
+		switch (optchar)
+		{
+		case 't':
+			ttl = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			blocklist = true;
+			break;
+		case 'h':
+			usage(std::cout);
+			return 0;
+		default:
+			usage(std::cerr);
+			return 1;
+		}
+
+	argv += optind;
+	if (!argv[0] || !argv[1])
+	{
+		usage(std::cerr);
+		return 1;
+	}
+
+	common::Init();
+
+	std::ifstream in(argv[0]);
+	if (!in)
+	{
+		common::Log_error("%s: %s", argv[0], strerror(errno));
+		return 1;
+	}
+
+	db_t db;
+	std::vector<uint64_t> hashes;
+	unsigned lineno = 0;
+	for (std::string line; std::getline(in, line); )
+	{
+		lineno++;
+		if (const char *error = blocklist
+					? parse_blocked(hashes, line)
+					: parse_line(db, line, ttl))
+		{
+			common::Log_error("%s:%u: %s",
+					  argv[0], lineno, error);
+			return 1;
+		}
+	}
+
+	if (blocklist)
+	{
+		if (!write_blocklist(hashes, argv[1]))
+			return 1;
+		common::Log_info("%zu domains written to %s",
+				 hashes.size(), argv[1]);
+		return 0;
+	}
+
+	if (!write_db(db, argv[1]))
+		return 1;
+
+	common::Log_info("%zu RRsets written to %s", db.size(), argv[1]);
+	return 0;
+}
+
+// End of mkdnsdb.cc
@@ -0,0 +1,522 @@
+// Regression and fuzz tests of the DNS message parser and the code looking
+// at the names it has validated, and tests of truncating responses and
+// lowering the EDNS payload size of queries.  "make test" builds this with
+// the address and undefined behavior sanitizers, so reading out of bounds
+// is caught even if it happens not to crash.
+//
+// Usage: parsertest [<iterations> [<seed>]]
+//        parsertest -b	(measure the throughput of Parse())
+
+// Include files
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+
+#include "common.h"
+#include "DNSMessage.h"
+#include "Records.h"
+#include "Blocklist.h"
+#include "Routes.h"
+#include "Synthesizer.h"
+
+// Defaults for command line options.
+#define DFLT_ITERATIONS			200000
+#define DFLT_SEED			1
+
+// A message the parser must accept or reject.
+struct case_st
+{
+	const char *what;
+	std::string msg;
+	bool valid;
+};
+
+static unsigned nfailed = 0;
+
+// Routes to some of the names of the regression cases.
+static Routes routes;
+
+// Answers the special-use names.
+static Synthesizer synthesizer;
+
+// Program code
+static void check(bool ok, const char *what, const char *how)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "FAIL: %s: %s\n", what, how);
+	nfailed++;
+}
+
+// Return @name in presentation format as a wire-format name.
+static std::string wire(const char *name)
+{
+	std::string out;
+
+	while (*name)
+	{
+		const char *dot = strchr(name, '.');
+		size_t llabel = dot ? dot - name : strlen(name);
+		out += static_cast<char>(llabel);
+		out.append(name, llabel);
+		name += llabel + (dot ? 1 : 0);
+	}
+
+	return out + '\0';
+}
+
+// Return a message with the header fields given, followed by @body.
+static std::string message(unsigned qdcount, unsigned arcount,
+			   const std::string &body)
+{
+	const char header[NS_HFIXEDSZ] =
+	{
+		0x12, 0x34,		// ID
+		0x01, 0x00,		// RD
+		0, static_cast<char>(qdcount),
+		0, 0,
+		0, 0,
+		0, static_cast<char>(arcount),
+	};
+
+	return std::string(header, sizeof(header)) + body;
+}
+
+// Return a query of @qname, a wire-format name, with an OPT record
+// if @edns.
+static std::string query(const std::string &qname, bool edns = false,
+			 uint16_t qtype = ns_t_a)
+{
+	const char question[] =
+	{
+		static_cast<char>(qtype >> 8), static_cast<char>(qtype),
+		0, ns_c_in,
+	};
+	static const char opt[] =
+	{
+		0, 0, ns_t_opt, 0x10, 0x00, 0, 0, 0, 0, 0, 0,
+	};
+
+	std::string body = qname + std::string(question, sizeof(question));
+	if (edns)
+		body += std::string(opt, sizeof(opt));
+	return message(1, edns ? 1 : 0, body);
+}
+
+// Return a response to query() of @qname with @nanswers A records,
+// an OPT record with @udp_size if it's not 0, and a TSIG record
+// if @signed_.
+static std::string response(const std::string &qname, unsigned nanswers,
+			    uint16_t udp_size = 0, bool signed_ = false)
+{
+	static const char a[] =
+	{
+		'\xC0', NS_HFIXEDSZ, 0, ns_t_a, 0, ns_c_in,
+		0, 0, 0, 60, 0, 4,
+		10, 0, 0, 1,
+	};
+	const char opt[] =
+	{
+		0, 0, ns_t_opt,
+		static_cast<char>(udp_size >> 8), static_cast<char>(udp_size),
+		0, 0, 0, 0, 0, 0,
+	};
+	// Only the layout of the record matters to Parse().
+	static const char tsig[] =
+	{
+		0, 0, static_cast<char>(ns_t_tsig),
+		0, static_cast<char>(ns_c_any),
+		0, 0, 0, 0, 0, 0,
+	};
+
+	std::string msg = query(qname);
+	for (unsigned i = 0; i < nanswers; i++)
+		msg += std::string(a, sizeof(a));
+	if (udp_size)
+		msg += std::string(opt, sizeof(opt));
+	if (signed_)
+		msg += std::string(tsig, sizeof(tsig));
+
+	auto header = reinterpret_cast<DNSMessage::dns_header_st *>(&msg[0]);
+	header->qr = 1;
+	header->ancount = htons(nanswers);
+	header->arcount = htons((udp_size ? 1 : 0) + (signed_ ? 1 : 0));
+	return msg;
+}
+
+// Exercise everything which looks at the names of a message the parser
+// has accepted, and check what the parser says about it.
+static void look_at(const char *what, const DNSMessage &view)
+{
+	char key[Records::MAX_KEY];
+	uint64_t hashes[Blocklist::MAX_LABELS];
+
+	check(view.question_begin == NS_HFIXEDSZ
+	      && view.question_begin <= view.question_end
+	      && view.question_end <= view.size,
+	      what, "question section out of the message");
+	check(view.opt_begin <= view.opt_end && view.opt_end <= view.size,
+	      what, "OPT record out of the message");
+	if (!view.Qdcount())
+		return;
+
+	check(view.qname_begin == view.question_begin
+	      && view.qname_end <= view.question_end,
+	      what, "QNAME out of the question section");
+	check(DNSMessage::Name_size(view.Qname(), view.Qname_size())
+	      == view.Qname_size(), what, "QNAME size mismatch");
+	check(view.Qname_size() + NS_INT16SZ <= sizeof(key),
+	      what, "QNAME too long for a records key");
+
+	DNSMessage::Name_str(view.Qname(), view.Qname_size());
+	Records::Make_key(key, view.Qname(), view.Qname_size(), view.qtype);
+	Blocklist::Suffix_hashes(view.Qname(), view.Qname_size(), hashes);
+	routes.Lookup(view.Qname(), view.Qname_size());
+
+	// The synthesized response must be valid too.
+	std::vector<char> response;
+	DNSMessage answer;
+	if (view.Qdcount() == 1 && view.qclass == ns_c_in
+	    && synthesizer.Answer(view, response))
+		check(!answer.Parse(&response[0], response.size()),
+		      what, "invalid synthesized response");
+
+	// Flipping the case twice must restore the name.
+	std::vector<char> qname(view.Qname(), view.Qname() + view.Qname_size());
+	DNSMessage::Flip_case(&qname[0], qname.size(), ~0ull);
+	check(DNSMessage::Equal_nocase(&qname[0], view.Qname(), qname.size()),
+	      what, "Flip_case() changed more than the case");
+	DNSMessage::Flip_case(&qname[0], qname.size(), ~0ull);
+	check(!memcmp(&qname[0], view.Qname(), qname.size()),
+	      what, "Flip_case() isn't its own inverse");
+}
+
+// Parse @msg from a buffer of its exact size, so the sanitizers catch
+// any access past its end.  Returns whether it was accepted.
+static bool parse(const char *what, const std::string &msg)
+{
+	DNSMessage view;
+	std::vector<char> buf(msg.begin(), msg.end());
+
+	// An empty vector may not have a buffer at all.
+	if (buf.empty())
+		return !view.Parse("", 0);
+	if (view.Parse(&buf[0], buf.size()) != NULL)
+		return false;
+	look_at(what, view);
+	return true;
+}
+
+static std::vector<struct case_st> regression_cases()
+{
+	std::string long_name;
+	for (unsigned i = 0; i < 4; i++)
+		long_name += std::string(1, 63) + std::string(63, 'a');
+	std::string longest_name;
+	for (unsigned i = 0; i < 3; i++)
+		longest_name += std::string(1, 63) + std::string(63, 'a');
+	longest_name += std::string(1, 61) + std::string(61, 'a');
+
+	return std::vector<struct case_st>
+	{
+		{ "plain query", query(wire("www.example.com")), true },
+		{ "query of the root", query(wire("")), true },
+		{ "query with EDNS", query(wire("example.com"), true), true },
+		{ "no questions", message(0, 0, ""), true },
+		{ "longest QNAME", query(longest_name + '\0'), true },
+
+		// A pointer at the end of the QNAME is skipped by the
+		// parser, so everything looking at the name must stop
+		// there.
+		{ "compressed QNAME",
+		  query(std::string("\3www\xC0\x0C", 6)), true },
+		{ "QNAME of just a pointer",
+		  query(std::string("\xC0\x0C", 2)), true },
+		{ "compressed QNAME with a long label before",
+		  query(std::string(1, 63) + std::string(63, 'a')
+			+ "\xC0\x0C"), true },
+
+		{ "incomplete header", std::string("\x12\x34\x01", 3), false },
+		{ "empty message", std::string(), false },
+		{ "unterminated QNAME",
+		  message(1, 0, std::string("\3www\7example", 12)), false },
+		{ "truncated label",
+		  message(1, 0, std::string("\3www\7exa", 8)), false },
+		{ "truncated compression pointer",
+		  message(1, 0, std::string("\3www\xC0", 5)), false },
+		{ "truncated QTYPE",
+		  message(1, 0, wire("example.com") + '\0'), false },
+		{ "invalid label type",
+		  query(std::string("\x43" "abc", 4) + '\0'), false },
+		{ "QNAME too long", query(long_name + '\0'), false },
+		{ "more questions than there are",
+		  message(2, 0, query(wire("a.b")).substr(NS_HFIXEDSZ)),
+		  false },
+		{ "truncated OPT record",
+		  query(wire("example.com"), true).substr(0, 38), false },
+	};
+}
+
+// Check what is done to the size of messages on the way through: responses
+// over the client's UDP payload size are cut down unless they're signed,
+// and the payload size of queries is lowered to --edns-size if it's given.
+static void test_udp_size()
+{
+	const std::string qname = wire("www.example.com");
+	const struct
+	{
+		const char *what;
+		std::string msg;
+		size_t limit;
+		bool cut;
+	} responses[] =
+	{
+		{ "response within the UDP size",
+		  response(qname, 10), NS_PACKETSZ, false },
+		{ "response over the UDP size",
+		  response(qname, 40), NS_PACKETSZ, true },
+		{ "response with EDNS over the UDP size",
+		  response(qname, 100, 1232), 1232, true },
+		{ "signed response over the UDP size",
+		  response(qname, 40, 0, true), NS_PACKETSZ, false },
+		{ "signed response with EDNS over the UDP size",
+		  response(qname, 100, 1232, true), 1232, false },
+	};
+
+	for (const auto &test: responses)
+	{
+		std::vector<char> buf(test.msg.begin(), test.msg.end());
+		DNSMessage view, cut;
+
+		if (view.Parse(&buf[0], buf.size()))
+		{
+			check(false, test.what, "rejected");
+			continue;
+		}
+
+		// The view is invalid after Truncate().
+		const uint16_t udp_size = view.udp_size;
+		const size_t question_size = view.Question_size();
+		const size_t size = view.Truncate(test.limit);
+		if (!test.cut)
+		{
+			check(size == test.msg.size()
+			      && !memcmp(&buf[0], test.msg.data(), size),
+			      test.what, "modified");
+			continue;
+		}
+
+		check(size < test.msg.size() && size <= test.limit,
+		      test.what, "not cut down to the UDP size");
+		if (cut.Parse(&buf[0], size))
+			check(false, test.what, "cut down to garbage");
+		else
+			check(cut.Header()->tc && !cut.Header()->ancount
+			      && cut.Question_size() == question_size
+			      && cut.udp_size == udp_size,
+			      test.what, "not truncated properly");
+	}
+
+	const struct
+	{
+		const char *what;
+		std::string msg;
+		uint16_t edns_size, udp_size;
+	} queries[] =
+	{
+		{ "query without --edns-size",
+		  query(qname, true), 0, 4096 },
+		{ "query over --edns-size",
+		  query(qname, true), 1232, 1232 },
+		{ "query within --edns-size",
+		  query(qname, true), 8192, 4096 },
+		{ "query without EDNS",
+		  query(qname), 1232, 0 },
+		{ "signed query over --edns-size",
+		  response(qname, 0, 4096, true), 1232, 4096 },
+	};
+
+	for (const auto &test: queries)
+	{
+		std::vector<char> buf(test.msg.begin(), test.msg.end());
+		DNSMessage view, lowered;
+
+		if (view.Parse(&buf[0], buf.size()))
+		{
+			check(false, test.what, "rejected");
+			continue;
+		}
+
+		bool changed = test.edns_size
+			&& view.Limit_udp_size(test.edns_size);
+		check(!lowered.Parse(&buf[0], buf.size())
+		      && lowered.udp_size == test.udp_size,
+		      test.what, "wrong payload size");
+		check(changed == (test.udp_size != 0
+				  && test.udp_size == test.edns_size),
+		      test.what, "wrong return value");
+		if (!changed)
+			check(!memcmp(&buf[0], test.msg.data(), buf.size()),
+			      test.what, "modified");
+	}
+}
+
+// Derive a random message from one of the @seeds: flip, insert, delete
+// or overwrite bytes, or cut it short.
+static std::string mutate(const std::vector<std::string> &seeds,
+			  std::default_random_engine &rnd)
+{
+	std::string msg = seeds[rnd() % seeds.size()];
+	unsigned nmutations = 1 + rnd() % 4;
+
+	for (unsigned i = 0; i < nmutations; i++)
+	{
+		size_t at = msg.empty() ? 0 : rnd() % msg.size();
+		switch (rnd() % 6)
+		{
+		case 0:
+			if (!msg.empty())
+				msg[at] ^= 1 << (rnd() % 8);
+			break;
+		case 1:
+			msg.insert(at, 1, static_cast<char>(rnd()));
+			break;
+		case 2:
+			if (!msg.empty())
+				msg.erase(at, 1);
+			break;
+		case 3:	// Label lengths and pointers are the interesting
+			// values.
+			if (!msg.empty())
+			{
+				static const char bytes[] =
+				{
+					0, 1, 63, 64, '\x3F', '\x80',
+					'\xC0', '\xFF',
+				};
+				msg[at] = bytes[rnd() % sizeof(bytes)];
+			}
+			break;
+		case 4:
+			msg.resize(at);
+			break;
+		case 5:	// Header counts.
+			if (msg.size() >= NS_HFIXEDSZ)
+				msg[5 + 2 * (rnd() % 4)] = rnd() % 4;
+			break;
+		}
+	}
+
+	return msg;
+}
+
+// Measure how long Parse() takes on a typical query.
+static void benchmark()
+{
+	const unsigned n = 10000000;
+	const std::string msg = query(wire("www.example.com"), true);
+	unsigned nvalid = 0;
+	DNSMessage view;
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < n; i++)
+		nvalid += !view.Parse(msg.data(), msg.size());
+	std::chrono::duration<double, std::nano> elapsed =
+		std::chrono::steady_clock::now() - start;
+
+	printf("Parse(): %.1fns per query (%u parsed)\n",
+	       elapsed.count() / n, nvalid);
+}
+
+int main(int argc, char *const *argv)
+{
+	unsigned long iterations = DFLT_ITERATIONS;
+	unsigned seed = DFLT_SEED;
+
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+	{
+		benchmark();
+		return 0;
+	}
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		seed = strtoul(argv[2], NULL, 0);
+
+	routes.Add("www", 1);
+	routes.Add("example.com", 2);
+	check(routes.Lookup(wire("www.example.com").data(),
+			    wire("www.example.com").size()) == 2,
+	      "routed QNAME", "wrong route");
+
+	// The suffix of a compressed name is unknown, so it mustn't be
+	// routed by the labels before the pointer.
+	check(routes.Lookup("\3www\xC0\x0C", 6) == Routes::NO_ROUTE,
+	      "routed compressed QNAME", "routed by its first label");
+
+	// Nor can it be checked against the blocklist.
+	uint64_t hashes[Blocklist::MAX_LABELS];
+	check(Blocklist::Suffix_hashes(wire("www.example").data(),
+				       wire("www.example").size(), hashes) == 2
+	      && !Blocklist::Suffix_hashes("wwwexampleÀ", 14,
+					   hashes),
+	      "hashed compressed QNAME", "hashed as a complete name");
+
+	// 127.0.0.1 is localhost, other addresses in its reverse zone
+	// don't exist.
+	synthesizer.Add("special-use");
+	for (const auto &test: std::vector<case_st>
+	     {
+		{ "localhost PTR",
+		  query(wire("1.0.0.127.in-addr.arpa"), false, ns_t_ptr),
+		  true },
+		{ "loopback PTR",
+		  query(wire("2.0.0.127.in-addr.arpa"), false, ns_t_ptr),
+		  false },
+	     })
+	{
+		DNSMessage view, answer;
+		std::vector<char> response;
+
+		view.Parse(test.msg.data(), test.msg.size());
+		if (!synthesizer.Answer(view, response)
+		    || answer.Parse(&response[0], response.size()))
+			check(false, test.what, "not answered");
+		else if (test.valid)
+			check(answer.Header()->rcode == ns_r_noerror
+			      && ntohs(answer.Header()->ancount) == 1,
+			      test.what, "not answered with localhost");
+		else
+			check(answer.Header()->rcode == ns_r_nxdomain,
+			      test.what, "not answered with NXDOMAIN");
+	}
+
+	test_udp_size();
+
+	std::vector<std::string> seeds;
+	for (const auto &test: regression_cases())
+	{
+		check(parse(test.what, test.msg) == test.valid, test.what,
+		      test.valid ? "rejected" : "accepted");
+		seeds.push_back(test.msg);
+	}
+
+	std::default_random_engine rnd(seed);
+	unsigned long nvalid = 0;
+	for (unsigned long i = 0; i < iterations; i++)
+		nvalid += parse("fuzzed message", mutate(seeds, rnd));
+
+	printf("%zu regression cases, %lu fuzzed messages (%lu valid, "
+	       "seed %u): %u failures\n", seeds.size(), iterations, nvalid,
+	       seed, nfailed);
+	return nfailed ? 1 : 0;
+}
+
+// End of parsertest.cc